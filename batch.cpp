@@ -0,0 +1,257 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "clip.h"
+#include "logger.h"
+#include "probe.h"
+#include "project.h"
+#include "remote.h"
+
+Batch_Runner::Batch_Runner(int concurrent_jobs, int threads_per_job)
+{
+	int cores = std::max(1u, std::thread::hardware_concurrency());
+	this->concurrent_jobs = std::max(1, concurrent_jobs);
+	this->threads_per_job = threads_per_job > 0 ? threads_per_job : std::max(1, cores / this->concurrent_jobs);
+}
+
+void Batch_Runner::add(const std::string& project, const std::string& output)
+{
+	Batch_Job job;
+	job.project = project;
+	job.output = output;
+	if (job.output.empty()) {
+		size_t dot = project.find_last_of('.');
+		size_t slash = project.find_last_of('/');
+		job.output = (dot != std::string::npos && (slash == std::string::npos || dot > slash) ? project.substr(0, dot) : project) + ".mp4";
+	}
+	this->jobs.push_back(job);
+}
+
+int Batch_Runner::add_queue(const std::string& filename)
+{
+	std::ifstream in(filename);
+	if (!in) {
+		Logger::get("error") << "Could not open queue " << filename << "\n";
+		return AVERROR(ENOENT);
+	}
+	std::string line;
+	while (std::getline(in, line)) {
+		std::istringstream fields(line);
+		std::string project, output;
+		if (!(fields >> project) || project[0] == '#')
+			continue;
+		fields >> output;
+		add(project, output);
+	}
+	return 0;
+}
+
+void Batch_Runner::set_workers(int workers, const std::string& executable)
+{
+	this->workers = workers;
+	this->executable = executable;
+}
+
+int Batch_Runner::run()
+{
+	this->start_time = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (int i = 0; i < this->concurrent_jobs && i < (int) this->jobs.size(); ++i)
+		workers.push_back(std::thread(&Batch_Runner::work, this));
+
+	// reports progress until the last job finishes
+	{
+		std::unique_lock<std::mutex> lock(this->jobs_mutex);
+		auto all_finished = [this] {
+			return std::all_of(this->jobs.begin(), this->jobs.end(), [](const Batch_Job& job) { return job.finished; });
+		};
+		while (!this->job_finished.wait_for(lock, report_interval, all_finished)) {
+			for (const Batch_Job& job : this->jobs)
+				if (job.exporter != nullptr)
+					Logger::get("batch") << job.project << ": " << (int) (job.exporter->get_progress() * 100) << "%\n";
+		}
+	}
+	for (std::thread& worker : workers)
+		worker.join();
+	this->elapsed_secs = std::chrono::duration_cast<std::chrono::duration<float>>(std::chrono::steady_clock::now() - this->start_time).count();
+
+	return std::count_if(this->jobs.begin(), this->jobs.end(), [](const Batch_Job& job) { return job.error < 0; });
+}
+
+void Batch_Runner::work()
+{
+	while (true) {
+		int i = this->next_job++;
+		if (i >= (int) this->jobs.size())
+			return;
+		render(&this->jobs[i]);
+		{
+			std::lock_guard<std::mutex> lock(this->jobs_mutex);
+			this->jobs[i].finished = true;
+		}
+		this->job_finished.notify_one();
+	}
+}
+
+void Batch_Runner::render(Batch_Job* job)
+{
+	auto job_start = std::chrono::steady_clock::now();
+	Export_Settings settings;
+	settings.filename = job->output;
+	settings.smart_render = true;
+	// the job's threads go to encoding segments side by side, one encoder thread each
+	settings.threads = 1;
+	std::unique_ptr<Segmented_Exporter> exporter;
+	int ret = 0;
+	if (this->workers > 0) {
+		// every job gets its own socket and workers
+		std::string address = local_worker_address("render-" + std::to_string(job - &this->jobs[0]));
+		Distributed_Exporter* distributed = new Distributed_Exporter(settings, address, this->workers);
+		exporter.reset(distributed);
+		ret = distributed->spawn_local_workers(this->executable);
+	} else {
+		exporter.reset(new Segmented_Exporter(settings, this->threads_per_job));
+	}
+	exporter->set_decoder_pool(&this->decoder_pool);
+
+	// the timeline only lives long enough to be copied, its decoders go back to the pool for the segments
+	if (ret >= 0) {
+		Video video;
+		video.set_decoder_pool(&this->decoder_pool);
+		video.set_realtime(false);
+		ret = load_project(job->project, &video);
+		if (ret >= 0) {
+			exporter->load(&video);
+			job->duration_secs = video.get_duration_secs();
+		}
+	}
+
+	if (ret >= 0) {
+		Logger::get("batch") << "rendering " << job->project << " to " << job->output << "\n";
+		ret = exporter->start();
+	}
+	if (ret >= 0) {
+		{
+			std::lock_guard<std::mutex> lock(this->jobs_mutex);
+			job->exporter = exporter.get();
+		}
+		ret = exporter->wait();
+	}
+
+	std::lock_guard<std::mutex> lock(this->jobs_mutex);
+	job->exporter = nullptr;
+	job->error = ret;
+	job->stats = exporter->get_stats();
+	job->elapsed_secs = std::chrono::duration_cast<std::chrono::duration<float>>(std::chrono::steady_clock::now() - job_start).count();
+	if (ret < 0)
+		Logger::get("error") << job->project << " failed: " << av_err2str(ret) << "\n";
+	else
+		Logger::get("batch") << "finished " << job->project << " in " << job->elapsed_secs << "s\n";
+}
+
+static std::string json_string(const std::string& value)
+{
+	std::ostringstream out;
+	out << '"';
+	for (char c : value) {
+		if (c == '"' || c == '\\')
+			out << '\\' << c;
+		else if ((unsigned char) c < 0x20)
+			out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int) c << std::dec;
+		else
+			out << c;
+	}
+	out << '"';
+	return out.str();
+}
+
+void Batch_Runner::write_summary(std::ostream& out)
+{
+	std::lock_guard<std::mutex> lock(this->jobs_mutex);
+	Probe_Stats probe_stats = Probe_Cache::shared().get_stats();
+	Decoder_Pool_Stats pool_stats = this->decoder_pool.get_stats();
+
+	out << "{\n";
+	out << "  \"concurrent_jobs\": " << this->concurrent_jobs << ",\n";
+	out << "  \"threads_per_job\": " << this->threads_per_job << ",\n";
+	out << "  \"elapsed_secs\": " << this->elapsed_secs << ",\n";
+	out << "  \"probe_cache\": {\"probes\": " << probe_stats.probes << ", \"hits\": " << probe_stats.hits << "},\n";
+	out << "  \"decoder_pool\": {\"reused\": " << pool_stats.reused << ", \"misses\": " << pool_stats.misses << ", \"evictions\": " << pool_stats.evictions << "},\n";
+	out << "  \"jobs\": [";
+	for (size_t i = 0; i < this->jobs.size(); ++i) {
+		const Batch_Job& job = this->jobs[i];
+		int frames = job.stats.frames_composited + job.stats.frames_copied;
+		float fps = job.elapsed_secs > 0 ? frames / job.elapsed_secs : 0;
+		float realtime_factor = job.elapsed_secs > 0 ? job.duration_secs / job.elapsed_secs : 0;
+		out << (i > 0 ? ",\n" : "\n") << "    {";
+		out << "\"project\": " << json_string(job.project) << ", ";
+		out << "\"output\": " << json_string(job.output) << ", ";
+		out << "\"ok\": " << (job.finished && job.error >= 0 ? "true" : "false") << ", ";
+		if (job.error < 0)
+			out << "\"error\": " << json_string(av_err2str(job.error)) << ", ";
+		out << "\"duration_secs\": " << job.duration_secs << ", ";
+		out << "\"elapsed_secs\": " << job.elapsed_secs << ", ";
+		out << "\"frames\": " << frames << ", ";
+		out << "\"frames_copied\": " << job.stats.frames_copied << ", ";
+		out << "\"frames_repeated\": " << job.stats.frames_repeated << ", ";
+		out << "\"segments\": " << job.stats.segments << ", ";
+		out << "\"fps\": " << fps << ", ";
+		out << "\"realtime_factor\": " << realtime_factor << "}";
+	}
+	out << "\n  ]\n}\n";
+}
+
+int run_batch(const char* executable, int argc, char* argv[])
+{
+	Logger::addCategory("batch");
+
+	int concurrent_jobs = 1;
+	int threads_per_job = 0;
+	int workers = 0;
+	std::string summary_filename;
+	std::vector<std::string> queues;
+	std::vector<std::string> projects;
+	for (int i = 0; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (arg == "--jobs" && has_value)
+			concurrent_jobs = std::atoi(argv[++i]);
+		else if (arg == "--threads" && has_value)
+			threads_per_job = std::atoi(argv[++i]);
+		else if (arg == "--workers" && has_value)
+			workers = std::atoi(argv[++i]);
+		else if (arg == "--summary" && has_value)
+			summary_filename = argv[++i];
+		else if (arg == "--queue" && has_value)
+			queues.push_back(argv[++i]);
+		else if (arg.size() > 0 && arg[0] == '-') {
+			std::cerr << "usage: --batch [--jobs n] [--threads n] [--workers n] [--summary file.json] [--queue file] [project ...]\n";
+			return 2;
+		} else
+			projects.push_back(arg);
+	}
+
+	Batch_Runner runner(concurrent_jobs, threads_per_job);
+	runner.set_workers(workers, executable);
+	for (const std::string& queue : queues)
+		if (runner.add_queue(queue) < 0)
+			return 1;
+	for (const std::string& project : projects)
+		runner.add(project, "");
+
+	int failed = runner.run();
+	if (summary_filename.empty()) {
+		runner.write_summary(std::cout);
+	} else {
+		std::ofstream out(summary_filename);
+		runner.write_summary(out);
+	}
+	return failed > 0 ? 1 : 0;
+}
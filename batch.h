@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "decoders.h"
+#include "export.h"
+
+struct Batch_Job {
+	std::string project;
+	std::string output;
+
+	int error = 0;
+	Export_Stats stats;
+	float duration_secs = 0;
+	float elapsed_secs = 0;
+	bool finished = false;
+	// only while rendering, guarded by the runner's jobs_mutex
+	Segmented_Exporter* exporter = nullptr;
+};
+
+// renders a queue of projects without a window, a few at a time
+// every job shares the probe cache and one decoder pool, so projects cut from the same footage open it once
+class Batch_Runner {
+public:
+	// how often progress is logged while jobs run
+	static constexpr std::chrono::milliseconds report_interval{2000};
+
+	// threads_per_job is how many segments of a job encode at once, 0 splits the cores between the jobs
+	Batch_Runner(int concurrent_jobs, int threads_per_job);
+
+	// output defaults to the project with an .mp4 extension
+	void add(const std::string& project, const std::string& output);
+	// one job per line, the project and optionally its output separated by whitespace
+	int add_queue(const std::string& filename);
+	// renders each job's segments in this many worker processes of executable instead of threads
+	void set_workers(int workers, const std::string& executable);
+
+	// blocks until every job is done, returns how many failed
+	int run();
+	// per-job throughput as JSON
+	void write_summary(std::ostream& out);
+
+protected:
+	int concurrent_jobs;
+	int threads_per_job;
+	int workers = 0;
+	std::string executable;
+	Decoder_Pool decoder_pool;
+
+	std::mutex jobs_mutex;
+	std::condition_variable job_finished;
+	std::vector<Batch_Job> jobs;
+	std::atomic_int next_job{0};
+	std::chrono::steady_clock::time_point start_time;
+	float elapsed_secs = 0;
+
+	void work();
+	void render(Batch_Job* job);
+};
+
+// entry point for main --batch, arguments after the flag
+// executable is what worker processes are started from
+int run_batch(const char* executable, int argc, char* argv[]);
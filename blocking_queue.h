@@ -0,0 +1,73 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+// bounded queue between pipeline stages, any number of producer and consumer threads
+// a full queue blocks the producer, so a slow stage holds back the ones before it
+template <typename T>
+class Blocking_Queue {
+public:
+	explicit Blocking_Queue(size_t capacity) : capacity(capacity) {}
+	Blocking_Queue(const Blocking_Queue&) = delete;
+	void operator=(const Blocking_Queue&) = delete;
+
+	// blocks while full, false if the queue was closed and the item wasn't taken
+	bool push(T item)
+	{
+		std::unique_lock<std::mutex> lock(this->mutex);
+		this->not_full.wait(lock, [this] { return this->items.size() < this->capacity || this->closed; });
+		if (this->closed)
+			return false;
+		this->items.push_back(item);
+		lock.unlock();
+		this->not_empty.notify_one();
+		return true;
+	}
+
+	// blocks while empty, false once the queue is closed and drained
+	bool pop(T* item)
+	{
+		std::unique_lock<std::mutex> lock(this->mutex);
+		this->not_empty.wait(lock, [this] { return this->items.size() > 0 || this->closed; });
+		if (this->items.size() == 0)
+			return false;
+		*item = this->items.front();
+		this->items.pop_front();
+		lock.unlock();
+		this->not_full.notify_one();
+		return true;
+	}
+
+	// no more pushes, consumers still get what's queued
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->closed = true;
+		}
+		this->not_full.notify_all();
+		this->not_empty.notify_all();
+	}
+
+	// takes whatever is left, for freeing after the consumers are gone
+	bool try_pop(T* item)
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		if (this->items.size() == 0)
+			return false;
+		*item = this->items.front();
+		this->items.pop_front();
+		return true;
+	}
+
+protected:
+	size_t capacity;
+	std::mutex mutex;
+	std::condition_variable not_full;
+	std::condition_variable not_empty;
+	std::deque<T> items;
+	bool closed = false;
+};
@@ -1,5 +1,6 @@
 #include "clip.h"
 
+#include <algorithm>
 #include <iomanip>
 #include <numeric>
 #include <sstream>
@@ -8,7 +9,9 @@ extern "C" {
 #include "libavutil/opt.h"
 }
 
+#include "decoders.h"
 #include "logger.h"
+#include "probe.h"
 
 std::ostream& operator<<(std::ostream& out, const TransitionEffect value){
 	const char* s = 0;
@@ -33,8 +36,6 @@ std::ostream& operator<<(std::ostream& out, const FilterEffect value){
 		SWITCH_VAL(FilterEffect::RGB);
 		SWITCH_VAL(FilterEffect::SoloTrack);
 		SWITCH_VAL(FilterEffect::OverlayTrack);
-		SWITCH_VAL(FilterEffect::AudioMix);
-		SWITCH_VAL(FilterEffect::AudioPrep);
 	}
 #undef SWITCH_VAL
 	return out << s;
@@ -62,28 +63,6 @@ std::string get_buffersink_str(const std::string& input_name)
 	return ss.str();
 }
 
-std::string get_abuffer_str(const Decoder_Ctx* decoder, const std::string& output_name)
-{
-	const AVCodecContext* audio_ctx = decoder->get_audio_context();
-	const AVStream* audio_stream = decoder->get_audio_stream();
-
-	std::stringstream ss;
-	ss << "abuffer=";
-	ss << "time_base=" << audio_stream->time_base.num << "/" << audio_stream->time_base.den << ":";
-	ss << "sample_rate=" << audio_ctx->sample_rate << ":";
-	ss << "sample_fmt=" << audio_ctx->sample_fmt << ":";
-	ss << "channel_layout=" << audio_ctx->channel_layout << " ";
-	ss << "[" << output_name << "];";
-	return ss.str();
-}
-
-std::string get_abuffersink_str(const std::string& input_name)
-{
-	std::stringstream ss;
-	ss << "[" << input_name << "] abuffersink";
-	return ss.str();
-}
-
 
 Filter* Filter::FadeOut(const Decoder_Ctx* decoder, float duration)
 {
@@ -173,39 +152,6 @@ Filter* Filter::OverlayTrack(const Decoder_Ctx* decoder1, const Decoder_Ctx* dec
 	return new Filter(FilterEffect::OverlayTrack, filter_str.str());
 }
 
-Filter* Filter::AudioMix(const Decoder_Ctx* decoder1, const Decoder_Ctx* decoder2)
-{
-	std::string buffer1_str = get_abuffer_str(decoder1, "in_1");
-	std::string buffer2_str = get_abuffer_str(decoder2, "in_2");
-	std::string sink_str = get_abuffersink_str("result");
-
-	std::stringstream filter_str;
-	filter_str << buffer1_str;
-	filter_str << buffer2_str;
-	filter_str << "[in_1] volume=0.8 [v1];";
-	filter_str << "[in_2] volume=2.5 [v2];";
-	filter_str << "[v1] [v2] amix [mixed];";
-	filter_str << "[mixed] aresample=osr=44100:ocl=stereo:osf=s16 [result];";
-	filter_str << sink_str;
-
-	Logger::get("overlay") << "audiomix filter: " << filter_str.str() << "\n";
-	return new Filter(FilterEffect::AudioMix, filter_str.str());
-}
-
-Filter* Filter::AudioPrep(const Decoder_Ctx* decoder)
-{
-	std::string buffer1_str = get_abuffer_str(decoder, "in_1");
-	std::string sink_str = get_abuffersink_str("result");
-
-	std::stringstream filter_str;
-	filter_str << buffer1_str;
-	filter_str << "[in_1] aresample=osr=44100:ocl=stereo:osf=s16 [result];";
-	filter_str << sink_str;
-
-	Logger::get("overlay") << "audioprep filter: " << filter_str.str() << "\n";
-	return new Filter(FilterEffect::AudioPrep, filter_str.str());
-}
-
 Filter::Filter(FilterEffect effect, const std::string& filter_str)
 {
 	this->effect = effect;
@@ -381,7 +327,7 @@ FilePiece::FilePiece(std::string filename, float video_start_secs)
 	this->filename = filename;
 	this->video_start_secs = video_start_secs;
 	this->file_start_secs = 0;
-	this->duration_secs = Decoder_Ctx::get_duration_secs(filename);
+	this->duration_secs = Probe_Cache::shared().get_duration_secs(filename);
 }
 
 FilePiece::FilePiece(std::string filename, float video_start_secs, float file_start_secs, float duration_secs)
@@ -400,7 +346,7 @@ FilePiece::FilePiece(const FilePiece& fp)
 	this->duration_secs = fp.duration_secs;
 }
 
-FilePiece FilePiece::with_duration(float duration_secs)
+FilePiece FilePiece::with_duration(float duration_secs) const
 {
 	return FilePiece(this->filename, this->video_start_secs, this->file_start_secs, duration_secs);
 }
@@ -438,31 +384,45 @@ Track::Track(Video* video, FilePiece file_piece, TransitionEffect effect)
 	add(file_piece, effect);
 }
 
-struct FilePiece_Compare
+Track::~Track()
 {
-	bool operator()( const FilePiece& lhs, const FilePiece& rhs ) const {
-		return lhs.video_start_secs > rhs.video_start_secs;
-	}
-};
+	if (this->decoder_pool == nullptr)
+		return;
+	this->decoder_pool->give(std::move(this->decoder));
+}
 
 void Track::add(FilePiece file_piece, TransitionEffect effect)
 {
-	this->pieces.push_back(TrackPiece(file_piece, effect));
+	auto piece = insert_piece(TrackPiece(file_piece, effect));
+	recalc_clips(piece, std::next(piece), piece->file.video_start_secs, 0);
+}
+
+std::list<TrackPiece>::iterator Track::insert_piece(const TrackPiece& piece)
+{
+	// before the first piece starting later
+	auto after = std::upper_bound(this->piece_index.begin(), this->piece_index.end(), piece.file.video_start_secs,
+			[](float secs, std::list<TrackPiece>::iterator piece) { return secs < piece->file.video_start_secs; });
+	auto inserted = this->pieces.insert(after != this->piece_index.end() ? *after : this->pieces.end(), piece);
+	this->piece_index.insert(after, inserted);
+	return inserted;
+}
+
+void Track::sort_pieces()
+{
 	this->pieces.sort([](const TrackPiece& tp1, const TrackPiece& tp2) {
-		return tp1.file.video_start_secs > tp2.file.video_start_secs;
+		return tp1.file.video_start_secs < tp2.file.video_start_secs;
 	});
-	recalc_clips();
 }
 
-const std::list<Clip>& Track::get_clips()
+const std::vector<Clip>& Track::get_clips()
 {
 	return clips;
 }
 
 float Track::get_duration_secs() const
 {
-	return std::accumulate(this->pieces.begin(), this->pieces.end(), 0,
-		[](int duration_secs_so_far, const TrackPiece& piece) {
+	return std::accumulate(this->pieces.begin(), this->pieces.end(), 0.0f,
+		[](float duration_secs_so_far, const TrackPiece& piece) {
 			return duration_secs_so_far + piece.file.duration_secs;
 		}
 	);
@@ -499,9 +459,17 @@ void Track::split(float secs, TransitionEffect effect)
 		2nd filepiece: video=3s-6s, file 11s-14s - vstart=secs(3), fstart=fstart+secs-vstart(11), duration=duration+vstart-secs(3)
 	*/
 
-	// find file piece to split
-	auto piece = std::find_if(this->pieces.begin(), this->pieces.end(),
-			[secs](const TrackPiece& piece) { return piece.file.video_start_secs <= secs && secs < piece.file.video_start_secs + piece.file.duration_secs; });
+	// find file piece to split, the last one starting at or before secs
+	auto after = std::upper_bound(this->piece_index.begin(), this->piece_index.end(), secs,
+			[](float secs, std::list<TrackPiece>::iterator piece) { return secs < piece->file.video_start_secs; });
+	if (after == this->piece_index.begin())
+		return;
+	auto piece = *std::prev(after);
+	if (secs >= piece->file.video_start_secs + piece->file.duration_secs)
+		return;
+	// a placeholder's duration is only a guess, it can't be cut until its file is probed
+	if (piece->placeholder != 0)
+		return;
 
 	float new_piece_duration_secs = piece->file.duration_secs + piece->file.video_start_secs - secs;
 	float new_piece_file_start_secs = piece->file.file_start_secs + secs - piece->file.video_start_secs;
@@ -509,85 +477,189 @@ void Track::split(float secs, TransitionEffect effect)
 	// lower current file piece duration
 	piece->file.duration_secs = secs - piece->file.video_start_secs;
 	// insert new track piece
-	this->pieces.insert(std::next(piece, 1), TrackPiece(FilePiece(piece->file.filename, secs, new_piece_file_start_secs, new_piece_duration_secs), effect));
+	auto new_piece = insert_piece(TrackPiece(FilePiece(piece->file.filename, secs, new_piece_file_start_secs, new_piece_duration_secs), effect));
 
-	recalc_clips();
+	recalc_clips(piece, std::next(new_piece), piece->file.video_start_secs, 0);
+}
+
+void Track::set_pieces(const std::list<TrackPiece>& pieces)
+{
+	this->pieces = pieces;
+	// projects saved before the pieces were kept in order may have them backwards
+	sort_pieces();
+	rebuild_clips();
 }
 
-void Track::recalc_clips()
+int Track::add_placeholder(const std::string& filename, TransitionEffect effect, float duration_secs)
+{
+	TrackPiece placeholder(FilePiece(filename, get_duration_secs(), 0, duration_secs), effect);
+	placeholder.placeholder = this->next_placeholder++;
+	auto piece = insert_piece(placeholder);
+	// the decoder is left alone, the renderer opens the file when the playhead gets there
+	replace_clips(piece, std::next(piece), piece->file.video_start_secs, 0);
+	return piece->placeholder;
+}
+
+bool Track::resolve_placeholder(int placeholder, float duration_secs)
+{
+	auto piece = std::find_if(this->pieces.begin(), this->pieces.end(),
+			[placeholder](const TrackPiece& piece) { return piece.placeholder == placeholder; });
+	if (piece == this->pieces.end())
+		return false;
+
+	float shift_secs = duration_secs - piece->file.duration_secs;
+	piece->file.duration_secs = duration_secs;
+	piece->placeholder = 0;
+	replace_clips(piece, std::next(piece), piece->file.video_start_secs, shift_secs);
+	return true;
+}
+
+bool Track::remove_placeholder(int placeholder)
+{
+	auto piece = std::find_if(this->pieces.begin(), this->pieces.end(),
+			[placeholder](const TrackPiece& piece) { return piece.placeholder == placeholder; });
+	if (piece == this->pieces.end())
+		return false;
+
+	float old_start_secs = piece->file.video_start_secs;
+	float shift_secs = -piece->file.duration_secs;
+	this->piece_index.erase(std::find(this->piece_index.begin(), this->piece_index.end(), piece));
+	auto next = this->pieces.erase(piece);
+	// only the piece before loses a neighbour
+	replace_clips(next, next, old_start_secs, shift_secs);
+	return true;
+}
+
+void Track::rebuild_clips()
 {
 	this->clips.clear();
+	this->clip_cursor = 0;
+	this->piece_index.clear();
+	for (auto track_piece = pieces.begin(); track_piece != pieces.end(); ++track_piece) {
+		this->piece_index.push_back(track_piece);
+		build_clips(track_piece, &this->clips);
+	}
+}
 
+void Track::build_clips(std::list<TrackPiece>::const_iterator track_piece, std::vector<Clip>* clips) const
+{
 	const float transition_duration_secs = 0.5f;
 
-	for (auto track_piece = pieces.begin(); track_piece != pieces.end(); ++track_piece) {
-		if (track_piece->file.duration_secs < transition_duration_secs) {
-			clips.push_back(Clip(track_piece->file));
-			continue;
-		}
+	if (track_piece->file.duration_secs < transition_duration_secs) {
+		clips->push_back(Clip(track_piece->file));
+		return;
+	}
 
-		bool has_incoming_effect = (track_piece->transition != TransitionEffect::None);
-		auto next_track_piece = std::next(track_piece, 1);
-		bool has_outgoing_effect = (next_track_piece != pieces.end() && next_track_piece->transition != TransitionEffect::None);
+	bool has_incoming_effect = (track_piece->transition != TransitionEffect::None);
+	auto next_track_piece = std::next(track_piece, 1);
+	bool has_outgoing_effect = (next_track_piece != pieces.end() && next_track_piece->transition != TransitionEffect::None);
 
-		if (has_incoming_effect)
-			clips.push_back(Clip(track_piece->file.with_duration(transition_duration_secs), FilterEffect::FadeIn));
+	if (has_incoming_effect)
+		clips->push_back(Clip(track_piece->file.with_duration(transition_duration_secs), FilterEffect::FadeIn));
 
-		float main_clip_file_start = track_piece->file.file_start_secs + (has_incoming_effect ? transition_duration_secs : 0);
-		float main_clip_video_start = track_piece->file.video_start_secs + (has_incoming_effect ? transition_duration_secs : 0);
-		float main_clip_duration = track_piece->file.duration_secs - (has_incoming_effect ? transition_duration_secs : 0) - (has_outgoing_effect ? transition_duration_secs : 0);
-		if (main_clip_duration > 0)
-			clips.push_back(Clip(FilePiece(track_piece->file.filename, main_clip_video_start, main_clip_file_start, main_clip_duration)));
+	float main_clip_file_start = track_piece->file.file_start_secs + (has_incoming_effect ? transition_duration_secs : 0);
+	float main_clip_video_start = track_piece->file.video_start_secs + (has_incoming_effect ? transition_duration_secs : 0);
+	float main_clip_duration = track_piece->file.duration_secs - (has_incoming_effect ? transition_duration_secs : 0) - (has_outgoing_effect ? transition_duration_secs : 0);
+	if (main_clip_duration > 0)
+		clips->push_back(Clip(FilePiece(track_piece->file.filename, main_clip_video_start, main_clip_file_start, main_clip_duration)));
 
-		if (has_outgoing_effect) {
-			float outgoing_clip_file_start = track_piece->file.file_start_secs + track_piece->file.duration_secs - transition_duration_secs;
-			float outgoing_clip_video_start = track_piece->file.video_start_secs + track_piece->file.duration_secs - transition_duration_secs;
-			clips.push_back(Clip(FilePiece(track_piece->file.filename, outgoing_clip_video_start, outgoing_clip_file_start, transition_duration_secs), FilterEffect::FadeOut));
-		}
+	if (has_outgoing_effect) {
+		float outgoing_clip_file_start = track_piece->file.file_start_secs + track_piece->file.duration_secs - transition_duration_secs;
+		float outgoing_clip_video_start = track_piece->file.video_start_secs + track_piece->file.duration_secs - transition_duration_secs;
+		clips->push_back(Clip(FilePiece(track_piece->file.filename, outgoing_clip_video_start, outgoing_clip_file_start, transition_duration_secs), FilterEffect::FadeOut));
 	}
+}
 
-	Logger::get("clip_recalc") << "track " << this << "\n";
-	int p = 0;
-	for (auto piece = pieces.begin(); piece != pieces.end(); ++piece) {
-		Logger::get("clip_recalc") << "  piece " << p++ << "\n";
-		Logger::get("clip_recalc") << "    file piece at " << std::setprecision(3) << piece->file.video_start_secs << "s: " << piece->file.filename << " from " << piece->file.file_start_secs << " for " << piece->file.duration_secs << "\n";
-		Logger::get("clip_recalc") << "    transition " << piece->transition << "\n";
+void Track::replace_clips(std::list<TrackPiece>::iterator first, std::list<TrackPiece>::iterator last, float old_start_secs, float shift_secs)
+{
+	// the piece before fades out into first, so its clips depend on it
+	if (first != this->pieces.begin())
+		first = std::prev(first);
+	float from_secs = old_start_secs;
+	if (first != this->pieces.end())
+		from_secs = std::min(from_secs, first->file.video_start_secs);
+
+	// last hasn't moved yet, its first clip starts exactly where it does
+	auto starts_before = [](const Clip& clip, float secs) { return clip.video_start_secs < secs; };
+	auto begin = std::lower_bound(this->clips.begin(), this->clips.end(), from_secs, starts_before);
+	auto end = this->clips.end();
+	if (last != this->pieces.end())
+		end = std::lower_bound(begin, this->clips.end(), last->file.video_start_secs, starts_before);
+
+	// the pieces and clips after the edit only move
+	if (shift_secs != 0) {
+		for (auto piece = last; piece != this->pieces.end(); ++piece)
+			piece->file.video_start_secs += shift_secs;
+		for (auto clip = end; clip != this->clips.end(); ++clip)
+			clip->video_start_secs += shift_secs;
 	}
 
-	int c = 0;
-	for (auto clip = clips.begin(); clip != clips.end(); ++clip)
-		Logger::get("clip_recalc") << "clip " << c++ << " at " << clip->video_start_secs << " on " << clip->filename << " from " << clip->file_start_secs << " for " << clip->duration_secs << " with effect " << clip->effect << "\n";
+	std::vector<Clip> rebuilt;
+	for (auto piece = first; piece != last; ++piece)
+		build_clips(piece, &rebuilt);
 
-	// make sure current decoders is on proper file at correct place
-	Clip* cur_clip = this->get_next_frame_clip();
-	if (cur_clip != nullptr) {
-		float decoder_seek = this->last_shown_frame_secs - cur_clip->video_start_secs + cur_clip->file_start_secs;
-		Track::ensure_decoder_at(decoder.get(), cur_clip->filename, decoder_seek);
-	}
+	Logger::get("clip_recalc") << "track " << this << " replacing " << end - begin << " clips from " << std::setprecision(3) << from_secs << "s with " << rebuilt.size() << "\n";
+	for (const Clip& clip : rebuilt)
+		Logger::get("clip_recalc") << "  clip at " << clip.video_start_secs << " on " << clip.filename << " from " << clip.file_start_secs << " for " << clip.duration_secs << " with effect " << clip.effect << "\n";
+
+	auto at = this->clips.erase(begin, end);
+	this->clips.insert(at, rebuilt.begin(), rebuilt.end());
+}
 
-	Logger::get("clip_recalc") << "---\n";
+void Track::recalc_clips(std::list<TrackPiece>::iterator first, std::list<TrackPiece>::iterator last, float old_start_secs, float shift_secs)
+{
+	std::string old_filename;
+	float old_file_secs = 0;
+	bool had_clip = get_file_position(this->last_shown_frame_secs, &old_filename, &old_file_secs);
+
+	replace_clips(first, last, old_start_secs, shift_secs);
+
+	// the decoder only moves if the edit changed what's under the playhead
+	std::string filename;
+	float file_secs;
+	if (!get_file_position(this->last_shown_frame_secs, &filename, &file_secs))
+		return;
+	if (had_clip && filename == old_filename && file_secs == old_file_secs)
+		return;
+	position_decoder(filename, file_secs);
 }
 
 Clip* Track::find_clip_at(float secs)
 {
-	auto clip = std::find_if(this->clips.begin(), this->clips.end(),
-			[secs](const Clip& clip) { return clip.video_start_secs <= secs && secs < clip.video_start_secs + clip.duration_secs; });
-	if (clip == clips.end())
+	auto contains = [secs](const Clip& clip) { return clip.video_start_secs <= secs && secs < clip.video_start_secs + clip.duration_secs; };
+
+	// sequential playback stays on the cursor's clip or steps to the next one
+	if (this->clip_cursor < this->clips.size()) {
+		if (contains(this->clips[this->clip_cursor]))
+			return &this->clips[this->clip_cursor];
+		if (this->clip_cursor + 1 < this->clips.size() && contains(this->clips[this->clip_cursor + 1]))
+			return &this->clips[++this->clip_cursor];
+	}
+
+	// a seek, the last clip starting at or before secs
+	auto after = std::upper_bound(this->clips.begin(), this->clips.end(), secs,
+			[](float secs, const Clip& clip) { return secs < clip.video_start_secs; });
+	if (after == this->clips.begin())
+		return nullptr;
+	auto clip = std::prev(after);
+	if (!contains(*clip))
 		return nullptr;
+	this->clip_cursor = clip - this->clips.begin();
 	return &*clip;
 }
 
 Clip* Track::find_next_clip_after(float secs)
 {
-	auto clip = std::find_if(this->clips.begin(), this->clips.end(), [secs](const Clip& clip) { return clip.video_start_secs > secs; });
-	if (clip == clips.end())
+	auto clip = std::upper_bound(this->clips.begin(), this->clips.end(), secs,
+			[](float secs, const Clip& clip) { return secs < clip.video_start_secs; });
+	if (clip == this->clips.end())
 		return nullptr;
 	return &*clip;
 }
 
 bool Track::seek(float secs)
 {
-	if (this->last_shown_frame_secs == secs)
+	if (this->last_shown_frame_secs == secs && !decoder->is_keyframe_only())
 		return false;
 
 	// ensure decoders have the proper files
@@ -596,41 +668,210 @@ bool Track::seek(float secs)
 	this->last_shown_frame_secs = secs;
 	delete current_filter;
 	current_filter = nullptr;
-	return Track::ensure_decoder_at(decoder.get(), cur_clip->filename, decoder_seek);
+
+	if (this->prefetcher != nullptr) {
+		std::unique_ptr<Decoder_Ctx> warm = this->prefetcher->take(cur_clip->filename, decoder_seek);
+		if (warm != nullptr) {
+			warm->set_realtime(this->realtime);
+			replace_decoder(std::move(warm));
+			return true;
+		}
+	}
+	return position_decoder(cur_clip->filename, decoder_seek);
+}
+
+bool Track::get_file_position(float secs, std::string* filename, float* file_secs)
+{
+	Clip* clip = find_clip_at(secs);
+	if (clip == nullptr)
+		return false;
+	*filename = clip->filename;
+	*file_secs = secs - clip->video_start_secs + clip->file_start_secs;
+	return true;
+}
+
+void Track::set_prefetcher(Seek_Prefetcher* prefetcher)
+{
+	this->prefetcher = prefetcher;
 }
 
 bool Track::ensure_decoder_at(Decoder_Ctx* decoder, const std::string& filename, float seek_secs)
 {
 	if (decoder->filename != filename)
 		decoder->open_file(filename, seek_secs);
-	else if (decoder->get_last_video_frame_secs() != seek_secs)
+	else if (decoder->get_last_video_frame_secs() != seek_secs || decoder->is_keyframe_only())
 		decoder->seek(seek_secs);
 	else
 		return false;
-	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	// the next frame request waits for the seek, or settles for a nearby frame
 	return true;
 }
 
+bool Track::position_decoder(const std::string& filename, float seek_secs)
+{
+	if (this->decoder_pool != nullptr && this->decoder->filename != filename) {
+		std::unique_ptr<Decoder_Ctx> pooled = this->decoder_pool->take(filename);
+		// keep the old file open in the pool, cuts often come back to it
+		if (pooled == nullptr) {
+			pooled = std::make_unique<Decoder_Ctx>();
+			pooled->set_frame_pool(this->frame_pool);
+		}
+		pooled->set_realtime(this->realtime);
+		replace_decoder(std::move(pooled));
+	} else if (this->decoder->filename != filename) {
+		// the same decoder opens the next file, what the resampler holds back is from the last one
+		std::lock_guard<std::mutex> lock(this->decoder_mutex);
+		this->resampler.reset();
+	}
+	return Track::ensure_decoder_at(this->decoder.get(), filename, seek_secs);
+}
+
+float Track::nearest_keyframe_secs(const std::string& filename, float file_secs)
+{
+	// only what's already probed, a scrub shouldn't wait on reading the index
+	Media_Info info;
+	if (!Probe_Cache::shared().peek(filename, &info) || info.keyframe_secs.empty())
+		return file_secs;
+	auto next = std::lower_bound(info.keyframe_secs.begin(), info.keyframe_secs.end(), file_secs);
+	if (next == info.keyframe_secs.end())
+		return info.keyframe_secs.back();
+	if (next == info.keyframe_secs.begin())
+		return *next;
+	return file_secs - *(next - 1) <= *next - file_secs ? *(next - 1) : *next;
+}
+
+void Track::replace_decoder(std::unique_ptr<Decoder_Ctx> next)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->decoder_mutex);
+		std::swap(this->decoder, next);
+		// seek ids belong to the decoder that handed them out
+		this->scrub_seek = 0;
+		// a file in the same format would otherwise get the last one's buffered samples
+		this->resampler.reset();
+	}
+	// closing joins the decoding thread, the audio thread shouldn't wait on that
+	if (this->decoder_pool != nullptr)
+		this->decoder_pool->give(std::move(next));
+}
+
+void Track::set_decoder_pool(Decoder_Pool* pool)
+{
+	this->decoder_pool = pool;
+}
+
 const Decoder_Ctx* Track::get_decoder() const
 {
 	return this->decoder.get();
 }
 
+void Track::set_frame_pool(Frame_Pool* pool)
+{
+	this->frame_pool = pool;
+	this->decoder->set_frame_pool(pool);
+}
+
+void Track::release_frame_pool()
+{
+	delete this->current_filter;
+	this->current_filter = nullptr;
+	this->frame_pool = nullptr;
+	// codecs keep reference frames, only closing the decoder gives every slot back
+	replace_decoder(std::make_unique<Decoder_Ctx>());
+}
+
+void Track::set_direct_frames(bool allowed)
+{
+	this->direct_frames_allowed = allowed;
+}
+
+bool Track::has_clips_between(float start_secs, float end_secs, bool effects_only) const
+{
+	// clips are contiguous, walking back from the first one past the range stops at the first one before it
+	auto after = std::upper_bound(this->clips.begin(), this->clips.end(), end_secs,
+		[](float secs, const Clip& clip) { return secs < clip.video_start_secs; });
+	for (auto it = after; it != this->clips.begin(); ) {
+		--it;
+		if (it->video_start_secs + it->duration_secs <= start_secs)
+			break;
+		if (!effects_only || it->effect != FilterEffect::None)
+			return true;
+	}
+	return false;
+}
+
+void Track::set_realtime(bool enabled)
+{
+	this->realtime = enabled;
+	this->decoder->set_realtime(enabled);
+}
+
+void Track::set_volume(float gain)
+{
+	this->volume = gain;
+}
+
+void Track::set_muted(bool muted)
+{
+	this->muted = muted;
+}
+
+float Track::get_gain() const
+{
+	return this->muted ? 0 : this->volume.load();
+}
+
 const AVCodecContext* Track::get_audio_context() const
 {
 	return this->decoder->get_audio_context();
 }
 
-AVFrame* Track::get_next_audio_frame() {
-	return decoder->get_audio_frame();
+int Track::read_audio(Audio_Mixer* mixer, int input, int min_samples)
+{
+	std::lock_guard<std::mutex> lock(this->decoder_mutex);
+	while (mixer->available(input) < min_samples) {
+		AVFrame* frame = decoder->get_audio_frame();
+		if (frame == nullptr)
+			return AVERROR(EAGAIN);
+
+		int ret = this->resampler.convert(frame, mixer, input);
+		av_frame_free(&frame);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+void Track::reset_audio()
+{
+	std::lock_guard<std::mutex> lock(this->decoder_mutex);
+	this->resampler.reset();
+}
+
+void Track::skip_audio()
+{
+	std::lock_guard<std::mutex> lock(this->decoder_mutex);
+	AVFrame* frame;
+	while ((frame = decoder->get_audio_frame()) != nullptr)
+		av_frame_free(&frame);
 }
 
 AVFrame* Track::get_video_frame(float secs)
+{
+	return request_video_frame(secs, -1, nullptr);
+}
+
+AVFrame* Track::request_video_frame(float secs, int deadline_ms, bool* approximate)
 {
 	Clip* clip = find_clip_at(secs);
 	if (clip == nullptr)
 		return nullptr;
 
+	// crossed into a clip from another file
+	float file_secs = secs - clip->video_start_secs + clip->file_start_secs;
+	if (decoder->filename != clip->filename)
+		position_decoder(clip->filename, file_secs);
+
 	// see whether we need to set up the filter
 	// TODO: see if this was sequential
 	Clip* last_clip = find_clip_at(this->last_shown_frame_secs);
@@ -655,8 +896,18 @@ AVFrame* Track::get_video_frame(float secs)
 				break;
 		}
 	}
+	// frames are decoded ahead of this one, a fade coming up needs them from the default allocator already
+	decoder->set_direct_frames(this->direct_frames_allowed && !has_clips_between(secs, secs + direct_frames_lookahead_secs, true));
 
-	AVFrame* decoded_frame = decoder->get_video_frame_at(secs - clip->video_start_secs + clip->file_start_secs);
+	AVFrame* decoded_frame;
+	if (deadline_ms < 0) {
+		decoded_frame = decoder->get_video_frame_at(file_secs);
+	} else {
+		Frame_Lookup lookup = decoder->request_video_frame(file_secs, deadline_ms);
+		decoded_frame = lookup.frame;
+		if (approximate != nullptr)
+			*approximate = *approximate || lookup.approximate;
+	}
 	if (decoded_frame == nullptr) {
 		Logger::get("get_video_frame") << "didn't get frame from decoder\n";
 		return nullptr;
@@ -680,6 +931,45 @@ AVFrame* Track::get_video_frame(float secs)
 }
 
 
+AVFrame* Track::get_keyframe_near(float secs)
+{
+	Clip* clip = find_clip_at(secs);
+	if (clip == nullptr)
+		return nullptr;
+
+	// effects are skipped while scrubbing
+	delete this->current_filter;
+	this->current_filter = nullptr;
+	decoder->set_direct_frames(this->direct_frames_allowed);
+
+	// crossed into a clip from another file, the keyframe seek below replaces the one this starts
+	float file_secs = secs - clip->video_start_secs + clip->file_start_secs;
+	if (decoder->filename != clip->filename)
+		position_decoder(clip->filename, file_secs);
+	float keyframe_secs = nearest_keyframe_secs(clip->filename, file_secs);
+	Seek_Status status = this->scrub_seek != 0 ? decoder->get_seek_status(this->scrub_seek) : Seek_Status::Failed;
+	bool same_keyframe = this->scrub_filename == clip->filename && this->scrub_keyframe_secs == keyframe_secs;
+	// a seek that finished counts only while nothing has moved the decoder off keyframes since
+	bool reusable = status == Seek_Status::Pending || (status == Seek_Status::Completed && decoder->is_keyframe_only());
+	if (!same_keyframe || !reusable) {
+		this->scrub_seek = decoder->seek_keyframe(file_secs);
+		this->scrub_filename = clip->filename;
+		this->scrub_keyframe_secs = keyframe_secs;
+	}
+	if (decoder->wait_for_seek(this->scrub_seek, scrub_timeout_ms) != Seek_Status::Completed) {
+		Logger::get("get_video_frame") << "keyframe near " << file_secs << "s isn't decoded yet\n";
+		return nullptr;
+	}
+
+	AVFrame* keyframe = decoder->peek_video_frame();
+	if (keyframe == nullptr || keyframe->width == 0)
+		return nullptr;
+
+	float shown_secs = keyframe->pts * av_q2d(decoder->get_video_stream()->time_base);
+	this->last_shown_frame_secs = clip->video_start_secs + shown_secs - clip->file_start_secs;
+	return keyframe;
+}
+
 /********
 * Video *
 ********/
@@ -691,8 +981,8 @@ Video::~Video()
 {
 	if (this->out_video_frame != nullptr)
 		av_frame_unref(this->out_video_frame);
-	if (this->out_audio_frame != nullptr)
-		av_frame_unref(this->out_audio_frame);
+	av_frame_free(&this->out_audio_frame);
+	delete this->mixer;
 }
 
 void Video::addToMainTrack(const std::string& filename, TransitionEffect effect)
@@ -705,6 +995,40 @@ void Video::addToOverlayTrack(const std::string& filename, TransitionEffect effe
 	overlay_track.add(FilePiece(filename, this->overlay_track.get_duration_secs()), effect);
 }
 
+void Video::set_frame_pool(Frame_Pool* pool)
+{
+	this->main_track.set_frame_pool(pool);
+}
+
+void Video::release_frame_pool()
+{
+	// the last output may be a pooled frame, or come from a filter that holds one
+	this->out_video_frame = nullptr;
+	delete this->solo_track_filter;
+	delete this->overlay_track_filter;
+	this->solo_track_filter = nullptr;
+	this->overlay_track_filter = nullptr;
+	this->main_track.release_frame_pool();
+	this->overlay_track.release_frame_pool();
+}
+
+void Video::set_decoder_pool(Decoder_Pool* pool)
+{
+	this->main_track.set_decoder_pool(pool);
+	this->overlay_track.set_decoder_pool(pool);
+}
+
+void Video::set_prefetcher(Seek_Prefetcher* prefetcher)
+{
+	this->main_track.set_prefetcher(prefetcher);
+}
+
+void Video::set_realtime(bool enabled)
+{
+	this->main_track.set_realtime(enabled);
+	this->overlay_track.set_realtime(enabled);
+}
+
 // returns whether the frame will change
 bool Video::seek(float secs)
 {
@@ -721,9 +1045,31 @@ float Video::get_last_video_frame_secs()
 	return this->main_track.last_shown_frame_secs;
 }
 
+float Video::get_frame_duration_secs() const
+{
+	const AVStream* stream = this->main_track.get_decoder()->get_video_stream();
+	if (stream == nullptr || stream->avg_frame_rate.num == 0)
+		return 0;
+	return av_q2d(av_inv_q(stream->avg_frame_rate));
+}
+
+bool Video::has_audio() const
+{
+	return this->main_track.get_decoder()->get_audio_stream() != nullptr;
+}
+
 int Video::get_video_frame(float secs, int out_width, int out_height)
 {
-	AVFrame* main_frame = this->main_track.get_video_frame(secs);
+	return request_video_frame(secs, out_width, out_height, -1, nullptr);
+}
+
+int Video::request_video_frame(float secs, int out_width, int out_height, int deadline_ms, bool* approximate)
+{
+	if (approximate != nullptr)
+		*approximate = false;
+	// decided before the frames are decoded, an overlay coming up needs them filtered
+	this->main_track.set_direct_frames(!this->overlay_track.has_clips_between(secs, secs + Track::direct_frames_lookahead_secs, false));
+	AVFrame* main_frame = this->main_track.request_video_frame(secs, deadline_ms, approximate);
 	if (main_frame == nullptr) {
 		// TODO: add status to decoder so we know whether it's got an error or operating normally
 		Logger::get("error") << "xx error getting a video frame from the main track\n";
@@ -731,7 +1077,29 @@ int Video::get_video_frame(float secs, int out_width, int out_height)
 	}
 
 	// put overlay track on top
-	AVFrame* overlay_frame = this->overlay_track.get_video_frame(secs);
+	AVFrame* overlay_frame = this->overlay_track.request_video_frame(secs, deadline_ms, approximate);
+	return compose(main_frame, overlay_frame, out_width, out_height);
+}
+
+int Video::scrub(float secs, int out_width, int out_height)
+{
+	this->main_track.set_direct_frames(!this->overlay_track.has_clips_between(secs, secs + Track::direct_frames_lookahead_secs, false));
+	AVFrame* main_frame = this->main_track.get_keyframe_near(secs);
+	if (main_frame == nullptr) {
+		Logger::get("get_video_frame") << "no keyframe from the main track yet\n";
+		return AVERROR(EAGAIN);
+	}
+	return compose(main_frame, this->overlay_track.get_keyframe_near(secs), out_width, out_height);
+}
+
+int Video::compose(AVFrame* main_frame, AVFrame* overlay_frame, int out_width, int out_height)
+{
+	// frames decoded into mapped GPU memory are scaled and converted by the uploader
+	if (overlay_frame == nullptr && this->main_track.get_decoder()->is_pooled_frame(main_frame)) {
+		this->out_video_frame = main_frame;
+		return 0;
+	}
+
 	if (overlay_frame != nullptr) {
 		if (this->overlay_track_filter == nullptr)
 			this->overlay_track_filter = Filter::OverlayTrack(main_track.get_decoder(), this->overlay_track.get_decoder(), out_width, out_height);
@@ -755,37 +1123,56 @@ int Video::get_video_frame(float secs, int out_width, int out_height)
 	return 0;
 }
 
+void Video::set_audio_output(int sample_rate, int channels)
+{
+	delete this->mixer;
+	this->mixer = new Audio_Mixer(sample_rate, channels);
+	this->mixer_inputs.clear();
+	for (Track* track : { &this->main_track, &this->overlay_track })
+		this->mixer_inputs.push_back(std::make_pair(track, this->mixer->add_input()));
+
+	av_frame_free(&this->out_audio_frame);
+	this->out_audio_frame = av_frame_alloc();
+	this->out_audio_frame->format = AV_SAMPLE_FMT_S16;
+	this->out_audio_frame->sample_rate = sample_rate;
+	this->out_audio_frame->channels = channels;
+	this->out_audio_frame->channel_layout = av_get_default_channel_layout(channels);
+	this->out_audio_frame->nb_samples = Audio_Mixer::block_samples;
+	av_frame_get_buffer(this->out_audio_frame, 0);
+}
+
+void Video::reset_audio()
+{
+	if (this->mixer != nullptr)
+		this->mixer->reset();
+	this->main_track.reset_audio();
+	this->overlay_track.reset_audio();
+}
+
+const Audio_Mixer* Video::get_mixer() const
+{
+	return this->mixer;
+}
+
 int Video::get_next_audio_frame()
 {
-	AVFrame* main_frame = this->main_track.get_next_audio_frame();
-	if (main_frame == nullptr) {
-		// TODO: add status to decoder so we know whether it's got an error or operating normally
-		Logger::get("error") << "xx error getting an audio frame from the main track\n";
-		return AVERROR(EAGAIN);
+	if (this->mixer == nullptr) {
+		Logger::get("error") << "no audio output set up\n";
+		return AVERROR(EINVAL);
 	}
 
-	// put overlay track on top
-	AVFrame* overlay_frame = this->overlay_track.get_next_audio_frame();
-	if (overlay_frame == nullptr) {
-		if (this->audioprep_filter == nullptr)
-			this->audioprep_filter = Filter::AudioPrep(main_track.get_decoder());
-		int ret = this->audioprep_filter->feed(main_frame);
-		if (ret != 0) {
-			Logger::get("error") << "error feeding the overlay filter: " << av_err2str(ret) << "\n";
+	// the main track paces the mix, other tracks are silent where they have nothing decoded
+	std::vector<float> gains;
+	for (auto& input : this->mixer_inputs) {
+		int ret = input.first->read_audio(this->mixer, input.second, Audio_Mixer::block_samples);
+		if (ret < 0 && input.first == &this->main_track) {
+			// TODO: add status to decoder so we know whether it's got an error or operating normally
+			Logger::get("error") << "xx error getting an audio frame from the main track\n";
 			return ret;
 		}
-		this->out_audio_frame = this->audioprep_filter->get_output_frame();
-		return 0;
-	}
-
-	if (this->audiomix_filter == nullptr)
-		this->audiomix_filter = Filter::AudioMix(main_track.get_decoder(), this->overlay_track.get_decoder());
-	int ret = this->audiomix_filter->feed(main_frame, overlay_frame);
-	if (ret != 0) {
-		Logger::get("error") << "error feeding the overlay filter: " << av_err2str(ret) << "\n";
-		return ret;
+		gains.push_back(input.first->get_gain());
 	}
-	this->out_audio_frame = this->audiomix_filter->get_output_frame();
 
+	this->mixer->mix((int16_t*) this->out_audio_frame->data[0], Audio_Mixer::block_samples, gains);
 	return 0;
 }
@@ -12,6 +12,9 @@ extern "C" {
 #include <vector>
 
 #include "common.h"
+#include "mixer.h"
+#include "prefetch.h"
+#include "resample.h"
 
 enum class TransitionEffect {
 	None,
@@ -27,8 +30,6 @@ enum class FilterEffect {
 	RGB,
 	SoloTrack,
 	OverlayTrack,
-	AudioMix,
-	AudioPrep,
 };
 
 // API requires filtergraph outputs only one frame per input frame
@@ -53,8 +54,6 @@ public:
 	static Filter* RGB(const Decoder_Ctx* decoder1);
 	static Filter* SoloTrack(const Decoder_Ctx* decoder, int out_width, int out_height);
 	static Filter* OverlayTrack(const Decoder_Ctx* decoder1, const Decoder_Ctx* decoder2, int out_width, int out_height);
-	static Filter* AudioMix(const Decoder_Ctx* decoder1, const Decoder_Ctx* decoder2);
-	static Filter* AudioPrep(const Decoder_Ctx* decoder1);
 
 protected:
 	Filter(FilterEffect effect, const std::string& filter_str);
@@ -86,7 +85,7 @@ public:
 	FilePiece(std::string filename, float video_start_secs, float file_start_secs, float duration_secs);
 	FilePiece(const FilePiece& fp);
 
-	FilePiece with_duration(float duration_secs);
+	FilePiece with_duration(float duration_secs) const;
 };
 
 class Clip
@@ -109,11 +108,14 @@ struct TrackPiece
 	// transition occurs before file plays
 	FilePiece file;
 	TransitionEffect transition;
+	// nonzero while the file is still being probed, the duration is a guess until then
+	int placeholder = 0;
 
 	TrackPiece(FilePiece file_piece, TransitionEffect effect);
 };
 
 class Video;
+class Decoder_Pool;
 
 class Track {
 public:
@@ -123,23 +125,78 @@ public:
 	Track(Video* video, const std::string& filename);
 	Track(Video* video, FilePiece file_piece);
 	Track(Video* video, FilePiece file_piece, TransitionEffect effect);
+	~Track();
 
 	void add(FilePiece file_piece, TransitionEffect effect);
 	void split(float secs, TransitionEffect effect);
+	// replaces the pieces without opening anything, the decoder opens its file at the first frame or seek
+	void set_pieces(const std::list<TrackPiece>& pieces);
+	// appends a piece of duration_secs for a file that hasn't been probed, without opening anything
+	// returns the placeholder id to resolve it by
+	int add_placeholder(const std::string& filename, TransitionEffect effect, float duration_secs);
+	// gives the placeholder its real duration and moves the pieces after it, false if it's gone
+	bool resolve_placeholder(int placeholder, float duration_secs);
+	// drops a placeholder whose file couldn't be probed and closes the gap
+	bool remove_placeholder(int placeholder);
 	bool seek(float secs);
 
 	AVFrame* get_video_frame(float secs);
+	// gives up on the exact frame after deadline_ms and sets approximate if a nearby one stands in,
+	// a negative deadline waits like get_video_frame
+	AVFrame* request_video_frame(float secs, int deadline_ms, bool* approximate);
+	// unfiltered keyframe nearest secs, quick enough to follow a dragged playhead, nullptr if it isn't decoded within scrub_timeout_ms
+	AVFrame* get_keyframe_near(float secs);
 	//AVFrame* get_audio_frame(float secs);
-	AVFrame* get_next_audio_frame();
+	// decodes and converts audio until the mixer input has min_samples queued
+	int read_audio(Audio_Mixer* mixer, int input, int min_samples);
+	// throws decoded audio away, for a walk over the timeline that doesn't mix it
+	void skip_audio();
+	// drops audio the resampler holds back from before a seek
+	void reset_audio();
 	const Decoder_Ctx* get_decoder() const;
 	const AVCodecContext* get_audio_context() const;
 
-	const std::list<Clip>& get_clips();
+	// sorted by video_start_secs
+	const std::vector<Clip>& get_clips();
 	float get_duration_secs() const;
 	float last_shown_frame_secs = 0;
 
+	void set_frame_pool(Frame_Pool* pool);
+	// closes the decoder and stops using the pool, so none of its frames outlive it
+	void release_frame_pool();
+	// seeks first try to adopt a decoder the prefetcher already positioned
+	void set_prefetcher(Seek_Prefetcher* prefetcher);
+	// switching files trades decoders with the pool, and they go back to it when the track is destroyed
+	void set_decoder_pool(Decoder_Pool* pool);
+	// maps a timeline position to the file under it, false between clips
+	bool get_file_position(float secs, std::string* filename, float* file_secs);
+	// frames can skip filtering when the track has no effect and nothing on top
+	void set_direct_frames(bool allowed);
+	// the decoder reads about this far ahead, its allocator is picked for every clip in that window
+	static constexpr float direct_frames_lookahead_secs = 1.0f;
+	// whether a clip overlaps start_secs to end_secs, with effects_only one that has an effect
+	bool has_clips_between(float start_secs, float end_secs, bool effects_only) const;
+	// see Decoder_Ctx::set_realtime
+	void set_realtime(bool enabled);
+
+	// safe to call from the UI while audio is playing
+	void set_volume(float gain);
+	void set_muted(bool muted);
+	float get_gain() const;
+
+	// how long a scrub waits for the decoder before giving up on the frame
+	static const int scrub_timeout_ms = 100;
+
 protected:
 	static bool ensure_decoder_at(Decoder_Ctx* decoder, const std::string& filename, float seek_secs);
+	// ensure_decoder_at, but a file switch takes a decoder from the pool if one is set
+	bool position_decoder(const std::string& filename, float seek_secs);
+	// the keyframe a scrub to file_secs lands on, file_secs itself while the file's keyframes aren't known
+	static float nearest_keyframe_secs(const std::string& filename, float file_secs);
+	// the keyframe seek a scrub is waiting on, retries for the same keyframe wait on it instead of restarting it
+	int scrub_seek = 0;
+	std::string scrub_filename;
+	float scrub_keyframe_secs = -1;
 
 	Video* video;
 
@@ -147,13 +204,43 @@ protected:
 	Clip* get_next_clip();
 	float get_last_video_frame_secs();
 
-	std::list<Clip> clips;
-	void recalc_clips();
+	// sorted by video_start_secs and contiguous, lookups binary search it
+	std::vector<Clip> clips;
+	// where the last lookup landed, playback asks for the same clip or the one after it nearly every frame
+	size_t clip_cursor = 0;
+	// the pieces in timeline order, rebuilt with the clips so split can binary search them
+	std::vector<std::list<TrackPiece>::iterator> piece_index;
+	int next_placeholder = 1;
+	// pieces are kept in timeline order, the clips are built from them in that order
+	void sort_pieces();
+	// in timeline order, after any piece starting at the same time
+	std::list<TrackPiece>::iterator insert_piece(const TrackPiece& piece);
+	void rebuild_clips();
+	void build_clips(std::list<TrackPiece>::const_iterator piece, std::vector<Clip>* clips) const;
+	// rebuilds the clips of the edited pieces first up to last, and of the piece before first since its fade out depends on first
+	// old_start_secs is where the edit started on the timeline, last and the pieces after it move by shift_secs
+	void replace_clips(std::list<TrackPiece>::iterator first, std::list<TrackPiece>::iterator last, float old_start_secs, float shift_secs);
+	// replace_clips, then moves the decoder if the file position under the playhead changed
+	void recalc_clips(std::list<TrackPiece>::iterator first, std::list<TrackPiece>::iterator last, float old_start_secs, float shift_secs);
 	Clip* find_clip_at(float secs);
 	Clip* find_next_clip_after(float secs);
 
 	Filter* current_filter = nullptr;
 	std::unique_ptr<Decoder_Ctx> decoder;
+	// held while the decoder is swapped and while the audio thread reads from it
+	std::mutex decoder_mutex;
+	// swaps under decoder_mutex, the old decoder goes to the pool or closes once the audio thread can't be using it
+	void replace_decoder(std::unique_ptr<Decoder_Ctx> next);
+	Seek_Prefetcher* prefetcher = nullptr;
+	Decoder_Pool* decoder_pool = nullptr;
+	Frame_Pool* frame_pool = nullptr;
+	bool direct_frames_allowed = false;
+	bool realtime = true;
+
+	std::atomic<float> volume{1.0f};
+	std::atomic_bool muted{false};
+
+	Audio_Resampler resampler;
 };
 
 class Video {
@@ -167,18 +254,42 @@ public:
 	void addToMainTrack(const std::string& filename, TransitionEffect effect);
 	void addToOverlayTrack(const std::string& filename, TransitionEffect effect);
 	bool seek(float secs);
+	void set_frame_pool(Frame_Pool* pool);
+	void set_prefetcher(Seek_Prefetcher* prefetcher);
+	void set_decoder_pool(Decoder_Pool* pool);
+	// see Decoder_Ctx::set_realtime
+	void set_realtime(bool enabled);
 
 	AVFrame* out_video_frame = nullptr;
 	float get_duration_secs();
+	// waits for the exact frames, for export
 	int get_video_frame(float secs, int width, int height);
+	// returns by deadline_ms with nearby frames if the exact ones aren't decoded yet, for playback
+	int request_video_frame(float secs, int width, int height, int deadline_ms, bool* approximate);
+	// like get_video_frame but shows the nearest keyframes, leaves the decoders in scrub mode until the next seek
+	int scrub(float secs, int width, int height);
 	float get_last_video_frame_secs();
+	// 0 when the main track has no video yet
+	float get_frame_duration_secs() const;
+	bool has_audio() const;
 
+	// must be called before get_next_audio_frame
+	void set_audio_output(int sample_rate, int channels);
+	// mixes the next block of s16 audio into out_audio_frame
 	AVFrame* out_audio_frame = nullptr;
 	int get_next_audio_frame();
+	// drops audio queued for mixing or held back by the resamplers, call from the thread that calls get_next_audio_frame
+	void reset_audio();
+	const Audio_Mixer* get_mixer() const;
+	// call once nothing renders any more, before the frame pool is destroyed
+	void release_frame_pool();
 
 private:
-	Filter* solo_track_filter;
-	Filter* overlay_track_filter;
-	Filter* audiomix_filter;
-	Filter* audioprep_filter;
+	int compose(AVFrame* main_frame, AVFrame* overlay_frame, int width, int height);
+
+	Filter* solo_track_filter = nullptr;
+	Filter* overlay_track_filter = nullptr;
+
+	Audio_Mixer* mixer = nullptr;
+	std::vector<std::pair<Track*, int>> mixer_inputs;
 };
@@ -41,6 +41,29 @@ float Decoder_Ctx::get_duration_secs(const std::string& filename)
 	return duration;
 }
 
+int Decoder_Ctx::get_keyframe_secs(const std::string& filename, std::vector<float>* keyframes)
+{
+	keyframes->clear();
+	AVFormatContext* format_ctx = nullptr;
+
+	int ret = avformat_open_input(&format_ctx, filename.c_str(), nullptr, nullptr);
+	if (ret < 0) {
+		Logger::get("error") << "Could not open source file " << filename << ": " << av_err2str(ret) << "\n";
+		return ret;
+	}
+
+	ret = av_find_best_stream(format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+	if (ret >= 0) {
+		AVStream* stream = format_ctx->streams[ret];
+		for (int i = 0; i < stream->nb_index_entries; ++i)
+			if (stream->index_entries[i].flags & AVINDEX_KEYFRAME)
+				keyframes->push_back((stream->index_entries[i].timestamp - (stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0)) * av_q2d(stream->time_base));
+	}
+
+	avformat_close_input(&format_ctx);
+	return 0;
+}
+
 Decoder_Ctx::Decoder_Ctx()
 {
 	this->errnum = 0;
@@ -56,18 +79,32 @@ Decoder_Ctx::Decoder_Ctx()
 
 	this->seek_secs = -1;
 	this->stop_decoding_thread = false;
+	this->direct_frames = false;
 }
 
 Decoder_Ctx::~Decoder_Ctx()
 {
 	close();
+	delete this->frames;
+	av_frame_free(&this->approximate_frame);
+	av_frame_free(&this->landing_frame);
+	av_frame_free(&this->returned_video_frame);
+	av_frame_free(&this->returned_audio_frame);
 }
 
 void Decoder_Ctx::close()
 {
+	// the interrupt callback sees this too, so a read blocked on slow storage gives up
 	this->stop_decoding_thread = true;
-	if (decoding_thread.joinable())
+	if (decoding_thread.joinable()) {
+		auto start = std::chrono::steady_clock::now();
 		decoding_thread.join();
+		float join_ms = std::chrono::duration_cast<std::chrono::duration<float, std::milli>>(std::chrono::steady_clock::now() - start).count();
+		this->last_close_ms = join_ms;
+		if (join_ms > this->max_close_ms)
+			this->max_close_ms = join_ms;
+		Logger::get("decoder") << "decoder " << this << " decoding thread joined in " << join_ms << "ms\n";
+	}
 	this->stop_decoding_thread = false;
 
 	avformat_close_input(&this->format_ctx);
@@ -77,28 +114,44 @@ void Decoder_Ctx::close()
 		avcodec_close(this->audio_decoder_ctx);
 
 	empty_frame_caches();
+	this->scrub_keyframe_pts = AV_NOPTS_VALUE;
 }
 
-void Decoder_Ctx::empty_frame_caches()
+Frame_Cache::~Frame_Cache()
+{
+	clear_audio();
+	clear_video();
+}
+
+void Frame_Cache::clear_audio()
 {
 	for (auto it = this->audio_frames.begin(); it != this->audio_frames.end(); it++)
 		av_frame_free(&it->second);
 	this->audio_frames.clear();
+}
 
+void Frame_Cache::clear_video()
+{
 	for (auto it = this->video_frames.begin(); it != this->video_frames.end(); it++)
 		av_frame_free(&it->second);
 	this->video_frames.clear();
 }
 
+void Decoder_Ctx::empty_frame_caches()
+{
+	this->frames->clear_audio();
+	this->frames->clear_video();
+}
+
 AVFrame* Decoder_Ctx::get_video_frame()
 {
 	AVFrame* first_frame = nullptr;
 	this->video_mutex.lock();
-	auto it = this->video_frames.begin();
-	if (it != this->video_frames.end()) {
+	auto it = this->frames->video_frames.begin();
+	if (it != this->frames->video_frames.end()) {
 		first_frame = it->second;
 		this->last_video_frame_secs = first_frame->pts * av_q2d(this->get_video_stream()->time_base);
-		this->video_frames.erase(it);
+		this->frames->video_frames.erase(it);
 	}
 	this->video_mutex.unlock();
 	return first_frame;
@@ -108,10 +161,10 @@ AVFrame* Decoder_Ctx::get_audio_frame()
 {
 	AVFrame* first_frame = nullptr;
 	this->audio_mutex.lock();
-	auto it = this->audio_frames.begin();
-	if (it != this->audio_frames.end()) {
+	auto it = this->frames->audio_frames.begin();
+	if (it != this->frames->audio_frames.end()) {
 		first_frame = it->second;
-		this->audio_frames.erase(it);
+		this->frames->audio_frames.erase(it);
 	}
 	this->audio_mutex.unlock();
 	return first_frame;
@@ -124,42 +177,102 @@ float Decoder_Ctx::get_last_video_frame_secs()
 
 AVFrame* Decoder_Ctx::peek_video_frame()
 {
-	AVFrame* first_frame = nullptr;
-	this->video_mutex.lock();
-	auto it = this->video_frames.begin();
-	if (it != this->video_frames.end())
-		first_frame = it->second;
-	this->video_mutex.unlock();
-	return first_frame;
+	std::lock_guard<std::mutex> lock(this->video_mutex);
+	auto it = this->frames->video_frames.begin();
+	if (it == this->frames->video_frames.end())
+		return nullptr;
+	// like internal_get_frame_at, a seek swapping the cache can't free what's handed out
+	av_frame_unref(this->returned_video_frame);
+	int ret = av_frame_ref(this->returned_video_frame, it->second);
+	if (ret < 0) {
+		Logger::get("error") << "decoder " << this << " unable to reference frame: " << av_err2str(ret) << "\n";
+		return nullptr;
+	}
+	return this->returned_video_frame;
 }
 
 AVFrame* Decoder_Ctx::peek_audio_frame()
 {
 	AVFrame* first_frame = nullptr;
 	this->audio_mutex.lock();
-	auto it = this->audio_frames.begin();
-	if (it != this->audio_frames.end())
+	auto it = this->frames->audio_frames.begin();
+	if (it != this->frames->audio_frames.end())
 		first_frame = it->second;
 	this->audio_mutex.unlock();
 	return first_frame;
 }
 
-AVFrame* Decoder_Ctx::internal_get_frame_at(float secs, int media_type)
+// call with the media's mutex held, the pointer is only good until a seek swaps the caches
+std::map<int64_t, AVFrame*>* Decoder_Ctx::get_frame_cache(int media_type)
+{
+	return media_type == AVMEDIA_TYPE_VIDEO ? &this->frames->video_frames : &this->frames->audio_frames;
+}
+
+// whether pts can be served without seeking, video can be a little behind and is shown late
+bool Decoder_Ctx::is_cached(const std::map<int64_t, AVFrame*>& cache, int64_t pts, int media_type) const
+{
+	if (cache.size() == 0 || cache.begin()->first > pts)
+		return false;
+	int64_t last_pts = std::prev(cache.end())->first;
+	if (last_pts >= pts)
+		return true;
+	return media_type == AVMEDIA_TYPE_VIDEO && this->realtime && (pts - last_pts) * av_q2d(this->get_video_stream()->time_base) < keyframe_jump_secs;
+}
+
+// waits on a seek that is already running, or starts one towards secs
+// until_landing also stops waiting once the seek has decoded the keyframe it landed on
+// a decoder that was just opened gets its first frames without seeking
+void Decoder_Ctx::wait_for_frames(float secs, int media_type, int wait_ms, bool until_landing)
+{
+	auto timeout = std::chrono::steady_clock::now() + std::chrono::milliseconds(wait_ms);
+	int seek_id;
+	if (is_seeking()) {
+		Logger::get("decoder") << "decoder " << this << " waiting on a seek for " << secs << "\n";
+		seek_id = this->seek_generation;
+	} else {
+		std::mutex* mutex = media_type == AVMEDIA_TYPE_VIDEO ? &this->video_mutex : &this->audio_mutex;
+		mutex->lock();
+		bool empty = get_frame_cache(media_type)->size() == 0;
+		mutex->unlock();
+		if (empty) {
+			while (empty && std::chrono::steady_clock::now() < timeout) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				mutex->lock();
+				empty = get_frame_cache(media_type)->size() == 0;
+				mutex->unlock();
+			}
+			return;
+		}
+		Logger::get("decoder") << "decoder " << this << " seeking to " << secs << "\n";
+		seek_id = seek(secs);
+	}
+
+	while (get_seek_status(seek_id) == Seek_Status::Pending && std::chrono::steady_clock::now() < timeout) {
+		if (until_landing && has_landing_frame())
+			return;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+bool Decoder_Ctx::has_landing_frame()
+{
+	std::lock_guard<std::mutex> lock(this->video_mutex);
+	return this->landing_seek != 0 && this->landing_seek == this->active_seek;
+}
+
+AVFrame* Decoder_Ctx::internal_get_frame_at(float secs, int media_type, int wait_ms)
 {
-	std::map<int64_t, AVFrame*>* cache;
 	std::mutex* mutex;
 	std::ostream* logger;
 	const AVStream* stream;
 	std::string media;
 
 	if (media_type == AVMEDIA_TYPE_VIDEO) {
-		cache = &this->video_frames;
 		mutex = &this->video_mutex;
 		logger = &Logger::get("get_video_frame");
 		stream = this->get_video_stream();
 		media = "video";
 	} else if (media_type == AVMEDIA_TYPE_AUDIO) {
-		cache = &this->audio_frames;
 		mutex = &this->audio_mutex;
 		logger = &Logger::get("get_audio_frame");
 		stream = this->get_audio_stream();
@@ -173,7 +286,17 @@ AVFrame* Decoder_Ctx::internal_get_frame_at(float secs, int media_type)
 	*logger << "got request for frame at " << secs << ", pts " << target_pts << "\n";
 	*logger << media << " time base " << stream->time_base.num << " / " << stream->time_base.den << "\n";
 
+	// if frame cache doesn't have pts, seek
 	mutex->lock();
+	if (!is_cached(*get_frame_cache(media_type), target_pts, media_type) && wait_ms > 0) {
+		mutex->unlock();
+		wait_for_frames(secs, media_type, wait_ms, false);
+		mutex->lock();
+	}
+
+	std::map<int64_t, AVFrame*>* cache = get_frame_cache(media_type);
+	if (media_type == AVMEDIA_TYPE_VIDEO)
+		this->deadline_secs = secs;
 	if (cache->size() == 0) {
 		Logger::get("decoder") << "decoder " << this << " no cached " << media << " frames\n";
 		mutex->unlock();
@@ -181,35 +304,34 @@ AVFrame* Decoder_Ctx::internal_get_frame_at(float secs, int media_type)
 	}
 
 	// assumes are sequential
-	// if frame cache doesn't have pts, seek
 	auto first_frame = cache->begin();
 	auto last_frame = std::next(cache->end(), -1);
 	*logger << "cache has pts " << first_frame->first << " to " << last_frame->first << "\n";
-	if (last_frame->first < target_pts || first_frame->first > target_pts) {
-		*logger << "seeking to " << secs << "\n";
-		mutex->unlock();
-		seek(secs);
-		std::this_thread::sleep_for(std::chrono::milliseconds(200));
-		mutex->lock();
-
-		first_frame = cache->begin();
-		last_frame = std::next(cache->end(), -1);
-		*logger << "done seeking, cache has pts " << first_frame->first << " to " << last_frame->first << "\n";
-	}
 
 	// if the frame still isn't in the frame cache, we don't have it
-	if (last_frame->first < target_pts || first_frame->first > target_pts) {
-		*logger << "frame not found after seeking\n";
+	if (!is_cached(*cache, target_pts, media_type)) {
+		*logger << "frame at " << secs << " isn't cached\n";
 		mutex->unlock();
 		return nullptr;
 	}
 
+	// decoding is only a little behind, show the newest frame late and let the late policy catch up
+	if (last_frame->first < target_pts) {
+		*logger << "decoding is behind, returning frame with pts " << last_frame->first << "\n";
+		target_pts = last_frame->first;
+		this->frames_late += 1;
+	}
+
 	// remove the first frames from the queue until we found the right one
+	// the frame handed out last time may be among them, the caller holds its own reference to it
 	AVFrame* frame = first_frame->second;
 	auto second_frame = std::next(first_frame, 1);
-	*logger << "first frame pts " << first_frame->first << ", second frame pts " << second_frame->first << "\n";
-	while (second_frame != cache->end() && second_frame->first < target_pts) {
+	while (second_frame != cache->end() && second_frame->first <= target_pts) {
 		*logger << "skipping to second frame\n";
+		// never handed out, dropped before it reaches any filter
+		if (media_type == AVMEDIA_TYPE_VIDEO && first_frame->first > this->last_returned_pts)
+			this->frames_dropped += 1;
+		av_frame_free(&first_frame->second);
 		cache->erase(first_frame);
 		first_frame = cache->begin();
 		second_frame = std::next(first_frame, 1);
@@ -219,23 +341,84 @@ AVFrame* Decoder_Ctx::internal_get_frame_at(float secs, int media_type)
 	*logger << "returning frame with pts " << frame->pts << "\n";
 
 	if (media_type == AVMEDIA_TYPE_VIDEO) {
+		this->last_returned_pts = frame->pts;
 		this->last_video_frame_secs = frame->pts * av_q2d(stream->time_base);
 		Logger::get("get_video_frame") << "decoder pts " << frame->pts << ", last_video_frame_secs: " << std::setprecision(3) << this->last_video_frame_secs << "\n---\n";
 	}
 
+	// the cache belongs to the decoding thread once a seek swaps it out, hand out a reference instead
+	AVFrame* returned = media_type == AVMEDIA_TYPE_VIDEO ? this->returned_video_frame : this->returned_audio_frame;
+	av_frame_unref(returned);
+	int ret = av_frame_ref(returned, frame);
 	mutex->unlock();
+	if (ret < 0) {
+		Logger::get("error") << "decoder " << this << " unable to reference frame: " << av_err2str(ret) << "\n";
+		return nullptr;
+	}
 
-	return frame;
+	return returned;
 }
 
 AVFrame* Decoder_Ctx::get_audio_frame_at(float secs)
 {
-	return internal_get_frame_at(secs, AVMEDIA_TYPE_AUDIO);
+	return internal_get_frame_at(secs, AVMEDIA_TYPE_AUDIO, seek_wait_ms);
 }
 
 AVFrame* Decoder_Ctx::get_video_frame_at(float secs)
 {
-	return internal_get_frame_at(secs, AVMEDIA_TYPE_VIDEO);
+	return internal_get_frame_at(secs, AVMEDIA_TYPE_VIDEO, seek_wait_ms);
+}
+
+Frame_Lookup Decoder_Ctx::request_video_frame(float secs, int deadline_ms)
+{
+	Frame_Lookup lookup;
+	const AVStream* stream = this->get_video_stream();
+	if (stream == nullptr)
+		return lookup;
+
+	// frames cached from before a running seek are from the wrong place
+	if (!is_seeking())
+		lookup.frame = internal_get_frame_at(secs, AVMEDIA_TYPE_VIDEO, 0);
+	if (lookup.frame == nullptr) {
+		wait_for_frames(secs, AVMEDIA_TYPE_VIDEO, deadline_ms, true);
+		if (!is_seeking())
+			lookup.frame = internal_get_frame_at(secs, AVMEDIA_TYPE_VIDEO, 0);
+	}
+	// a late frame from decoding that's behind is still the newest there is, only stand-ins are approximate
+	if (lookup.frame != nullptr) {
+		lookup.frame_secs = this->get_last_video_frame_secs();
+		return lookup;
+	}
+
+	// out of time, the keyframe a running seek landed on stands in, otherwise the nearest cached frame
+	std::lock_guard<std::mutex> lock(this->video_mutex);
+	AVFrame* stand_in;
+	if (this->landing_seek != 0 && this->landing_seek == this->active_seek) {
+		stand_in = this->landing_frame;
+		lookup.seek_landing = true;
+	} else {
+		int64_t target_pts = this->get_pts_at(stream, secs);
+		std::map<int64_t, AVFrame*>& cache = this->frames->video_frames;
+		if (cache.size() == 0)
+			return lookup;
+		auto nearest = cache.lower_bound(target_pts);
+		if (nearest == cache.end() || (nearest != cache.begin() && target_pts - std::prev(nearest)->first < nearest->first - target_pts))
+			nearest = std::prev(nearest);
+		stand_in = nearest->second;
+	}
+
+	av_frame_unref(this->approximate_frame);
+	int ret = av_frame_ref(this->approximate_frame, stand_in);
+	if (ret < 0) {
+		Logger::get("error") << "decoder " << this << " unable to reference frame: " << av_err2str(ret) << "\n";
+		return lookup;
+	}
+	lookup.frame = this->approximate_frame;
+	lookup.frame_secs = stand_in->pts * av_q2d(stream->time_base);
+	lookup.approximate = true;
+	this->last_video_frame_secs = lookup.frame_secs;
+	Logger::get("get_video_frame") << "frame at " << secs << "s not ready, standing in " << (lookup.seek_landing ? "seek keyframe" : "frame") << " at " << lookup.frame_secs << "s\n";
+	return lookup;
 }
 
 int Decoder_Ctx::read_and_decode(AVFormatContext* format_ctx, AVFrame** out_frame)
@@ -252,7 +435,9 @@ int Decoder_Ctx::read_and_decode(AVFormatContext* format_ctx, AVFrame** out_fram
 		this->errnum = av_read_frame(this->format_ctx, &pkt);
 		Logger::get("decoder") << "decoder " << this << " read frame for decoding, pts " << pkt.pts << "\n";
 		if (this->errnum < 0) {
-			Logger::get("error") << "decoder " << this << "Error reading frame: " << av_err2str(this->errnum) << "\n";
+			// AVERROR_EXIT means the interrupt callback cut the read short
+			if (this->errnum != AVERROR_EXIT)
+				Logger::get("error") << "decoder " << this << "Error reading frame: " << av_err2str(this->errnum) << "\n";
 			av_packet_unref(&pkt);
 			return this->errnum;
 		}
@@ -269,6 +454,18 @@ int Decoder_Ctx::read_and_decode(AVFormatContext* format_ctx, AVFrame** out_fram
 		if (codec_ctx == nullptr)
 			continue;
 
+		// jumping ahead, nothing before the keyframe needs decoding
+		if (codec_ctx == this->video_decoder_ctx && this->skip_until_key_pts != AV_NOPTS_VALUE) {
+			if (!(pkt.flags & AV_PKT_FLAG_KEY) || pkt.pts < this->skip_until_key_pts) {
+				this->packets_skipped += 1;
+				av_packet_unref(&pkt);
+				continue;
+			}
+			Logger::get("decoder") << "decoder " << this << " jumped to keyframe with pts " << pkt.pts << "\n";
+			avcodec_flush_buffers(codec_ctx);
+			this->skip_until_key_pts = AV_NOPTS_VALUE;
+		}
+
 		// decode the packet
 		*out_frame = decode_frame(codec_ctx, &pkt);
 		if (*out_frame == nullptr && this->errnum != AVERROR(EAGAIN))
@@ -282,14 +479,12 @@ int Decoder_Ctx::read_and_decode(AVFormatContext* format_ctx, AVFrame** out_fram
 int Decoder_Ctx::internal_start_decoding()
 {
 	while (!this->stop_decoding_thread) {
-		this->seeking_mutex.lock();
 		internal_seek();
-		this->seeking_mutex.unlock();
 
 		// wait until we need frames - switch to condition
 		int need_video_frames = this->video_stream_index >= 0 ? 10 : 0;
 		int need_audio_frames = this->audio_stream_index >= 0 ? 10 : 0;
-		if (this->video_frames.size() >= need_video_frames && this->audio_frames.size() >= need_audio_frames) {
+		if (this->frames->video_frames.size() >= need_video_frames && this->frames->audio_frames.size() >= need_audio_frames) {
 			std::this_thread::sleep_for(std::chrono::milliseconds(1));
 			continue;
 		}
@@ -298,17 +493,19 @@ int Decoder_Ctx::internal_start_decoding()
 		int stream_index = this->read_and_decode(this->format_ctx, &decoded_frame);
 
 		if (stream_index < 0) {
-			Logger::get("error") << "decoder " << this << "got an error while reading and decoding: " << av_err2str(this->errnum) << "\n";
+			if (!this->stop_decoding_thread)
+				Logger::get("error") << "decoder " << this << "got an error while reading and decoding: " << av_err2str(this->errnum) << "\n";
 			return stream_index;
 		} else if (stream_index == this->audio_stream_index) {
 			this->audio_mutex.lock();
-			this->audio_frames[decoded_frame->pts] = decoded_frame;
-			Logger::get("decoder") << "decoder " << this << " decoded a audio frame with pts " << decoded_frame->pts << ", cache now has " << this->audio_frames.size() << " frames\n";
+			this->frames->audio_frames[decoded_frame->pts] = decoded_frame;
+			Logger::get("decoder") << "decoder " << this << " decoded a audio frame with pts " << decoded_frame->pts << ", cache now has " << this->frames->audio_frames.size() << " frames\n";
 			this->audio_mutex.unlock();
 		} else if (stream_index == this->video_stream_index) {
+			update_late_policy(decoded_frame);
 			this->video_mutex.lock();
-			this->video_frames[decoded_frame->pts] = decoded_frame;
-			Logger::get("decoder") << "decoder " << this << " decoded a video frame with pts " << decoded_frame->pts << ", cache now has " << this->video_frames.size() << " frames\n";
+			this->frames->video_frames[decoded_frame->pts] = decoded_frame;
+			Logger::get("decoder") << "decoder " << this << " decoded a video frame with pts " << decoded_frame->pts << ", cache now has " << this->frames->video_frames.size() << " frames\n";
 			this->video_mutex.unlock();
 		}
 	}
@@ -337,62 +534,312 @@ AVFrame* Decoder_Ctx::decode_frame(AVCodecContext* codec_ctx, AVPacket* pkt)
 	return frame;
 }
 
-// returns pts for secs
-int64_t Decoder_Ctx::seek(float target_secs)
+float Decoder_Ctx::get_frame_duration_secs() const
+{
+	const AVStream* stream = this->get_video_stream();
+	if (stream == nullptr || stream->avg_frame_rate.num == 0)
+		return 0;
+	return av_q2d(av_inv_q(stream->avg_frame_rate));
+}
+
+// runs on the decoding thread for every decoded video frame
+void Decoder_Ctx::update_late_policy(const AVFrame* frame)
 {
-	Logger::get("decoder") << "decoder " << this << " decoder seeking to " << target_secs << "\n";
+	this->frames_decoded += 1;
+
+	// scrubbing sets its own skipping, and export wants every frame
+	if (this->keyframe_only || !this->realtime)
+		return;
+
+	float deadline = this->deadline_secs;
+	const AVStream* stream = this->get_video_stream();
+	float frame_secs = frame->pts * av_q2d(stream->time_base);
+	if (deadline < 0)
+		return;
+
+	// caught up, decode everything again
+	if (frame_secs >= deadline) {
+		this->late_streak = 0;
+		if (this->skipping_nonref) {
+			Logger::get("decoder") << "decoder " << this << " caught up, decoding all frames\n";
+			this->video_decoder_ctx->skip_frame = AVDISCARD_DEFAULT;
+			this->skipping_nonref = false;
+		}
+		return;
+	}
+
+	if (deadline - frame_secs < late_frames * this->get_frame_duration_secs()) {
+		this->late_streak = 0;
+		return;
+	}
+
+	this->late_streak += 1;
+	if (this->late_streak < sustained_late_frames)
+		return;
+
+	if (!this->skipping_nonref) {
+		Logger::get("decoder") << "decoder " << this << " " << deadline - frame_secs << "s behind, skipping non-reference frames\n";
+		this->video_decoder_ctx->skip_frame = AVDISCARD_NONREF;
+		this->skipping_nonref = true;
+	}
+
+	// still too far behind, jump to a keyframe between here and the deadline if the index has one
+	if (deadline - frame_secs > keyframe_jump_secs && this->skip_until_key_pts == AV_NOPTS_VALUE) {
+		AVStream* video_stream = this->format_ctx->streams[this->video_stream_index];
+		int index = av_index_search_timestamp(video_stream, this->get_pts_at(stream, deadline), AVSEEK_FLAG_BACKWARD);
+		if (index >= 0 && video_stream->index_entries[index].timestamp > frame->pts) {
+			this->skip_until_key_pts = video_stream->index_entries[index].timestamp;
+			this->keyframe_jumps += 1;
+			this->late_streak = 0;
+			Logger::get("decoder") << "decoder " << this << " " << deadline - frame_secs << "s behind, jumping to keyframe with pts " << this->skip_until_key_pts << "\n";
+		}
+	}
+}
+
+// call with video_mutex held
+void Decoder_Ctx::reset_late_policy()
+{
+	this->late_streak = 0;
+	this->skip_until_key_pts = AV_NOPTS_VALUE;
+	this->skipping_nonref = false;
+	this->last_returned_pts = AV_NOPTS_VALUE;
+}
+
+Decode_Stats Decoder_Ctx::get_decode_stats() const
+{
+	Decode_Stats stats;
+	stats.frames_decoded = this->frames_decoded;
+	stats.frames_dropped = this->frames_dropped;
+	stats.frames_late = this->frames_late;
+	stats.packets_skipped = this->packets_skipped;
+	stats.keyframe_jumps = this->keyframe_jumps;
+	stats.skipping_nonref = this->skipping_nonref;
+	stats.last_close_ms = this->last_close_ms;
+	stats.max_close_ms = this->max_close_ms;
+	return stats;
+}
+
+// returns an id for get_seek_status, a newer seek supersedes it
+int Decoder_Ctx::seek(float target_secs)
+{
+	return request_seek(target_secs, false);
+}
+
+int Decoder_Ctx::seek_keyframe(float target_secs)
+{
+	return request_seek(target_secs, true);
+}
+
+int Decoder_Ctx::request_seek(float target_secs, bool keyframe_only)
+{
+	Logger::get("decoder") << "decoder " << this << " decoder seeking to " << (keyframe_only ? "keyframe near " : "") << target_secs << "\n";
 	this->seeking_mutex.lock();
 	this->seek_secs = target_secs;
+	this->keyframe_only = keyframe_only;
+	// the last request's deadline is from before the seek, after a backward one every frame would look late
+	this->deadline_secs = -1;
+	int id = ++this->seek_generation;
 	this->seeking_mutex.unlock();
-	return av_q2d(this->get_video_stream()->time_base) * this->seek_secs;
+	return id;
+}
+
+bool Decoder_Ctx::is_seeking()
+{
+	std::lock_guard<std::mutex> lock(this->seeking_mutex);
+	return this->seek_secs != -1 || this->active_seek != 0;
+}
+
+bool Decoder_Ctx::is_keyframe_only() const
+{
+	return this->keyframe_only;
 }
 
+Seek_Status Decoder_Ctx::get_seek_status(int id)
+{
+	std::lock_guard<std::mutex> lock(this->seeking_mutex);
+	auto result = this->seek_results.find(id);
+	if (result != this->seek_results.end())
+		return result->second;
+	// not taken yet, or so old its result was forgotten
+	return id > this->last_taken_seek ? Seek_Status::Pending : Seek_Status::Superseded;
+}
+
+Seek_Status Decoder_Ctx::wait_for_seek(int id, int timeout_ms)
+{
+	auto timeout = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	while (true) {
+		Seek_Status status = get_seek_status(id);
+		if (status != Seek_Status::Pending || std::chrono::steady_clock::now() >= timeout)
+			return status;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+// true while the seek being decoded has been replaced by a newer one
+bool Decoder_Ctx::is_seek_superseded() const
+{
+	int active = this->active_seek;
+	return active != 0 && active != this->seek_generation;
+}
+
+// whether whatever the decoding thread is doing is no longer wanted
+bool Decoder_Ctx::should_interrupt() const
+{
+	return this->stop_decoding_thread || is_seek_superseded();
+}
+
+int Decoder_Ctx::interrupt_callback(void* opaque)
+{
+	return ((Decoder_Ctx*) opaque)->should_interrupt();
+}
+
+void Decoder_Ctx::finish_seek(int id, Seek_Status status)
+{
+	std::lock_guard<std::mutex> lock(this->seeking_mutex);
+	this->seek_results[id] = status;
+	while (this->seek_results.size() > max_seek_results)
+		this->seek_results.erase(this->seek_results.begin());
+	this->active_seek = 0;
+	Logger::get("decoder") << "decoder " << this << " seek " << id << (status == Seek_Status::Completed ? " completed" : status == Seek_Status::Superseded ? " superseded" : " failed") << "\n";
+}
+
+// closest keyframe on either side according to the stream index, pts itself without an index
+int64_t Decoder_Ctx::get_nearest_keyframe_pts(int64_t pts) const
+{
+	AVStream* stream = this->format_ctx->streams[this->video_stream_index];
+	int before = av_index_search_timestamp(stream, pts, AVSEEK_FLAG_BACKWARD);
+	int after = av_index_search_timestamp(stream, pts, 0);
+	if (before < 0 && after < 0)
+		return pts;
+	if (before < 0)
+		return stream->index_entries[after].timestamp;
+	if (after < 0)
+		return stream->index_entries[before].timestamp;
+
+	int64_t before_pts = stream->index_entries[before].timestamp;
+	int64_t after_pts = stream->index_entries[after].timestamp;
+	return pts - before_pts <= after_pts - pts ? before_pts : after_pts;
+}
+
+// runs the newest seek request, giving up between packets as soon as a newer one arrives
 int Decoder_Ctx::internal_seek()
 {
 	this->errnum = 0;
 
-	if (this->seek_secs == -1)
+	// take the newest request, the ones it replaced never started
+	this->seeking_mutex.lock();
+	if (this->seek_secs == -1) {
+		this->seeking_mutex.unlock();
 		return 0;
+	}
+	float target_secs = this->seek_secs;
+	bool keyframe_only = this->keyframe_only;
+	int id = this->seek_generation;
+	for (int skipped = this->last_taken_seek + 1; skipped < id; ++skipped)
+		this->seek_results[skipped] = Seek_Status::Superseded;
+	this->last_taken_seek = id;
+	this->active_seek = id;
+	this->seek_secs = -1;
+	this->seeking_mutex.unlock();
+
+	// seek to the previous iframe
+	int64_t seek_pts = target_secs / av_q2d(this->get_video_stream()->time_base);
+	if (keyframe_only) {
+		seek_pts = get_nearest_keyframe_pts(seek_pts);
+		// the scrub hasn't moved to another keyframe, it's still first in the cache
+		if (seek_pts == this->scrub_keyframe_pts) {
+			finish_seek(id, Seek_Status::Completed);
+			return 0;
+		}
+		this->scrub_keyframe_pts = seek_pts;
+	} else {
+		this->scrub_keyframe_pts = AV_NOPTS_VALUE;
+	}
 
+	// audio from before the seek is never wanted, video stays up until the new frames are ready
 	this->audio_mutex.lock();
-	this->video_mutex.lock();
+	this->frames->clear_audio();
+	this->audio_mutex.unlock();
 
+	// decode into a staging cache, readers keep using the current one without waiting on the seek
+	Frame_Cache* staging = new Frame_Cache();
 	reopen_audio_context();
 	reopen_video_context();
-	empty_frame_caches();
+	// a keyframe jump from before the seek doesn't apply to the new position
+	this->skip_until_key_pts = AV_NOPTS_VALUE;
 
-	// seek to the previous iframe
-	int64_t seek_pts = this->seek_secs / av_q2d(this->get_video_stream()->time_base);
-	av_seek_frame(this->format_ctx, this->video_stream_index, seek_pts, AVSEEK_FLAG_BACKWARD);
+	if (keyframe_only) {
+		// scrubbing only ever shows keyframes, so only decode those and don't bother deblocking them
+		this->video_decoder_ctx->skip_loop_filter = AVDISCARD_ALL;
+		this->video_decoder_ctx->skip_frame = AVDISCARD_NONKEY;
+	}
+
+	Seek_Status status = Seek_Status::Completed;
+	int ret = av_seek_frame(this->format_ctx, this->video_stream_index, seek_pts, AVSEEK_FLAG_BACKWARD);
 
 	// read packets until found the right pts on the right stream
-	if (this->seek_secs > 0) {
-		AVPacket pkt;
-		av_init_packet(&pkt);
+	if (ret >= 0 && target_secs > 0) {
 		while (true) {
+			if (should_interrupt()) {
+				status = Seek_Status::Superseded;
+				break;
+			}
+
 			AVFrame* decoded_frame;
 			int stream_index = this->read_and_decode(this->format_ctx, &decoded_frame);
 
 			if (stream_index < 0) {
-				Logger::get("error") << "decoder " << this << "Error reading video frame after seeking: " << av_err2str(this->errnum) << "\n";
-				return stream_index;
+				ret = stream_index;
+				break;
+			}
+
+			// the keyframe the seek landed on can be shown while decoding carries on to the exact frame
+			if (stream_index == this->video_stream_index && !keyframe_only && this->landing_seek != id) {
+				this->video_mutex.lock();
+				av_frame_unref(this->landing_frame);
+				if (av_frame_ref(this->landing_frame, decoded_frame) >= 0)
+					this->landing_seek = id;
+				this->video_mutex.unlock();
 			}
 
-			// this is the next video frame
-			if (stream_index == this->video_stream_index && decoded_frame->pts >= seek_pts) {
-				this->video_frames[decoded_frame->pts] = decoded_frame;
+			// this is the next video frame, without an index the first keyframe will do
+			if (stream_index == this->video_stream_index && (decoded_frame->pts >= seek_pts || keyframe_only)) {
+				staging->video_frames[decoded_frame->pts] = decoded_frame;
 				Logger::get("get_video_frame") << "seeked to a video frame with pts " << decoded_frame->pts << "\n";
 				break;
 			}
+			av_frame_free(&decoded_frame);
 		}
 	}
 
-	this->seek_secs = -1;
-
-	this->video_mutex.unlock();
-	this->audio_mutex.unlock();
+	// an interrupted read looks like an error
+	if (ret < 0 && should_interrupt()) {
+		status = Seek_Status::Superseded;
+		ret = 0;
+	} else if (ret < 0) {
+		Logger::get("error") << "decoder " << this << "Error reading video frame after seeking: " << av_err2str(ret) << "\n";
+		status = Seek_Status::Failed;
+	}
+	// a half finished scrub doesn't have its keyframe cached
+	if (status != Seek_Status::Completed)
+		this->scrub_keyframe_pts = AV_NOPTS_VALUE;
+
+	// a superseded seek leaves the old frames up, the next seek starts right away
+	// otherwise readers switch over with one pointer exchange
+	if (status != Seek_Status::Superseded) {
+		this->audio_mutex.lock();
+		this->video_mutex.lock();
+		std::swap(this->frames, staging);
+		av_frame_unref(this->landing_frame);
+		this->landing_seek = 0;
+		reset_late_policy();
+		this->video_mutex.unlock();
+		this->audio_mutex.unlock();
+	}
+	delete staging;
 
-	return 0;
+	finish_seek(id, status);
+	return ret;
 }
 
 int Decoder_Ctx::reopen_audio_context() {
@@ -452,6 +899,12 @@ int Decoder_Ctx::reopen_video_context() {
 		return ret;
 	}
 
+	// codecs without DR1 must use the default allocator
+	if (this->frame_pool != nullptr && (this->video_decoder->capabilities & AV_CODEC_CAP_DR1)) {
+		this->video_decoder_ctx->opaque = this;
+		this->video_decoder_ctx->get_buffer2 = &Decoder_Ctx::get_video_buffer;
+	}
+
 	if ((ret = avcodec_open2(this->video_decoder_ctx, this->video_decoder, nullptr)) < 0) {
 		Logger::get("error") << "decoder " << this << "Failed to open " << av_get_media_type_string(AVMEDIA_TYPE_VIDEO) << " codec\n";
 		return ret;
@@ -488,7 +941,16 @@ int Decoder_Ctx::internal_open_file(const std::string& filename)
 
 	close();
 
-	// open decoder file, and allocate format context
+	// allocate the format context first so opening can be interrupted too
+	this->format_ctx = avformat_alloc_context();
+	if (this->format_ctx == nullptr) {
+		Logger::get("error") << "decoder " << this << "Could not allocate format context\n";
+		return AVERROR(ENOMEM);
+	}
+	this->format_ctx->interrupt_callback.callback = &Decoder_Ctx::interrupt_callback;
+	this->format_ctx->interrupt_callback.opaque = this;
+
+	// open decoder file
 	ret = avformat_open_input(&this->format_ctx, filename.c_str(), nullptr, nullptr);
 	if (ret < 0) {
 		Logger::get("error") << "decoder " << this << "Could not open source file " << filename << ": " << av_err2str(ret) << "\n";
@@ -555,6 +1017,8 @@ const AVStream* Decoder_Ctx::get_video_stream() const
 
 const AVStream* Decoder_Ctx::get_audio_stream() const
 {
+	if (this->audio_stream_index < 0)
+		return nullptr;
 	return this->format_ctx->streams[this->audio_stream_index];
 }
 
@@ -573,6 +1037,34 @@ int Decoder_Ctx::get_num_frames_in(float duration_secs) const
 	return duration_secs * av_q2d(get_video_stream()->avg_frame_rate);
 }
 
+void Decoder_Ctx::set_frame_pool(Frame_Pool* pool)
+{
+	this->frame_pool = pool;
+}
+
+void Decoder_Ctx::set_direct_frames(bool enabled)
+{
+	this->direct_frames = enabled;
+}
+
+void Decoder_Ctx::set_realtime(bool enabled)
+{
+	this->realtime = enabled;
+}
+
+bool Decoder_Ctx::is_pooled_frame(const AVFrame* frame) const
+{
+	return this->frame_pool != nullptr && this->frame_pool->owns(frame);
+}
+
+int Decoder_Ctx::get_video_buffer(AVCodecContext* codec_ctx, AVFrame* frame, int flags)
+{
+	Decoder_Ctx* decoder = (Decoder_Ctx*) codec_ctx->opaque;
+	if (decoder->direct_frames && decoder->frame_pool->get_buffer(codec_ctx, frame) == 0)
+		return 0;
+	return avcodec_default_get_buffer2(codec_ctx, frame, flags);
+}
+
 int64_t Decoder_Ctx::get_pts_at(const AVStream* stream, float secs) const
 {
 	return secs / av_q2d(stream->time_base) + stream->start_time;
@@ -6,6 +6,7 @@
 #include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
 extern "C" {
 // ffmpeg headers
@@ -13,6 +14,63 @@ extern "C" {
 #include <libavformat/avformat.h>
 }
 
+// decoded frames keyed by pts
+// a seek fills a new cache while readers keep using the current one, then the two are swapped
+struct Frame_Cache {
+	std::map<int64_t, AVFrame*> video_frames;
+	std::map<int64_t, AVFrame*> audio_frames;
+
+	~Frame_Cache();
+	void clear_audio();
+	void clear_video();
+};
+
+// supplies memory for decoded video frames, see Decoder_Ctx::set_frame_pool
+class Frame_Pool {
+public:
+	virtual ~Frame_Pool() {}
+
+	// fills frame->buf, data and linesize, returns < 0 to fall back to the libav allocator
+	// called from decoding threads
+	virtual int get_buffer(AVCodecContext* codec_ctx, AVFrame* frame) = 0;
+	virtual bool owns(const AVFrame* frame) const = 0;
+};
+
+enum class Seek_Status {
+	Pending,
+	Completed,
+	// a newer seek arrived before this one finished
+	Superseded,
+	Failed,
+};
+
+struct Decode_Stats {
+	int frames_decoded = 0;
+	// passed over because a later frame was already due
+	int frames_dropped = 0;
+	// handed out for a later time because decoding hadn't got there yet
+	int frames_late = 0;
+	// video packets thrown away while jumping ahead to a keyframe
+	int packets_skipped = 0;
+	int keyframe_jumps = 0;
+	// whether non-reference frames are currently left undecoded
+	bool skipping_nonref = false;
+	// how long close() and file switches waited for the decoding thread
+	float last_close_ms = 0;
+	float max_close_ms = 0;
+};
+
+// what request_video_frame could hand out by its deadline
+struct Frame_Lookup {
+	AVFrame* frame = nullptr;
+	// file position of the returned frame
+	float frame_secs = 0;
+	// not the frame that was asked for, the decoder keeps working towards that one
+	bool approximate = false;
+	// the keyframe a running seek landed on, decoding continues from it to the exact frame
+	bool seek_landing = false;
+};
+
 class Decoder_Ctx {
 public:
 	// only written in decoding thread, only read when decoding thread is finished
@@ -20,6 +78,8 @@ public:
 	std::string filename;
 
 	static float get_duration_secs(const std::string& filename);
+	// keyframe positions from the container index, left empty if it has none, < 0 if the file can't be opened
+	static int get_keyframe_secs(const std::string& filename, std::vector<float>* keyframe_secs);
 
 	Decoder_Ctx();
 	virtual ~Decoder_Ctx();
@@ -28,13 +88,30 @@ public:
 
 	AVFrame* get_video_frame();
 	AVFrame* get_audio_frame();
+	// the first cached frame without taking it, valid until the next video request
 	AVFrame* peek_video_frame();
 	AVFrame* peek_audio_frame();
+	// wait up to seek_wait_ms for the exact frame, nullptr if it isn't decoded by then
+	// the frame stays valid until the next request for the same media, a seek swapping the caches can't free it
 	AVFrame* get_video_frame_at(float secs);
 	AVFrame* get_audio_frame_at(float secs);
+	// waits at most deadline_ms, then settles for the keyframe a running seek landed on
+	// or the cached frame nearest secs, and the seek keeps running so a later request gets the exact frame
+	// an approximate frame stays valid until the next request
+	Frame_Lookup request_video_frame(float secs, int deadline_ms);
+	static const int seek_wait_ms = 200;
 	float get_last_video_frame_secs();
 
-	int64_t seek(float target_secs);
+	// seeks are latest-wins, both return an id for get_seek_status
+	int seek(float target_secs);
+	// lands on the keyframe nearest target_secs and decodes only keyframes from there, until the next seek()
+	int seek_keyframe(float target_secs);
+	bool is_keyframe_only() const;
+	// whether a seek is queued or running
+	bool is_seeking();
+	Seek_Status get_seek_status(int id);
+	// returns Pending if the seek is still running after timeout_ms
+	Seek_Status wait_for_seek(int id, int timeout_ms);
 	int open_file(const std::string& filename);
 	int open_file(const std::string& filename, float seek_secs);
 
@@ -48,20 +125,66 @@ public:
 	int get_num_frames_in(float duration_secs) const;
 	int64_t get_pts_at(const AVStream* stream, float secs) const;
 
+	// must be set before opening a file
+	void set_frame_pool(Frame_Pool* pool);
+	// decode into the frame pool instead of libav buffers while enabled
+	void set_direct_frames(bool enabled);
+	// realtime decoders hand out frames late and skip decoding to keep up, on by default
+	// export turns it off so every frame is decoded and returned exactly
+	void set_realtime(bool enabled);
+	bool is_pooled_frame(const AVFrame* frame) const;
+
+	// late frame policy: frames further behind than late_frames frame durations are late,
+	// after sustained_late_frames of them in a row non-reference frames are no longer decoded,
+	// and past keyframe_jump_secs the decoder skips ahead to the last keyframe before the request
+	static const int late_frames = 3;
+	static const int sustained_late_frames = 8;
+	static constexpr float keyframe_jump_secs = 0.5f;
+	Decode_Stats get_decode_stats() const;
+
 protected:
+	// frames is only replaced while holding both mutexes
+	Frame_Cache* frames = new Frame_Cache();
 	std::mutex video_mutex;
-	std::map<int64_t, AVFrame*> video_frames;
 	float last_video_frame_secs = 0;
-
 	std::mutex audio_mutex;
-	std::map<int64_t, AVFrame*> audio_frames;
 
+	// guards the seek request and results, never held while seeking
 	std::mutex seeking_mutex;
+	std::atomic_int seek_generation{0};
+	int last_taken_seek = 0;
+	// the seek the decoding thread is working on, 0 if none
+	std::atomic_int active_seek{0};
+	static const size_t max_seek_results = 32;
+	std::map<int, Seek_Status> seek_results;
+	int request_seek(float target_secs, bool keyframe_only);
+	void finish_seek(int id, Seek_Status status);
+	bool is_seek_superseded() const;
+	bool should_interrupt() const;
+	// wired to the format context so blocking reads give up on close, file switches and superseded seeks
+	static int interrupt_callback(void* opaque);
 
 	int internal_open_file(const std::string& filename);
-	AVFrame* internal_get_frame_at(float secs, int media_type);
+	AVFrame* internal_get_frame_at(float secs, int media_type, int wait_ms);
+	// references to what internal_get_frame_at last handed out, guarded by the media's mutex
+	AVFrame* returned_video_frame = av_frame_alloc();
+	AVFrame* returned_audio_frame = av_frame_alloc();
+	std::map<int64_t, AVFrame*>* get_frame_cache(int media_type);
+	bool is_cached(const std::map<int64_t, AVFrame*>& cache, int64_t pts, int media_type) const;
+	void wait_for_frames(float secs, int media_type, int wait_ms, bool until_landing);
+	// guarded by video_mutex, holds a reference so a seek swapping the cache can't free it
+	AVFrame* approximate_frame = av_frame_alloc();
+	// first frame a running seek decoded, only meaningful while landing_seek is the active seek
+	// guarded by video_mutex
+	AVFrame* landing_frame = av_frame_alloc();
+	int landing_seek = 0;
+	bool has_landing_frame();
 
 	float seek_secs; // switch to atomic_float?
+	std::atomic_bool keyframe_only{false};
+	// decoding thread only
+	int64_t scrub_keyframe_pts = AV_NOPTS_VALUE;
+	int64_t get_nearest_keyframe_pts(int64_t pts) const;
 	std::atomic_bool stop_decoding_thread;
 	std::thread decoding_thread;
 	int internal_start_decoding();
@@ -71,6 +194,26 @@ protected:
 	void empty_frame_caches();
 	AVFrame* decode_frame(AVCodecContext* codec_ctx, AVPacket* pkt);
 
+	// the last time video was requested for, what decoding is racing against
+	std::atomic<float> deadline_secs{-1};
+	// guarded by video_mutex
+	int64_t last_returned_pts = AV_NOPTS_VALUE;
+	// decoding thread only
+	int late_streak = 0;
+	int64_t skip_until_key_pts = AV_NOPTS_VALUE;
+	void update_late_policy(const AVFrame* frame);
+	void reset_late_policy();
+	float get_frame_duration_secs() const;
+
+	std::atomic_int frames_decoded{0};
+	std::atomic_int frames_dropped{0};
+	std::atomic_int frames_late{0};
+	std::atomic_int packets_skipped{0};
+	std::atomic_int keyframe_jumps{0};
+	std::atomic_bool skipping_nonref{false};
+	std::atomic<float> last_close_ms{0};
+	std::atomic<float> max_close_ms{0};
+
 	// file
 	AVFormatContext* format_ctx;
 	int read_and_decode(AVFormatContext* format_ctx, AVFrame** out_frame);
@@ -81,6 +224,11 @@ protected:
 	AVCodecContext *video_decoder_ctx;
 	int reopen_video_context();
 
+	Frame_Pool* frame_pool = nullptr;
+	std::atomic_bool direct_frames;
+	std::atomic_bool realtime{true};
+	static int get_video_buffer(AVCodecContext* codec_ctx, AVFrame* frame, int flags);
+
 	// audio stream
 	int audio_stream_index;
 	AVCodec* audio_decoder;
@@ -0,0 +1,51 @@
+#include "decoders.h"
+
+#include "logger.h"
+
+Decoder_Pool::~Decoder_Pool()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->idle.clear();
+}
+
+std::unique_ptr<Decoder_Ctx> Decoder_Pool::take(const std::string& filename)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	for (auto it = this->idle.begin(); it != this->idle.end(); ++it) {
+		if ((*it)->filename != filename)
+			continue;
+		std::unique_ptr<Decoder_Ctx> decoder = std::move(*it);
+		this->idle.erase(it);
+		this->stats.reused += 1;
+		Logger::get("decoder_pool") << "reusing decoder on " << filename << "\n";
+		return decoder;
+	}
+	this->stats.misses += 1;
+	return nullptr;
+}
+
+void Decoder_Pool::give(std::unique_ptr<Decoder_Ctx> decoder)
+{
+	// never opened, nothing worth keeping
+	if (decoder == nullptr || decoder->filename.empty())
+		return;
+
+	std::unique_ptr<Decoder_Ctx> evicted;
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->idle.push_front(std::move(decoder));
+		if ((int) this->idle.size() > max_idle) {
+			evicted = std::move(this->idle.back());
+			this->idle.pop_back();
+			this->stats.evictions += 1;
+		}
+	}
+	// closing waits for the decoding thread, done outside the lock
+	evicted.reset();
+}
+
+Decoder_Pool_Stats Decoder_Pool::get_stats()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->stats;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "common.h"
+
+struct Decoder_Pool_Stats {
+	// decoders handed out already open on the file asked for
+	int reused = 0;
+	int misses = 0;
+	// closed to stay under max_idle
+	int evictions = 0;
+};
+
+// idle decoders left open on their files, shared by every track that's given the pool
+// a track switching files hands its old decoder back and takes one already open on the new file
+class Decoder_Pool {
+public:
+	// the least recently returned decoder is closed past this
+	static const int max_idle = 8;
+
+	~Decoder_Pool();
+
+	// a decoder open on filename, or nullptr if none is idle
+	std::unique_ptr<Decoder_Ctx> take(const std::string& filename);
+	void give(std::unique_ptr<Decoder_Ctx> decoder);
+
+	Decoder_Pool_Stats get_stats();
+
+protected:
+	std::mutex mutex;
+	// most recently returned first
+	std::list<std::unique_ptr<Decoder_Ctx>> idle;
+	Decoder_Pool_Stats stats;
+};
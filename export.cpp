@@ -0,0 +1,1370 @@
+#include "export.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <map>
+
+#include "logger.h"
+#include "probe.h"
+
+// the format of the track's first clip, a decoder that hasn't opened its file yet leaves it to the probe cache
+static Media_Info first_clip_format(Track& track)
+{
+	Media_Info format;
+	const AVCodecContext* source_ctx = track.get_decoder()->get_video_context();
+	const AVStream* source_stream = track.get_decoder()->get_video_stream();
+	if (source_ctx != nullptr && source_stream != nullptr) {
+		format.width = source_ctx->width;
+		format.height = source_ctx->height;
+		format.frame_rate = source_stream->avg_frame_rate;
+	} else if (track.get_clips().size() > 0) {
+		format = Probe_Cache::shared().get_info(track.get_clips().front().filename);
+	}
+	return format;
+}
+
+Exporter::Exporter(const Export_Settings& settings)
+{
+	this->settings = settings;
+}
+
+Exporter::~Exporter()
+{
+	cancel();
+	wait();
+	free_queued();
+}
+
+void Exporter::load(Video* source)
+{
+	this->settings.main_gain = source->main_track.get_gain();
+	this->settings.overlay_gain = source->overlay_track.get_gain();
+	load(source->main_track.pieces, source->overlay_track.pieces);
+}
+
+void Exporter::set_decoder_pool(Decoder_Pool* pool)
+{
+	this->video.set_decoder_pool(pool);
+}
+
+void Exporter::load(const std::list<TrackPiece>& main_pieces, const std::list<TrackPiece>& overlay_pieces)
+{
+	for (const TrackPiece& piece : main_pieces)
+		this->video.main_track.add(piece.file, piece.transition);
+	for (const TrackPiece& piece : overlay_pieces)
+		this->video.overlay_track.add(piece.file, piece.transition);
+	this->video.main_track.set_volume(this->settings.main_gain);
+	this->video.overlay_track.set_volume(this->settings.overlay_gain);
+	this->video.set_realtime(false);
+}
+
+int Exporter::start()
+{
+	if (this->settings.end_secs < 0)
+		this->settings.end_secs = this->video.get_duration_secs();
+
+	// full resolution unless asked otherwise
+	Media_Info first_clip = first_clip_format(this->video.main_track);
+	if (this->settings.width == 0 || this->settings.height == 0) {
+		this->settings.width = first_clip.width != 0 ? first_clip.width : 1280;
+		this->settings.height = first_clip.height != 0 ? first_clip.height : 720;
+	}
+	if (this->settings.frame_rate.num == 0)
+		this->settings.frame_rate = first_clip.frame_rate.num != 0 ? first_clip.frame_rate : AVRational{30, 1};
+	// 4:2:0 needs even dimensions
+	this->settings.width &= ~1;
+	this->settings.height &= ~1;
+
+	// ranges cut on the frame grid shouldn't gain a frame from rounding
+	this->frame_count = std::ceil((this->settings.end_secs - this->settings.start_secs) * av_q2d(this->settings.frame_rate) - 0.01);
+	if (this->frame_count <= 0) {
+		Logger::get("error") << "nothing to export between " << this->settings.start_secs << "s and " << this->settings.end_secs << "s\n";
+		return AVERROR(EINVAL);
+	}
+
+	int ret = open_output();
+	if (ret < 0) {
+		close_output();
+		return ret;
+	}
+	if (this->audio_encoder_ctx != nullptr)
+		this->video.set_audio_output(this->audio_encoder_ctx->sample_rate, this->audio_encoder_ctx->channels);
+	// audio is read from wherever the decoders are, so they start at the range
+	if (this->settings.start_secs > 0)
+		this->video.seek(this->settings.start_secs);
+
+	this->stats.frames_total = this->frame_count;
+	this->start_time = std::chrono::steady_clock::now();
+	Logger::get("export") << "exporting " << this->frame_count << " frames at " << this->settings.width << "x" << this->settings.height << " to " << this->settings.filename << "\n";
+
+	this->encoders_running = (this->video_encoder_ctx != nullptr ? 1 : 0) + (this->audio_encoder_ctx != nullptr ? 1 : 0);
+	this->stages_running = this->encoders_running + 2;
+	this->composite_thread = std::thread(&Exporter::composite, this);
+	if (this->video_encoder_ctx != nullptr)
+		this->video_encode_thread = std::thread(&Exporter::encode_video, this);
+	if (this->audio_encoder_ctx != nullptr)
+		this->audio_encode_thread = std::thread(&Exporter::encode_audio, this);
+	this->mux_thread = std::thread(&Exporter::mux, this);
+	return 0;
+}
+
+void Exporter::cancel()
+{
+	this->cancelled = true;
+	close_queues();
+}
+
+int Exporter::wait()
+{
+	for (std::thread* thread : { &this->composite_thread, &this->video_encode_thread, &this->audio_encode_thread, &this->mux_thread })
+		if (thread->joinable())
+			thread->join();
+	close_output();
+
+	std::lock_guard<std::mutex> lock(this->error_mutex);
+	return this->error;
+}
+
+bool Exporter::is_finished() const
+{
+	return this->stages_running == 0;
+}
+
+float Exporter::get_progress() const
+{
+	if (this->frame_count == 0)
+		return 0;
+	return (float) this->frames_encoded / this->frame_count;
+}
+
+Export_Stats Exporter::get_stats()
+{
+	std::lock_guard<std::mutex> lock(this->stats_mutex);
+	this->stats.elapsed_secs = std::chrono::duration_cast<std::chrono::duration<float>>(std::chrono::steady_clock::now() - this->start_time).count();
+	return this->stats;
+}
+
+void Exporter::fail(int ret, const std::string& what)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->error_mutex);
+		if (this->error == 0)
+			this->error = ret;
+	}
+	Logger::get("error") << "export failed " << what << ": " << av_err2str(ret) << "\n";
+	cancel();
+}
+
+void Exporter::close_queues()
+{
+	this->video_frames.close();
+	this->audio_frames.close();
+	this->packets.close();
+}
+
+void Exporter::free_queued()
+{
+	AVFrame* frame;
+	while (this->video_frames.try_pop(&frame))
+		av_frame_free(&frame);
+	while (this->audio_frames.try_pop(&frame))
+		av_frame_free(&frame);
+	AVPacket* packet;
+	while (this->packets.try_pop(&packet))
+		av_packet_free(&packet);
+}
+
+/*********
+* Output *
+*********/
+int Exporter::open_output()
+{
+	const char* format_name = this->settings.format_name.size() > 0 ? this->settings.format_name.c_str() : nullptr;
+	int ret = avformat_alloc_output_context2(&this->format_ctx, nullptr, format_name, this->settings.filename.c_str());
+	if (ret < 0) {
+		Logger::get("error") << "no output format for " << this->settings.filename << ": " << av_err2str(ret) << "\n";
+		return ret;
+	}
+
+	if (this->settings.video) {
+		ret = open_video_encoder();
+		if (ret < 0)
+			return ret;
+	}
+	if (this->settings.audio && (this->settings.audio_codec != AV_CODEC_ID_NONE || this->format_ctx->oformat->audio_codec != AV_CODEC_ID_NONE)) {
+		ret = open_audio_encoder();
+		if (ret < 0)
+			return ret;
+	}
+	if (this->video_encoder_ctx == nullptr && this->audio_encoder_ctx == nullptr) {
+		Logger::get("error") << "no streams to write to " << this->settings.filename << "\n";
+		return AVERROR(EINVAL);
+	}
+
+	if (!(this->format_ctx->oformat->flags & AVFMT_NOFILE)) {
+		ret = avio_open(&this->format_ctx->pb, this->settings.filename.c_str(), AVIO_FLAG_WRITE);
+		if (ret < 0) {
+			Logger::get("error") << "Could not open " << this->settings.filename << " for writing: " << av_err2str(ret) << "\n";
+			return ret;
+		}
+	}
+
+	ret = avformat_write_header(this->format_ctx, nullptr);
+	if (ret < 0) {
+		Logger::get("error") << "Could not write header to " << this->settings.filename << ": " << av_err2str(ret) << "\n";
+		return ret;
+	}
+	return 0;
+}
+
+int Exporter::open_video_encoder()
+{
+	AVCodecID codec_id = this->settings.video_codec != AV_CODEC_ID_NONE ? this->settings.video_codec : this->format_ctx->oformat->video_codec;
+	AVCodec* codec = avcodec_find_encoder(codec_id);
+	if (codec == nullptr) {
+		Logger::get("error") << "no video encoder for " << this->format_ctx->oformat->name << "\n";
+		return AVERROR_ENCODER_NOT_FOUND;
+	}
+
+	this->video_encoder_ctx = avcodec_alloc_context3(codec);
+	if (this->video_encoder_ctx == nullptr)
+		return AVERROR(ENOMEM);
+	AVCodecContext* ctx = this->video_encoder_ctx;
+	ctx->width = this->settings.width;
+	ctx->height = this->settings.height;
+	ctx->time_base = av_inv_q(this->settings.frame_rate);
+	ctx->framerate = this->settings.frame_rate;
+	ctx->pix_fmt = codec->pix_fmts != nullptr ? codec->pix_fmts[0] : AV_PIX_FMT_YUV420P;
+	if (this->settings.pix_fmt != AV_PIX_FMT_NONE)
+		ctx->pix_fmt = this->settings.pix_fmt;
+	ctx->bit_rate = this->settings.video_bit_rate;
+	if (this->settings.max_b_frames >= 0)
+		ctx->max_b_frames = this->settings.max_b_frames;
+	// by default the encoder gets every core the other stages leave over
+	ctx->thread_count = this->settings.threads;
+	if ((this->format_ctx->oformat->flags & AVFMT_GLOBALHEADER) && !this->settings.inline_headers)
+		ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	int ret = avcodec_open2(ctx, codec, nullptr);
+	if (ret < 0) {
+		Logger::get("error") << "Failed to open " << codec->name << " encoder: " << av_err2str(ret) << "\n";
+		return ret;
+	}
+
+	this->video_stream = avformat_new_stream(this->format_ctx, nullptr);
+	if (this->video_stream == nullptr)
+		return AVERROR(ENOMEM);
+	this->video_stream->time_base = ctx->time_base;
+	return avcodec_parameters_from_context(this->video_stream->codecpar, ctx);
+}
+
+int Exporter::open_audio_encoder()
+{
+	AVCodecID codec_id = this->settings.audio_codec != AV_CODEC_ID_NONE ? this->settings.audio_codec : this->format_ctx->oformat->audio_codec;
+	AVCodec* codec = avcodec_find_encoder(codec_id);
+	if (codec == nullptr) {
+		Logger::get("error") << "no audio encoder for " << this->format_ctx->oformat->name << "\n";
+		return AVERROR_ENCODER_NOT_FOUND;
+	}
+
+	// the mixer runs at whatever rate the encoder takes
+	int sample_rate = this->settings.sample_rate;
+	if (codec->supported_samplerates != nullptr) {
+		sample_rate = codec->supported_samplerates[0];
+		for (const int* rate = codec->supported_samplerates; *rate != 0; ++rate)
+			if (*rate == this->settings.sample_rate)
+				sample_rate = *rate;
+	}
+
+	this->audio_encoder_ctx = avcodec_alloc_context3(codec);
+	if (this->audio_encoder_ctx == nullptr)
+		return AVERROR(ENOMEM);
+	AVCodecContext* ctx = this->audio_encoder_ctx;
+	ctx->sample_fmt = codec->sample_fmts != nullptr ? codec->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+	ctx->sample_rate = sample_rate;
+	ctx->channels = this->settings.channels;
+	ctx->channel_layout = av_get_default_channel_layout(this->settings.channels);
+	ctx->bit_rate = this->settings.audio_bit_rate;
+	ctx->time_base = AVRational{1, sample_rate};
+	if (this->format_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+		ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	int ret = avcodec_open2(ctx, codec, nullptr);
+	if (ret < 0) {
+		Logger::get("error") << "Failed to open " << codec->name << " encoder: " << av_err2str(ret) << "\n";
+		return ret;
+	}
+
+	this->audio_stream = avformat_new_stream(this->format_ctx, nullptr);
+	if (this->audio_stream == nullptr)
+		return AVERROR(ENOMEM);
+	this->audio_stream->time_base = ctx->time_base;
+	return avcodec_parameters_from_context(this->audio_stream->codecpar, ctx);
+}
+
+void Exporter::close_output()
+{
+	avcodec_free_context(&this->video_encoder_ctx);
+	avcodec_free_context(&this->audio_encoder_ctx);
+	if (this->format_ctx != nullptr) {
+		if (!(this->format_ctx->oformat->flags & AVFMT_NOFILE))
+			avio_closep(&this->format_ctx->pb);
+		avformat_free_context(this->format_ctx);
+		this->format_ctx = nullptr;
+	}
+}
+
+/*********
+* Stages *
+*********/
+// walks the timeline one output frame at a time, mixing audio up to the end of each frame
+void Exporter::composite()
+{
+	float frame_secs = av_q2d(av_inv_q(this->settings.frame_rate));
+	AVRational sample_time_base = {1, this->audio_encoder_ctx != nullptr ? this->audio_encoder_ctx->sample_rate : 1};
+	AVFrame* previous = av_frame_alloc();
+	int64_t audio_pts = 0;
+
+	for (int64_t i = 0; i < this->frame_count && !this->cancelled; ++i) {
+		float secs = this->settings.start_secs + i * frame_secs;
+		if (this->video_encoder_ctx == nullptr) {
+			// the decoders only read so far ahead of the frames taken, so they're taken to keep the audio coming
+			this->video.main_track.get_video_frame(secs);
+			this->video.overlay_track.get_video_frame(secs);
+			this->frames_encoded = i + 1;
+			if (push_audio_until(i + 1, sample_time_base, &audio_pts) < 0)
+				break;
+			continue;
+		}
+
+		int ret = AVERROR(EAGAIN);
+		for (int attempt = 0; attempt < frame_retries && ret != 0 && !this->cancelled; ++attempt)
+			ret = this->video.get_video_frame(secs, this->settings.width, this->settings.height);
+
+		// filter outputs are reused, take a reference of our own
+		AVFrame* frame;
+		if (ret == 0) {
+			frame = av_frame_clone(this->video.out_video_frame);
+		} else if (previous->buf[0] != nullptr) {
+			Logger::get("export") << "no frame at " << secs << "s, repeating the previous one\n";
+			frame = av_frame_clone(previous);
+			std::lock_guard<std::mutex> lock(this->stats_mutex);
+			this->stats.frames_repeated += 1;
+		} else {
+			fail(ret, "getting the first frame");
+			break;
+		}
+		if (frame == nullptr) {
+			fail(AVERROR(ENOMEM), "referencing a frame");
+			break;
+		}
+		frame->pts = i;
+		av_frame_unref(previous);
+		av_frame_ref(previous, frame);
+		if (!this->video_frames.push(frame)) {
+			av_frame_free(&frame);
+			break;
+		}
+		{
+			std::lock_guard<std::mutex> lock(this->stats_mutex);
+			this->stats.frames_composited += 1;
+		}
+
+		// otherwise the decoders would keep every audio frame they read
+		if (this->audio_encoder_ctx == nullptr) {
+			this->video.main_track.skip_audio();
+			this->video.overlay_track.skip_audio();
+		} else if (push_audio_until(i + 1, sample_time_base, &audio_pts) < 0) {
+			break;
+		}
+	}
+
+	av_frame_free(&previous);
+	this->video_frames.close();
+	this->audio_frames.close();
+	this->stages_running -= 1;
+}
+
+int Exporter::push_audio_until(int64_t frame, AVRational sample_time_base, int64_t* pts)
+{
+	int64_t audio_end = av_rescale_q(frame, av_inv_q(this->settings.frame_rate), sample_time_base);
+	while (*pts < audio_end && !this->cancelled) {
+		int ret = push_audio_block(*pts);
+		if (ret < 0)
+			return ret;
+		*pts += Audio_Mixer::block_samples;
+	}
+	return 0;
+}
+
+int Exporter::push_audio_block(int64_t pts)
+{
+	// once the main track has run dry, don't wait on it for every block
+	int ret = this->video.get_next_audio_frame();
+	auto timeout = std::chrono::steady_clock::now() + audio_wait;
+	while (ret == AVERROR(EAGAIN) && !this->audio_starved && !this->cancelled && std::chrono::steady_clock::now() < timeout) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		ret = this->video.get_next_audio_frame();
+	}
+	this->audio_starved = ret < 0;
+
+	// the mix is written into the same frame every time, so the block gets its own copy
+	AVFrame* block = av_frame_alloc();
+	if (block == nullptr) {
+		fail(AVERROR(ENOMEM), "allocating an audio block");
+		return AVERROR(ENOMEM);
+	}
+	block->format = AV_SAMPLE_FMT_S16;
+	block->sample_rate = this->audio_encoder_ctx->sample_rate;
+	block->channels = this->audio_encoder_ctx->channels;
+	block->channel_layout = this->audio_encoder_ctx->channel_layout;
+	block->nb_samples = Audio_Mixer::block_samples;
+	int err = av_frame_get_buffer(block, 0);
+	if (err < 0) {
+		av_frame_free(&block);
+		fail(err, "allocating an audio block");
+		return err;
+	}
+	if (ret < 0)
+		av_samples_set_silence(block->data, 0, block->nb_samples, block->channels, AV_SAMPLE_FMT_S16);
+	else
+		av_frame_copy(block, this->video.out_audio_frame);
+	block->pts = pts;
+
+	if (!this->audio_frames.push(block)) {
+		av_frame_free(&block);
+		return AVERROR_EXIT;
+	}
+	std::lock_guard<std::mutex> lock(this->stats_mutex);
+	this->stats.audio_blocks += 1;
+	if (ret < 0)
+		this->stats.silent_blocks += 1;
+	return 0;
+}
+
+void Exporter::encode_video()
+{
+	AVCodecContext* ctx = this->video_encoder_ctx;
+	SwsContext* sws_ctx = nullptr;
+	AVFrame* frame;
+	while (this->video_frames.pop(&frame)) {
+		if (this->cancelled) {
+			av_frame_free(&frame);
+			continue;
+		}
+
+		// composited frames are rgb24 at the output size, the encoder wants its own pixel format
+		sws_ctx = sws_getCachedContext(sws_ctx, frame->width, frame->height, (AVPixelFormat) frame->format,
+				ctx->width, ctx->height, ctx->pix_fmt, SWS_BICUBIC, nullptr, nullptr, nullptr);
+		AVFrame* converted = av_frame_alloc();
+		converted->format = ctx->pix_fmt;
+		converted->width = ctx->width;
+		converted->height = ctx->height;
+		int ret = av_frame_get_buffer(converted, 0);
+		if (ret >= 0 && sws_ctx != nullptr) {
+			sws_scale(sws_ctx, frame->data, frame->linesize, 0, frame->height, converted->data, converted->linesize);
+			converted->pts = frame->pts;
+			ret = encode(ctx, this->video_stream, converted);
+		} else if (ret >= 0) {
+			ret = AVERROR(EINVAL);
+		}
+		av_frame_free(&converted);
+		av_frame_free(&frame);
+		if (ret < 0) {
+			fail(ret, "encoding video");
+			continue;
+		}
+		this->frames_encoded += 1;
+	}
+
+	if (!this->cancelled) {
+		int ret = encode(ctx, this->video_stream, nullptr);
+		if (ret < 0)
+			fail(ret, "flushing the video encoder");
+	}
+	sws_freeContext(sws_ctx);
+
+	if (--this->encoders_running == 0)
+		this->packets.close();
+	this->stages_running -= 1;
+}
+
+void Exporter::encode_audio()
+{
+	AVCodecContext* ctx = this->audio_encoder_ctx;
+	SwrContext* swr_ctx = swr_alloc_set_opts(nullptr,
+			ctx->channel_layout, ctx->sample_fmt, ctx->sample_rate,
+			ctx->channel_layout, AV_SAMPLE_FMT_S16, ctx->sample_rate, 0, nullptr);
+	if (swr_ctx == nullptr || swr_init(swr_ctx) < 0)
+		fail(AVERROR(EINVAL), "setting up audio conversion");
+
+	// encoders with a fixed frame size take exactly that many samples, blocks are regrouped through a fifo
+	int frame_size = ctx->frame_size;
+	if (frame_size == 0 || (ctx->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+		frame_size = Audio_Mixer::block_samples;
+	AVAudioFifo* fifo = av_audio_fifo_alloc(ctx->sample_fmt, ctx->channels, frame_size);
+	int64_t next_pts = 0;
+
+	AVFrame* block;
+	while (this->audio_frames.pop(&block)) {
+		if (this->cancelled) {
+			av_frame_free(&block);
+			continue;
+		}
+
+		uint8_t** converted = nullptr;
+		int max_samples = swr_get_out_samples(swr_ctx, block->nb_samples);
+		int ret = av_samples_alloc_array_and_samples(&converted, nullptr, ctx->channels, max_samples, ctx->sample_fmt, 0);
+		if (ret >= 0)
+			ret = swr_convert(swr_ctx, converted, max_samples, (const uint8_t**) block->data, block->nb_samples);
+		if (ret >= 0)
+			ret = av_audio_fifo_write(fifo, (void**) converted, ret);
+		if (ret >= 0)
+			ret = encode_audio_fifo(fifo, frame_size, &next_pts, false);
+		if (converted != nullptr)
+			av_freep(&converted[0]);
+		av_freep(&converted);
+		av_frame_free(&block);
+		if (ret < 0)
+			fail(ret, "encoding audio");
+	}
+
+	if (!this->cancelled) {
+		int ret = encode_audio_fifo(fifo, frame_size, &next_pts, true);
+		if (ret >= 0)
+			ret = encode(ctx, this->audio_stream, nullptr);
+		if (ret < 0)
+			fail(ret, "flushing the audio encoder");
+	}
+	av_audio_fifo_free(fifo);
+	swr_free(&swr_ctx);
+
+	if (--this->encoders_running == 0)
+		this->packets.close();
+	this->stages_running -= 1;
+}
+
+// encodes whole encoder frames from the fifo, and the short remainder when flushing
+int Exporter::encode_audio_fifo(AVAudioFifo* fifo, int frame_size, int64_t* next_pts, bool flush)
+{
+	AVCodecContext* ctx = this->audio_encoder_ctx;
+	while (av_audio_fifo_size(fifo) >= frame_size || (flush && av_audio_fifo_size(fifo) > 0)) {
+		AVFrame* frame = av_frame_alloc();
+		frame->nb_samples = std::min(frame_size, av_audio_fifo_size(fifo));
+		frame->format = ctx->sample_fmt;
+		frame->sample_rate = ctx->sample_rate;
+		frame->channels = ctx->channels;
+		frame->channel_layout = ctx->channel_layout;
+		int ret = av_frame_get_buffer(frame, 0);
+		if (ret >= 0)
+			ret = av_audio_fifo_read(fifo, (void**) frame->data, frame->nb_samples);
+		if (ret >= 0) {
+			frame->pts = *next_pts;
+			*next_pts += frame->nb_samples;
+			ret = encode(ctx, this->audio_stream, frame);
+		}
+		av_frame_free(&frame);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+int Exporter::encode(AVCodecContext* encoder_ctx, AVStream* stream, AVFrame* frame)
+{
+	int ret = avcodec_send_frame(encoder_ctx, frame);
+	if (ret < 0)
+		return ret;
+
+	while (true) {
+		AVPacket* packet = av_packet_alloc();
+		if (packet == nullptr)
+			return AVERROR(ENOMEM);
+		ret = avcodec_receive_packet(encoder_ctx, packet);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+			av_packet_free(&packet);
+			return 0;
+		} else if (ret < 0) {
+			av_packet_free(&packet);
+			return ret;
+		}
+
+		av_packet_rescale_ts(packet, encoder_ctx->time_base, stream->time_base);
+		packet->stream_index = stream->index;
+		if (!this->packets.push(packet)) {
+			av_packet_free(&packet);
+			return AVERROR_EXIT;
+		}
+	}
+}
+
+void Exporter::mux()
+{
+	AVPacket* packet;
+	while (this->packets.pop(&packet)) {
+		if (this->cancelled) {
+			av_packet_free(&packet);
+			continue;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(this->stats_mutex);
+			if (this->video_stream != nullptr && packet->stream_index == this->video_stream->index)
+				this->stats.video_packets += 1;
+			else
+				this->stats.audio_packets += 1;
+		}
+		// takes the packet's data either way
+		int ret = av_interleaved_write_frame(this->format_ctx, packet);
+		av_packet_free(&packet);
+		if (ret < 0)
+			fail(ret, "writing a packet");
+	}
+
+	if (!this->cancelled) {
+		int ret = av_write_trailer(this->format_ctx);
+		if (ret < 0)
+			fail(ret, "writing the trailer");
+		else
+			Logger::get("export") << "finished " << this->settings.filename << "\n";
+	}
+	this->stages_running -= 1;
+}
+
+/**********************
+* Segmented_Exporter *
+**********************/
+Segmented_Exporter::Segmented_Exporter(const Export_Settings& settings, int jobs)
+{
+	this->settings = settings;
+	this->jobs = jobs > 0 ? jobs : std::max(1u, std::thread::hardware_concurrency());
+}
+
+Segmented_Exporter::~Segmented_Exporter()
+{
+	cancel();
+	wait();
+}
+
+void Segmented_Exporter::set_decoder_pool(Decoder_Pool* pool)
+{
+	this->decoder_pool = pool;
+}
+
+void Segmented_Exporter::load(Video* source)
+{
+	this->main_pieces = source->main_track.pieces;
+	this->overlay_pieces = source->overlay_track.pieces;
+	this->main_clips = source->main_track.get_clips();
+	this->overlay_clips = source->overlay_track.get_clips();
+	this->duration_secs = source->get_duration_secs();
+	this->settings.main_gain = source->main_track.get_gain();
+	this->settings.overlay_gain = source->overlay_track.get_gain();
+
+	// every segment has to come out the same for the remux, so nothing is left for them to pick
+	Media_Info first_clip = first_clip_format(source->main_track);
+	if (this->settings.width == 0 || this->settings.height == 0) {
+		this->settings.width = first_clip.width != 0 ? first_clip.width : 1280;
+		this->settings.height = first_clip.height != 0 ? first_clip.height : 720;
+	}
+	if (this->settings.frame_rate.num == 0)
+		this->settings.frame_rate = first_clip.frame_rate.num != 0 ? first_clip.frame_rate : AVRational{30, 1};
+}
+
+int Segmented_Exporter::start()
+{
+	if (this->settings.end_secs < 0)
+		this->settings.end_secs = this->duration_secs;
+
+	const char* format_name = this->settings.format_name.size() > 0 ? this->settings.format_name.c_str() : nullptr;
+	AVOutputFormat* format = av_guess_format(format_name, this->settings.filename.c_str(), nullptr);
+	if (format == nullptr) {
+		Logger::get("error") << "no output format for " << this->settings.filename << "\n";
+		return AVERROR_MUXER_NOT_FOUND;
+	}
+	this->frame_count = std::ceil((this->settings.end_secs - this->settings.start_secs) * av_q2d(this->settings.frame_rate) - 0.01);
+	if (this->frame_count <= 0) {
+		Logger::get("error") << "nothing to export between " << this->settings.start_secs << "s and " << this->settings.end_secs << "s\n";
+		return AVERROR(EINVAL);
+	}
+
+	// a smart render takes its codecs from the sources it copies, otherwise
+	// segments are written in another container, but with the codecs the output wants
+	if (!this->settings.smart_render || !plan_smart_segments()) {
+		if (this->settings.smart_render)
+			Logger::get("export") << "nothing to copy, encoding everything\n";
+		plan_segments();
+	}
+	if (this->settings.video_codec == AV_CODEC_ID_NONE)
+		this->settings.video_codec = format->video_codec;
+	if (this->settings.audio_codec == AV_CODEC_ID_NONE)
+		this->settings.audio_codec = format->audio_codec;
+	if (!avformat_query_codec(format, this->settings.video_codec, FF_COMPLIANCE_NORMAL)) {
+		Logger::get("error") << format->name << " can't hold " << avcodec_get_name(this->settings.video_codec) << "\n";
+		return AVERROR(EINVAL);
+	}
+	// b-frames would give each segment a dts before its first pts, overlapping the segment before
+	this->settings.max_b_frames = 0;
+	// each segment is a separate encoder with its own headers, and the concat only keeps the first one's
+	this->settings.inline_headers = true;
+	if (this->settings.audio && this->settings.audio_codec != AV_CODEC_ID_NONE) {
+		this->audio.filename = this->settings.filename + ".audio.mkv";
+		this->audio.frame_count = this->frame_count;
+	}
+
+	this->start_time = std::chrono::steady_clock::now();
+	this->run_thread = std::thread(&Segmented_Exporter::run, this);
+	return 0;
+}
+
+void Segmented_Exporter::cancel()
+{
+	this->cancelled = true;
+	std::lock_guard<std::mutex> lock(this->segments_mutex);
+	for (Segment& segment : this->segments)
+		if (segment.exporter != nullptr)
+			segment.exporter->cancel();
+	if (this->audio.exporter != nullptr)
+		this->audio.exporter->cancel();
+}
+
+int Segmented_Exporter::wait()
+{
+	if (this->run_thread.joinable())
+		this->run_thread.join();
+	std::lock_guard<std::mutex> lock(this->error_mutex);
+	return this->error;
+}
+
+bool Segmented_Exporter::is_finished() const
+{
+	return this->finished;
+}
+
+float Segmented_Exporter::get_progress()
+{
+	if (this->frame_count == 0)
+		return 0;
+	std::lock_guard<std::mutex> lock(this->segments_mutex);
+	float frames = 0;
+	for (Segment& segment : this->segments) {
+		if (segment.done)
+			frames += segment.frame_count;
+		else if (segment.exporter != nullptr)
+			frames += segment.exporter->get_progress() * segment.frame_count;
+		else
+			frames += segment.progress * segment.frame_count;
+	}
+	return frames / this->frame_count;
+}
+
+Export_Stats Segmented_Exporter::get_stats()
+{
+	Export_Stats stats;
+	std::lock_guard<std::mutex> lock(this->segments_mutex);
+	std::vector<Segment*> exported;
+	for (Segment& segment : this->segments)
+		exported.push_back(&segment);
+	exported.push_back(&this->audio);
+	for (Segment* segment : exported) {
+		Export_Stats segment_stats = segment->exporter != nullptr ? segment->exporter->get_stats() : segment->stats;
+		stats.frames_composited += segment_stats.frames_composited;
+		stats.frames_copied += segment_stats.frames_copied;
+		stats.frames_repeated += segment_stats.frames_repeated;
+		stats.audio_blocks += segment_stats.audio_blocks;
+		stats.silent_blocks += segment_stats.silent_blocks;
+		stats.video_packets += segment_stats.video_packets;
+		stats.audio_packets += segment_stats.audio_packets;
+	}
+	stats.frames_total = this->frame_count;
+	stats.segments = this->segments.size();
+	stats.packets_dropped = this->packets_dropped;
+	stats.elapsed_secs = std::chrono::duration_cast<std::chrono::duration<float>>(std::chrono::steady_clock::now() - this->start_time).count();
+	return stats;
+}
+
+void Segmented_Exporter::fail(int ret, const std::string& what)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->error_mutex);
+		if (this->error == 0)
+			this->error = ret;
+	}
+	Logger::get("error") << "export failed " << what << ": " << av_err2str(ret) << "\n";
+	cancel();
+}
+
+// timeline positions a segment can start at without decoding frames it throws away,
+// clip starts and source keyframes, but not inside a fade or overlay effect whose filter would restart
+std::vector<float> Segmented_Exporter::get_split_candidates()
+{
+	std::vector<float> candidates;
+	std::map<std::string, std::vector<float>> keyframes;
+	for (const Clip& clip : this->main_clips) {
+		candidates.push_back(clip.video_start_secs);
+		if (clip.effect != FilterEffect::None)
+			continue;
+		if (keyframes.count(clip.filename) == 0)
+			keyframes[clip.filename] = Probe_Cache::shared().get_keyframe_secs(clip.filename);
+		for (float keyframe_secs : keyframes[clip.filename])
+			if (keyframe_secs > clip.file_start_secs && keyframe_secs < clip.file_start_secs + clip.duration_secs)
+				candidates.push_back(clip.video_start_secs + keyframe_secs - clip.file_start_secs);
+	}
+
+	auto inside_effect = [](const std::vector<Clip>& clips, float secs) {
+		for (const Clip& clip : clips)
+			if (clip.effect != FilterEffect::None && clip.video_start_secs < secs && secs < clip.video_start_secs + clip.duration_secs)
+				return true;
+		return false;
+	};
+	candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [&](float secs) {
+		return inside_effect(this->main_clips, secs) || inside_effect(this->overlay_clips, secs);
+	}), candidates.end());
+	return candidates;
+}
+
+void Segmented_Exporter::plan_segments()
+{
+	float start_secs = this->settings.start_secs;
+	float range_secs = this->settings.end_secs - start_secs;
+	double fps = av_q2d(this->settings.frame_rate);
+	int count = std::max(1, std::min(this->jobs, (int) (range_secs / min_segment_secs)));
+
+	std::vector<float> candidates;
+	if (count > 1)
+		candidates = get_split_candidates();
+
+	// each split goes to the candidate nearest an even share of the range
+	std::vector<int64_t> boundaries = { 0 };
+	for (int k = 1; k < count; ++k) {
+		float split_secs = start_secs + k * range_secs / count;
+		// no candidates, split where the share ends and let that segment start on a fresh keyframe
+		float best = candidates.size() > 0 ? candidates.front() : split_secs;
+		for (float candidate : candidates)
+			if (std::abs(candidate - split_secs) < std::abs(best - split_secs))
+				best = candidate;
+		int64_t frame = std::llround((best - start_secs) * fps);
+		if (frame > boundaries.back() && frame < this->frame_count)
+			boundaries.push_back(frame);
+	}
+	boundaries.push_back(this->frame_count);
+
+	this->segments.clear();
+	this->segments.resize(boundaries.size() - 1);
+	for (size_t i = 0; i < this->segments.size(); ++i) {
+		this->segments[i].first_frame = boundaries[i];
+		this->segments[i].frame_count = boundaries[i + 1] - boundaries[i];
+		this->segments[i].filename = this->settings.filename + ".part" + std::to_string(i) + ".mkv";
+		Logger::get("export") << "segment " << i << " from frame " << boundaries[i] << " for " << this->segments[i].frame_count << " frames\n";
+	}
+}
+
+// reads what a source would need the output to match, false if it has nothing that could be copied
+bool Segmented_Exporter::probe_copy_format(const std::string& filename, Copy_Format* format)
+{
+	AVFormatContext* format_ctx = nullptr;
+	int ret = avformat_open_input(&format_ctx, filename.c_str(), nullptr, nullptr);
+	if (ret >= 0)
+		ret = avformat_find_stream_info(format_ctx, nullptr);
+	if (ret < 0) {
+		Logger::get("error") << "Could not open source file " << filename << ": " << av_err2str(ret) << "\n";
+		avformat_close_input(&format_ctx);
+		return false;
+	}
+
+	// only the video is copied, the audio is always mixed from the timeline
+	int video_index = av_find_best_stream(format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+	if (video_index >= 0) {
+		const AVStream* video_stream = format_ctx->streams[video_index];
+		format->video_codec = video_stream->codecpar->codec_id;
+		format->width = video_stream->codecpar->width;
+		format->height = video_stream->codecpar->height;
+		format->pix_fmt = video_stream->codecpar->format;
+		format->frame_rate = video_stream->avg_frame_rate;
+	}
+	avformat_close_input(&format_ctx);
+	return video_index >= 0;
+}
+
+// whether the exporter can encode the cuts so they look like the copied packets
+bool Segmented_Exporter::can_encode_as(const Copy_Format& format)
+{
+	if (this->settings.width != format.width || this->settings.height != format.height || (format.width & 1) || (format.height & 1))
+		return false;
+	if (av_cmp_q(this->settings.frame_rate, format.frame_rate) != 0)
+		return false;
+	if (this->settings.video_codec != AV_CODEC_ID_NONE && this->settings.video_codec != format.video_codec)
+		return false;
+
+	AVCodec* video_codec = avcodec_find_encoder(format.video_codec);
+	if (video_codec == nullptr)
+		return false;
+	bool has_pix_fmt = video_codec->pix_fmts == nullptr;
+	for (const AVPixelFormat* pix_fmt = video_codec->pix_fmts; pix_fmt != nullptr && *pix_fmt != AV_PIX_FMT_NONE; ++pix_fmt)
+		has_pix_fmt = has_pix_fmt || *pix_fmt == format.pix_fmt;
+	if (!has_pix_fmt)
+		return false;
+
+	const char* format_name = this->settings.format_name.size() > 0 ? this->settings.format_name.c_str() : nullptr;
+	AVOutputFormat* output_format = av_guess_format(format_name, this->settings.filename.c_str(), nullptr);
+	return output_format != nullptr && avformat_query_codec(output_format, format.video_codec, FF_COMPLIANCE_NORMAL) != 0;
+}
+
+// plain clips with nothing on top are copied between the first and last keyframe inside them,
+// the partial gops at either end, effects, overlays and anything in another format are encoded
+bool Segmented_Exporter::plan_smart_segments()
+{
+	float start_secs = this->settings.start_secs;
+	float end_secs = this->settings.end_secs;
+	double fps = av_q2d(this->settings.frame_rate);
+
+	Copy_Format reference;
+	bool has_reference = false;
+	std::map<std::string, bool> copyable;
+	std::map<std::string, std::vector<float>> keyframes;
+	std::vector<Segment> copies;
+	for (const Clip& clip : this->main_clips) {
+		float clip_start = std::max(clip.video_start_secs, start_secs);
+		float clip_end = std::min(clip.video_start_secs + clip.duration_secs, end_secs);
+		if (clip.effect != FilterEffect::None || clip_end - clip_start < min_copy_secs)
+			continue;
+		bool covered = false;
+		for (const Clip& overlay : this->overlay_clips)
+			covered = covered || (overlay.video_start_secs < clip_end && overlay.video_start_secs + overlay.duration_secs > clip_start);
+		if (covered)
+			continue;
+
+		// the first copyable source sets the format, the rest have to match it
+		if (copyable.count(clip.filename) == 0) {
+			Copy_Format format;
+			bool can_copy = probe_copy_format(clip.filename, &format);
+			if (can_copy && !has_reference) {
+				can_copy = can_encode_as(format);
+				has_reference = can_copy;
+				reference = format;
+			} else if (can_copy) {
+				can_copy = format.video_codec == reference.video_codec && format.width == reference.width && format.height == reference.height
+					&& format.pix_fmt == reference.pix_fmt && av_cmp_q(format.frame_rate, reference.frame_rate) == 0;
+			}
+			copyable[clip.filename] = can_copy;
+			if (can_copy)
+				keyframes[clip.filename] = Probe_Cache::shared().get_keyframe_secs(clip.filename);
+			else
+				Logger::get("export") << clip.filename << " doesn't match the output, encoding it\n";
+		}
+		if (!copyable[clip.filename])
+			continue;
+
+		// the copy runs from a keyframe to the keyframe that starts the next gop, never past the clip
+		float file_start = clip.file_start_secs + clip_start - clip.video_start_secs;
+		float file_end = file_start + clip_end - clip_start;
+		float first_keyframe = -1;
+		float last_keyframe = -1;
+		for (float keyframe_secs : keyframes[clip.filename]) {
+			if (keyframe_secs < file_start || keyframe_secs > file_end)
+				continue;
+			if (first_keyframe < 0)
+				first_keyframe = keyframe_secs;
+			last_keyframe = keyframe_secs;
+		}
+		if (first_keyframe < 0 || last_keyframe - first_keyframe < min_copy_secs)
+			continue;
+
+		Segment copy;
+		copy.copy = true;
+		copy.source_filename = clip.filename;
+		copy.source_start_secs = first_keyframe;
+		copy.source_end_secs = last_keyframe;
+		copy.first_frame = std::llround((clip.video_start_secs + first_keyframe - clip.file_start_secs - start_secs) * fps);
+		copy.frame_count = std::llround((clip.video_start_secs + last_keyframe - clip.file_start_secs - start_secs) * fps) - copy.first_frame;
+		copies.push_back(std::move(copy));
+	}
+	if (copies.size() == 0)
+		return false;
+
+	// everything between the copies is encoded
+	this->segments.clear();
+	int64_t frame = 0;
+	auto add_encoded = [this](int64_t first_frame, int64_t end_frame) {
+		Segment segment;
+		segment.first_frame = first_frame;
+		segment.frame_count = end_frame - first_frame;
+		segment.filename = this->settings.filename + ".part" + std::to_string(this->segments.size()) + ".mkv";
+		this->segments.push_back(std::move(segment));
+	};
+	for (Segment& copy : copies) {
+		// rounding to the frame grid can pull a copy onto the one before
+		if (copy.first_frame < frame)
+			continue;
+		if (copy.first_frame > frame)
+			add_encoded(frame, copy.first_frame);
+		frame = copy.first_frame + copy.frame_count;
+		this->segments.push_back(std::move(copy));
+	}
+	if (frame < this->frame_count)
+		add_encoded(frame, this->frame_count);
+	for (size_t i = 0; i < this->segments.size(); ++i)
+		Logger::get("export") << "segment " << i << (this->segments[i].copy ? " copied" : " encoded") << " from frame " << this->segments[i].first_frame << " for " << this->segments[i].frame_count << " frames\n";
+
+	// the cuts are encoded to look like the copies, start() puts their parameter sets inline since they won't match the copies' headers
+	this->settings.video_codec = reference.video_codec;
+	this->settings.pix_fmt = (AVPixelFormat) reference.pix_fmt;
+	return true;
+}
+
+void Segmented_Exporter::run()
+{
+	std::vector<std::thread> workers;
+	if (this->audio.filename.size() > 0)
+		workers.push_back(std::thread(&Segmented_Exporter::export_audio, this));
+	for (int i = 0; i < this->jobs && i < (int) this->segments.size(); ++i)
+		workers.push_back(std::thread(&Segmented_Exporter::work, this, i));
+	for (std::thread& worker : workers)
+		worker.join();
+
+	if (!this->cancelled) {
+		int ret = concat();
+		if (ret < 0)
+			fail(ret, "joining the segments");
+		else
+			Logger::get("export") << "finished " << this->settings.filename << " from " << this->segments.size() << " segments\n";
+	}
+	for (Segment& segment : this->segments)
+		if (!segment.copy)
+			std::remove(segment.filename.c_str());
+	if (this->audio.filename.size() > 0)
+		std::remove(this->audio.filename.c_str());
+	this->finished = true;
+}
+
+// exports segments until none are left
+void Segmented_Exporter::work(int worker)
+{
+	double frame_secs = av_q2d(av_inv_q(this->settings.frame_rate));
+	while (!this->cancelled) {
+		int i = this->next_segment++;
+		if (i >= (int) this->segments.size())
+			return;
+		Segment& segment = this->segments[i];
+		// copied while joining
+		if (segment.copy) {
+			std::lock_guard<std::mutex> lock(this->segments_mutex);
+			segment.stats.frames_copied = segment.frame_count;
+			segment.done = true;
+			continue;
+		}
+
+		Export_Settings settings = this->settings;
+		settings.filename = segment.filename;
+		settings.format_name = segment_format;
+		settings.audio = false;
+		settings.start_secs = this->settings.start_secs + segment.first_frame * frame_secs;
+		settings.end_secs = this->settings.start_secs + (segment.first_frame + segment.frame_count) * frame_secs;
+		int ret = export_segment(worker, &segment, settings);
+		{
+			std::lock_guard<std::mutex> lock(this->segments_mutex);
+			segment.done = ret >= 0;
+		}
+		if (ret < 0 && !this->cancelled)
+			fail(ret, "exporting segment " + std::to_string(i));
+	}
+}
+
+// always runs here, even when the segments go to workers, the video is only decoded for it
+void Segmented_Exporter::export_audio()
+{
+	Export_Settings settings = this->settings;
+	settings.filename = this->audio.filename;
+	settings.format_name = segment_format;
+	settings.video = false;
+	int ret = Segmented_Exporter::export_segment(-1, &this->audio, settings);
+	{
+		std::lock_guard<std::mutex> lock(this->segments_mutex);
+		this->audio.done = ret >= 0;
+	}
+	if (ret < 0 && !this->cancelled)
+		fail(ret, "exporting the audio");
+}
+
+int Segmented_Exporter::export_segment(int, Segment* segment, const Export_Settings& settings)
+{
+	std::unique_ptr<Exporter> exporter(new Exporter(settings));
+	exporter->set_decoder_pool(this->decoder_pool);
+	exporter->load(this->main_pieces, this->overlay_pieces);
+	Exporter* running = exporter.get();
+	{
+		std::lock_guard<std::mutex> lock(this->segments_mutex);
+		if (this->cancelled)
+			return AVERROR_EXIT;
+		segment->exporter = std::move(exporter);
+	}
+
+	int ret = running->start();
+	if (ret >= 0)
+		ret = running->wait();
+
+	{
+		std::lock_guard<std::mutex> lock(this->segments_mutex);
+		segment->stats = running->get_stats();
+		// closes the segment's decoders before the next one opens its own
+		exporter = std::move(segment->exporter);
+	}
+	exporter.reset();
+	return ret;
+}
+
+// opens an encoded segment, or the source of a copied one positioned at its first keyframe
+int Segmented_Exporter::open_segment(const Segment& segment, AVMediaType media_type, Segment_Input* input)
+{
+	const std::string& filename = segment.copy ? segment.source_filename : segment.filename;
+	int ret = avformat_open_input(&input->format_ctx, filename.c_str(), nullptr, nullptr);
+	if (ret >= 0)
+		ret = avformat_find_stream_info(input->format_ctx, nullptr);
+	if (ret < 0) {
+		Logger::get("error") << "Could not open segment " << filename << ": " << av_err2str(ret) << "\n";
+		return ret;
+	}
+
+	AVFormatContext* ctx = input->format_ctx;
+	int stream_index = av_find_best_stream(ctx, media_type, -1, -1, nullptr, 0);
+	std::vector<int> mapped;
+	if (stream_index >= 0)
+		mapped.push_back(stream_index);
+
+	input->stream_map.assign(ctx->nb_streams, -1);
+	for (size_t i = 0; i < mapped.size(); ++i) {
+		AVStream* stream = ctx->streams[mapped[i]];
+		input->stream_map[mapped[i]] = i;
+		int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+		input->origins.push_back(segment.copy ? start + std::llround(segment.source_start_secs / av_q2d(stream->time_base)) : 0);
+		input->ends.push_back(segment.copy ? start + std::llround(segment.source_end_secs / av_q2d(stream->time_base)) : INT64_MAX);
+
+		// length-prefixed h.264 and hevc keep their parameter sets in the header, annex b already has them inline
+		const AVCodecParameters* par = stream->codecpar;
+		const char* filter_name = nullptr;
+		if (this->settings.inline_headers && par->extradata_size > 0 && par->extradata[0] == 1) {
+			if (par->codec_id == AV_CODEC_ID_H264)
+				filter_name = "h264_mp4toannexb";
+			else if (par->codec_id == AV_CODEC_ID_HEVC)
+				filter_name = "hevc_mp4toannexb";
+		}
+		AVBSFContext* filter = nullptr;
+		if (filter_name != nullptr) {
+			const AVBitStreamFilter* bsf = av_bsf_get_by_name(filter_name);
+			ret = bsf != nullptr ? av_bsf_alloc(bsf, &filter) : AVERROR_BSF_NOT_FOUND;
+			if (ret >= 0)
+				ret = avcodec_parameters_copy(filter->par_in, par);
+			if (ret >= 0) {
+				filter->time_base_in = stream->time_base;
+				ret = av_bsf_init(filter);
+			}
+		}
+		input->filters.push_back(filter);
+		if (ret < 0) {
+			Logger::get("error") << "Could not set up " << filter_name << " for " << filename << ": " << av_err2str(ret) << "\n";
+			return ret;
+		}
+	}
+
+	if (segment.copy && stream_index >= 0) {
+		ret = av_seek_frame(ctx, stream_index, input->origins[0], AVSEEK_FLAG_BACKWARD);
+		if (ret < 0)
+			Logger::get("error") << "Could not seek " << filename << " to " << segment.source_start_secs << "s: " << av_err2str(ret) << "\n";
+	}
+	return ret;
+}
+
+void Segmented_Exporter::close_segment(Segment_Input* input)
+{
+	for (AVBSFContext*& filter : input->filters)
+		av_bsf_free(&filter);
+	avformat_close_input(&input->format_ctx);
+	input->stream_map.clear();
+	input->filters.clear();
+	input->origins.clear();
+	input->ends.clear();
+}
+
+int Segmented_Exporter::add_output_streams(AVFormatContext* out_ctx, Segment_Input* input)
+{
+	for (size_t i = 0; i < input->stream_map.size(); ++i) {
+		int out_index = input->stream_map[i];
+		if (out_index < 0)
+			continue;
+		AVStream* in_stream = input->format_ctx->streams[i];
+		AVStream* out_stream = avformat_new_stream(out_ctx, nullptr);
+		if (out_stream == nullptr)
+			return AVERROR(ENOMEM);
+		AVBSFContext* filter = input->filters[out_index];
+		int ret = avcodec_parameters_copy(out_stream->codecpar, filter != nullptr ? filter->par_out : in_stream->codecpar);
+		if (ret < 0)
+			return ret;
+		out_stream->codecpar->codec_tag = 0;
+		out_stream->time_base = in_stream->time_base;
+
+		// inline parameter sets have to be declared in mp4, players otherwise only trust the header's
+		std::string muxer = out_ctx->oformat->name;
+		if (this->settings.inline_headers && (muxer == "mp4" || muxer == "mov")) {
+			if (out_stream->codecpar->codec_id == AV_CODEC_ID_H264)
+				out_stream->codecpar->codec_tag = MKTAG('a', 'v', 'c', '3');
+			else if (out_stream->codecpar->codec_id == AV_CODEC_ID_HEVC)
+				out_stream->codecpar->codec_tag = MKTAG('h', 'e', 'v', '1');
+		}
+	}
+	return 0;
+}
+
+// remuxes the segments' video into the output, shifting each by where it starts, and the audio alongside it
+int Segmented_Exporter::concat()
+{
+	AVFormatContext* out_ctx = nullptr;
+	const char* format_name = this->settings.format_name.size() > 0 ? this->settings.format_name.c_str() : nullptr;
+	int ret = avformat_alloc_output_context2(&out_ctx, nullptr, format_name, this->settings.filename.c_str());
+	if (ret < 0)
+		return ret;
+
+	// a copied segment describes the output when there is one, its headers match most of the packets
+	Segment_Input input;
+	auto first_copy = std::find_if(this->segments.begin(), this->segments.end(), [](const Segment& segment) { return segment.copy; });
+	ret = open_segment(first_copy != this->segments.end() ? *first_copy : this->segments.front(), AVMEDIA_TYPE_VIDEO, &input);
+	if (ret >= 0 && input.filters.size() == 0)
+		ret = AVERROR_STREAM_NOT_FOUND;
+	if (ret >= 0)
+		ret = add_output_streams(out_ctx, &input);
+	close_segment(&input);
+	// the audio stays open for the whole join
+	Segment_Input audio_input;
+	if (ret >= 0 && this->audio.filename.size() > 0) {
+		ret = open_segment(this->audio, AVMEDIA_TYPE_AUDIO, &audio_input);
+		if (ret >= 0)
+			ret = add_output_streams(out_ctx, &audio_input);
+	}
+	if (ret >= 0 && !(out_ctx->oformat->flags & AVFMT_NOFILE))
+		ret = avio_open(&out_ctx->pb, this->settings.filename.c_str(), AVIO_FLAG_WRITE);
+	if (ret >= 0)
+		ret = avformat_write_header(out_ctx, nullptr);
+
+	const int video_index = 0;
+	const int audio_index = 1;
+	int64_t last_dts = AV_NOPTS_VALUE;
+	// how much later the segment being joined plays to keep dts increasing
+	int64_t delay = AV_NOPTS_VALUE;
+	// shifts a segment's video packet to where the segment starts
+	auto write_video = [&](const Segment& segment, AVRational in_time_base, int64_t origin, AVPacket* packet) {
+		AVStream* out_stream = out_ctx->streams[video_index];
+		int64_t offset = av_rescale_q(segment.first_frame, av_inv_q(this->settings.frame_rate), out_stream->time_base);
+		if (packet->pts != AV_NOPTS_VALUE)
+			packet->pts = av_rescale_q(packet->pts - origin, in_time_base, out_stream->time_base) + offset;
+		if (packet->dts != AV_NOPTS_VALUE)
+			packet->dts = av_rescale_q(packet->dts - origin, in_time_base, out_stream->time_base) + offset;
+		packet->duration = av_rescale_q(packet->duration, in_time_base, out_stream->time_base);
+
+		// leading frames of an open gop reference the gop before the copy
+		if (packet->pts != AV_NOPTS_VALUE && packet->pts < offset) {
+			this->packets_dropped += 1;
+			av_packet_unref(packet);
+			return 0;
+		}
+		// a segment that reorders frames more than the one before starts decoding before that one has ended,
+		// the whole segment plays that much later rather than losing frames
+		if (delay == AV_NOPTS_VALUE) {
+			delay = 0;
+			if (last_dts != AV_NOPTS_VALUE && packet->dts != AV_NOPTS_VALUE && packet->dts <= last_dts)
+				delay = last_dts + 1 - packet->dts;
+			if (delay > 0)
+				Logger::get("export") << "delaying segment at frame " << segment.first_frame << " by " << delay << " ticks for its frame reordering\n";
+		}
+		if (packet->pts != AV_NOPTS_VALUE)
+			packet->pts += delay;
+		if (packet->dts != AV_NOPTS_VALUE) {
+			packet->dts += delay;
+			last_dts = packet->dts;
+		}
+		packet->stream_index = video_index;
+		packet->pos = -1;
+		return av_interleaved_write_frame(out_ctx, packet);
+	};
+
+	// the audio is written as the video reaches it, or the muxer would hold on to all the video to interleave it
+	AVPacket audio_packet;
+	av_init_packet(&audio_packet);
+	audio_packet.data = nullptr;
+	audio_packet.size = 0;
+	bool audio_left = audio_input.format_ctx != nullptr;
+	auto write_audio_until = [&](int64_t dts, AVRational time_base) {
+		int ret = 0;
+		while (ret >= 0 && audio_left) {
+			if (audio_packet.data == nullptr && av_read_frame(audio_input.format_ctx, &audio_packet) < 0) {
+				audio_left = false;
+				break;
+			}
+			if (audio_input.stream_map[audio_packet.stream_index] < 0) {
+				av_packet_unref(&audio_packet);
+				continue;
+			}
+			AVRational in_time_base = audio_input.format_ctx->streams[audio_packet.stream_index]->time_base;
+			if (dts != AV_NOPTS_VALUE && audio_packet.dts != AV_NOPTS_VALUE && av_compare_ts(audio_packet.dts, in_time_base, dts, time_base) > 0)
+				break;
+			av_packet_rescale_ts(&audio_packet, in_time_base, out_ctx->streams[audio_index]->time_base);
+			audio_packet.stream_index = audio_index;
+			audio_packet.pos = -1;
+			ret = av_interleaved_write_frame(out_ctx, &audio_packet);
+		}
+		return ret;
+	};
+
+	for (size_t i = 0; i < this->segments.size() && ret >= 0 && !this->cancelled; ++i) {
+		Segment& segment = this->segments[i];
+		delay = AV_NOPTS_VALUE;
+		ret = open_segment(segment, AVMEDIA_TYPE_VIDEO, &input);
+		if (ret >= 0 && input.filters.size() == 0) {
+			Logger::get("error") << "segment " << i << " has no video\n";
+			ret = AVERROR_INVALIDDATA;
+		}
+
+		// a copy ends at the keyframe that starts the gop past it
+		bool ended = false;
+		AVPacket packet;
+		av_init_packet(&packet);
+		while (ret >= 0 && !ended && av_read_frame(input.format_ctx, &packet) >= 0) {
+			int mapped = input.stream_map[packet.stream_index];
+			if (mapped >= 0 && packet.pts != AV_NOPTS_VALUE && packet.pts >= input.ends[mapped] && (packet.flags & AV_PKT_FLAG_KEY))
+				ended = true;
+			if (mapped < 0 || ended) {
+				av_packet_unref(&packet);
+				continue;
+			}
+
+			AVRational in_time_base = input.format_ctx->streams[packet.stream_index]->time_base;
+			AVBSFContext* filter = input.filters[mapped];
+			if (filter == nullptr) {
+				ret = write_video(segment, in_time_base, input.origins[mapped], &packet);
+			} else {
+				ret = av_bsf_send_packet(filter, &packet);
+				while (ret >= 0) {
+					ret = av_bsf_receive_packet(filter, &packet);
+					if (ret < 0)
+						break;
+					ret = write_video(segment, in_time_base, input.origins[mapped], &packet);
+				}
+				if (ret == AVERROR(EAGAIN))
+					ret = 0;
+			}
+			if (ret >= 0 && last_dts != AV_NOPTS_VALUE)
+				ret = write_audio_until(last_dts, out_ctx->streams[video_index]->time_base);
+		}
+		close_segment(&input);
+	}
+	if (ret >= 0 && !this->cancelled)
+		ret = write_audio_until(AV_NOPTS_VALUE, AVRational{1, 1});
+	av_packet_unref(&audio_packet);
+	close_segment(&audio_input);
+
+	if (ret >= 0 && !this->cancelled)
+		ret = av_write_trailer(out_ctx);
+	if (!(out_ctx->oformat->flags & AVFMT_NOFILE))
+		avio_closep(&out_ctx->pb);
+	avformat_free_context(out_ctx);
+	return ret;
+}
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/audio_fifo.h>
+#include <libswresample/swresample.h>
+#include <libswscale/swscale.h>
+}
+
+#include "blocking_queue.h"
+#include "clip.h"
+
+struct Export_Settings {
+	std::string filename;
+	// guessed from the filename when empty
+	std::string format_name;
+	// AV_CODEC_ID_NONE takes the format's default
+	AVCodecID video_codec = AV_CODEC_ID_NONE;
+	AVCodecID audio_codec = AV_CODEC_ID_NONE;
+	// -1 leaves it to the encoder
+	int max_b_frames = -1;
+	// encoder threads, 0 lets the encoder take every core
+	int threads = 0;
+	// AV_PIX_FMT_NONE takes the encoder's first
+	AVPixelFormat pix_fmt = AV_PIX_FMT_NONE;
+	// parameter sets go in front of every keyframe instead of the header, so streams from different encoders can be joined
+	bool inline_headers = false;
+	// plain clip ranges are copied from their source files instead of encoded, when the output can take their packets
+	bool smart_render = false;
+	// streams to write, the video is still walked without it since the decoders pace the audio
+	bool video = true;
+	bool audio = true;
+	// 0 takes the size and frame rate of the first clip on the main track
+	int width = 0;
+	int height = 0;
+	AVRational frame_rate = {0, 1};
+	int sample_rate = 48000;
+	int channels = 2;
+	// track volumes, 0 when muted
+	float main_gain = 1;
+	float overlay_gain = 1;
+	int64_t video_bit_rate = 8000000;
+	int64_t audio_bit_rate = 192000;
+	// timeline range, a negative end exports to the end of the video
+	float start_secs = 0;
+	float end_secs = -1;
+};
+
+struct Export_Stats {
+	int frames_total = 0;
+	int frames_composited = 0;
+	// copied from the source by a smart render, never decoded
+	int frames_copied = 0;
+	// the timeline had no frame ready in time, the previous one was encoded again
+	int frames_repeated = 0;
+	int segments = 0;
+	// leading frames of a copied range that belong to the keyframe interval before it
+	int packets_dropped = 0;
+	int audio_blocks = 0;
+	// the main track had no audio decoded, silence was encoded instead
+	int silent_blocks = 0;
+	int video_packets = 0;
+	int audio_packets = 0;
+	float elapsed_secs = 0;
+};
+
+// renders a snapshot of a Video to an encoded file, without the UI
+// the timeline is walked at full resolution with the same Track and Filter code as the preview,
+// and composite, video encode, audio encode and mux each run on their own thread joined by bounded queues
+class Exporter {
+public:
+	// how many composited frames or audio blocks can wait for an encoder
+	static const int frame_queue_size = 8;
+	static const int audio_queue_size = 32;
+	static const int packet_queue_size = 64;
+	// how often the timeline is asked for a frame before the previous one is repeated
+	static const int frame_retries = 10;
+	// how long the mix waits for the main track's audio before encoding silence
+	static constexpr std::chrono::milliseconds audio_wait{500};
+
+	Exporter(const Export_Settings& settings);
+	~Exporter();
+	Exporter(const Exporter&) = delete;
+	void operator=(const Exporter&) = delete;
+
+	// copies the tracks, hold the renderer's video mutex while calling
+	void load(Video* video);
+	void load(const std::list<TrackPiece>& main_pieces, const std::list<TrackPiece>& overlay_pieces);
+	// must be set before load
+	void set_decoder_pool(Decoder_Pool* pool);
+	// opens the output and starts the pipeline, returns < 0 if it couldn't
+	int start();
+	// stops early, the output is left incomplete
+	void cancel();
+	// blocks until the pipeline is done, returns the first error or 0
+	int wait();
+	bool is_finished() const;
+	// 0 to 1, by frames encoded
+	float get_progress() const;
+	Export_Stats get_stats();
+
+protected:
+	Export_Settings settings;
+	// a copy of the timeline with its own decoders, the preview keeps running on its own
+	Video video;
+	int64_t frame_count = 0;
+
+	AVFormatContext* format_ctx = nullptr;
+	AVCodecContext* video_encoder_ctx = nullptr;
+	AVCodecContext* audio_encoder_ctx = nullptr;
+	AVStream* video_stream = nullptr;
+	AVStream* audio_stream = nullptr;
+	int open_output();
+	int open_video_encoder();
+	int open_audio_encoder();
+	void close_output();
+
+	Blocking_Queue<AVFrame*> video_frames{frame_queue_size};
+	Blocking_Queue<AVFrame*> audio_frames{audio_queue_size};
+	Blocking_Queue<AVPacket*> packets{packet_queue_size};
+	void close_queues();
+	void free_queued();
+
+	std::thread composite_thread;
+	std::thread video_encode_thread;
+	std::thread audio_encode_thread;
+	std::thread mux_thread;
+	void composite();
+	void encode_video();
+	void encode_audio();
+	void mux();
+	// sends frame, or flushes with nullptr, and queues every packet the encoder has ready
+	int encode(AVCodecContext* encoder_ctx, AVStream* stream, AVFrame* frame);
+	// mixes the next block of audio, or silence if the main track has none decoded in time
+	int push_audio_block(int64_t pts);
+	// blocks up to the end of the given output frame
+	int push_audio_until(int64_t frame, AVRational sample_time_base, int64_t* pts);
+	bool audio_starved = false;
+	int encode_audio_fifo(AVAudioFifo* fifo, int frame_size, int64_t* next_pts, bool flush);
+
+	// the mux closes once both encoders are done
+	std::atomic_int encoders_running{0};
+	std::atomic_bool cancelled{false};
+	std::atomic_int stages_running{0};
+	std::atomic_int frames_encoded{0};
+	// first error from any stage
+	std::mutex error_mutex;
+	int error = 0;
+	void fail(int ret, const std::string& what);
+
+	std::mutex stats_mutex;
+	Export_Stats stats;
+	std::chrono::steady_clock::time_point start_time;
+};
+
+// splits the range at clip starts and source keyframes and exports the segments' video side by side,
+// each with its own decoders and encoders, then remuxes them into the output without re-encoding
+// the audio is encoded in one pass over the whole range, an encoder started per segment would prime every join with silence
+class Segmented_Exporter {
+public:
+	// shorter segments aren't worth an encoder of their own
+	static constexpr float min_segment_secs = 2.0f;
+	// segments are written here first, the name gets the segment number and extension appended
+	static constexpr const char* segment_format = "matroska";
+	// a smart render re-encodes plain ranges shorter than this rather than cutting around them
+	static constexpr float min_copy_secs = 1.0f;
+
+	// jobs of 0 runs a segment per core
+	Segmented_Exporter(const Export_Settings& settings, int jobs);
+	virtual ~Segmented_Exporter();
+	Segmented_Exporter(const Segmented_Exporter&) = delete;
+	void operator=(const Segmented_Exporter&) = delete;
+
+	// copies the tracks, hold the renderer's video mutex while calling
+	void load(Video* video);
+	// shared by every segment's decoders
+	void set_decoder_pool(Decoder_Pool* pool);
+	virtual int start();
+	void cancel();
+	int wait();
+	bool is_finished() const;
+	float get_progress();
+	Export_Stats get_stats();
+
+protected:
+	struct Segment {
+		int64_t first_frame = 0;
+		int64_t frame_count = 0;
+		std::string filename;
+		// only while the segment is exporting, guarded by segments_mutex
+		std::unique_ptr<Exporter> exporter;
+		// 0 to 1 for segments exported somewhere else, guarded by segments_mutex
+		float progress = 0;
+		Export_Stats stats;
+		bool done = false;
+		// copied from source_filename between two of its keyframes, instead of exported
+		bool copy = false;
+		std::string source_filename;
+		float source_start_secs = 0;
+		float source_end_secs = 0;
+	};
+
+	// what a source file has to match for its packets to be copied into the output
+	struct Copy_Format {
+		AVCodecID video_codec = AV_CODEC_ID_NONE;
+		int width = 0;
+		int height = 0;
+		int pix_fmt = -1;
+		AVRational frame_rate = {0, 1};
+	};
+
+	// a segment being remuxed, its streams mapped to the output's
+	struct Segment_Input {
+		AVFormatContext* format_ctx = nullptr;
+		// index into the vectors below for each input stream, -1 drops it
+		std::vector<int> stream_map;
+		// per mapped stream, puts parameter sets in front of keyframes so segments from different encoders join
+		std::vector<AVBSFContext*> filters;
+		// source timestamp each mapped stream starts from
+		std::vector<int64_t> origins;
+		std::vector<int64_t> ends;
+	};
+
+	Export_Settings settings;
+	int jobs;
+	Decoder_Pool* decoder_pool = nullptr;
+	std::list<TrackPiece> main_pieces;
+	std::list<TrackPiece> overlay_pieces;
+	std::vector<Clip> main_clips;
+	std::vector<Clip> overlay_clips;
+	float duration_secs = 0;
+	int64_t frame_count = 0;
+
+	std::mutex segments_mutex;
+	std::vector<Segment> segments;
+	// the whole range's audio, always exported here, no filename when the output has no audio
+	Segment audio;
+	std::atomic_int next_segment{0};
+	void plan_segments();
+	std::vector<float> get_split_candidates();
+	// copy segments for plain clips that match the first one's format, false if there's nothing to copy
+	bool plan_smart_segments();
+	static bool probe_copy_format(const std::string& filename, Copy_Format* format);
+	bool can_encode_as(const Copy_Format& format);
+
+	std::thread run_thread;
+	void run();
+	// worker is which of the jobs is asking, 0 to jobs - 1
+	void work(int worker);
+	// writes segment->filename, returns < 0 on failure
+	virtual int export_segment(int worker, Segment* segment, const Export_Settings& settings);
+	void export_audio();
+	int concat();
+	// maps only the best stream of media_type
+	int open_segment(const Segment& segment, AVMediaType media_type, Segment_Input* input);
+	void close_segment(Segment_Input* input);
+	int add_output_streams(AVFormatContext* out_ctx, Segment_Input* input);
+
+	std::atomic_bool cancelled{false};
+	std::atomic_bool finished{false};
+	std::mutex error_mutex;
+	int error = 0;
+	void fail(int ret, const std::string& what);
+
+	int packets_dropped = 0;
+	std::chrono::steady_clock::time_point start_time;
+};
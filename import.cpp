@@ -0,0 +1,116 @@
+#include "import.h"
+
+#include <algorithm>
+
+#include "logger.h"
+#include "probe.h"
+
+Importer::Importer(Video* video, std::mutex& video_mutex, int threads)
+	: video_mutex(video_mutex)
+{
+	this->video = video;
+	int cores = std::max(1u, std::thread::hardware_concurrency());
+	this->thread_count = std::min(threads > 0 ? threads : cores, (int) max_threads);
+}
+
+Importer::~Importer()
+{
+	stop();
+}
+
+void Importer::start()
+{
+	if (this->threads.size() > 0)
+		return;
+	this->stop_importing = false;
+	for (int i = 0; i < this->thread_count; ++i)
+		this->threads.push_back(std::thread(&Importer::work, this));
+}
+
+void Importer::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stop_importing = true;
+	}
+	this->condition.notify_all();
+	for (auto& thread : this->threads)
+		thread.join();
+	this->threads.clear();
+}
+
+void Importer::add(Track* track, const std::vector<std::string>& filenames, TransitionEffect effect)
+{
+	std::vector<Job> added;
+	{
+		std::lock_guard<std::mutex> lock(this->video_mutex);
+		for (auto& filename : filenames) {
+			// a file that's been probed before goes straight on with its real duration
+			Media_Info info;
+			bool known = Probe_Cache::shared().peek(filename, &info) && info.duration_secs > 0;
+			int placeholder = track->add_placeholder(filename, effect, known ? info.duration_secs : placeholder_secs);
+			if (known)
+				track->resolve_placeholder(placeholder, info.duration_secs);
+			else
+				added.push_back(Job{track, placeholder, filename});
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->jobs.insert(this->jobs.end(), added.begin(), added.end());
+		this->stats.queued += added.size();
+	}
+	this->condition.notify_all();
+	Logger::get("import") << "queued " << added.size() << " of " << filenames.size() << " files for probing\n";
+}
+
+int Importer::get_pending()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->jobs.size() + this->probing;
+}
+
+Import_Stats Importer::get_stats()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->stats;
+}
+
+void Importer::work()
+{
+	while (true) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(this->mutex);
+			this->condition.wait(lock, [this] { return this->jobs.size() > 0 || this->stop_importing; });
+			if (this->stop_importing)
+				return;
+			job = this->jobs.front();
+			this->jobs.pop_front();
+			this->probing += 1;
+		}
+
+		// the slow part, outside both locks
+		Media_Info info = Probe_Cache::shared().get_info(job.filename);
+		bool probed = info.duration_secs > 0;
+		{
+			std::lock_guard<std::mutex> lock(this->video_mutex);
+			if (probed)
+				job.track->resolve_placeholder(job.placeholder, info.duration_secs);
+			else
+				job.track->remove_placeholder(job.placeholder);
+		}
+		if (probed)
+			Logger::get("import") << "probed " << job.filename << ", " << info.duration_secs << "s\n";
+		else
+			Logger::get("error") << "unable to import " << job.filename << "\n";
+
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->probing -= 1;
+		if (probed)
+			this->stats.probed += 1;
+		else
+			this->stats.failed += 1;
+	}
+}
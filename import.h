@@ -0,0 +1,66 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "clip.h"
+
+struct Import_Stats {
+	int queued = 0;
+	int probed = 0;
+	// couldn't be probed, their placeholders were taken off the track
+	int failed = 0;
+};
+
+// probes added files on a pool of threads so the UI thread never opens one
+// each file goes on its track at once as a placeholder, which gets its real duration when the probe finishes
+class Importer {
+public:
+	// how long a placeholder lasts on the timeline until its file is probed
+	static constexpr float placeholder_secs = 5.0f;
+	// probing mostly waits on the disk, more threads than this just fight over it
+	static const int max_threads = 8;
+
+	// video_mutex guards the tracks, it's held while placeholders are added and resolved
+	// threads of 0 runs one per core, up to max_threads
+	Importer(Video* video, std::mutex& video_mutex, int threads);
+	~Importer();
+	Importer(const Importer&) = delete;
+	void operator=(const Importer&) = delete;
+
+	void start();
+	// files still queued keep their placeholders
+	void stop();
+
+	// UI thread, don't hold the video mutex, it only waits for the placeholders to go on the track
+	void add(Track* track, const std::vector<std::string>& filenames, TransitionEffect effect);
+	// files queued or being probed
+	int get_pending();
+
+	Import_Stats get_stats();
+
+protected:
+	struct Job {
+		Track* track;
+		int placeholder;
+		std::string filename;
+	};
+
+	Video* video;
+	std::mutex& video_mutex;
+	int thread_count;
+
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool stop_importing = false;
+	std::deque<Job> jobs;
+	int probing = 0;
+	Import_Stats stats;
+
+	void work();
+};
@@ -1,5 +1,8 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 std::string path();
+// every file picked, empty if cancelled
+std::vector<std::string> paths();
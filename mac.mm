@@ -19,3 +19,21 @@ std::string path() {
 	}
 	return "";
 }
+
+std::vector<std::string> paths() {
+	NSOpenGLContext *foo = [NSOpenGLContext currentContext];
+
+	NSOpenPanel* panel = [NSOpenPanel openPanel];
+	NSArray* videoTypes = @[@"mp4", @"mov"];
+	[panel setAllowedFileTypes:videoTypes];
+	[panel setAllowsMultipleSelection:YES];
+
+	std::vector<std::string> picked;
+	int response = [panel runModal];
+	[foo makeCurrentContext];
+	if (response == NSModalResponseOK) {
+		for (NSURL* nsurl in [panel URLs])
+			picked.push_back(std::string([[nsurl path] UTF8String]));
+	}
+	return picked;
+}
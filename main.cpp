@@ -31,6 +31,14 @@ extern "C"
 #include "logger.h"
 #include "common.h"
 #include "clip.h"
+#include "batch.h"
+#include "export.h"
+#include "import.h"
+#include "playback.h"
+#include "project.h"
+#include "remote.h"
+#include "render.h"
+#include "upload.h"
 #ifdef __APPLE__
 #include "mac.h"
 #endif
@@ -72,8 +80,15 @@ int win_width, win_height;
 bool paused = true;
 bool just_seeked = true;
 float last_frame_secs = 0;
+// timeline position of the frame on screen, -1 after a seek
+float shown_frame_secs = -1;
+// the frame on screen stands in until the exact one is decoded
+bool shown_frame_provisional = false;
+float shown_frame_duration = 0;
+bool video_has_audio = false;
 timer_clock::time_point last_frame_clock = timer_clock::now();
 float last_seek_secs = 0;
+bool scrubbing = false;
 float clips_bar_last_click_secs = -1;
 
 struct nk_font_atlas *atlas;
@@ -83,8 +98,12 @@ SDL_AudioDeviceID audio_device = 1; // will never be 1 due to SDL docs
 SDL_AudioSpec audio_spec;
 
 Video video;
-
-#define MAX_AUDIO_FRAME_SIZE 192000 // 1 second of 48khz 32bit audio
+Audio_Output* audio_output = nullptr;
+Frame_Renderer* renderer = nullptr;
+Seek_Prefetcher* prefetcher = nullptr;
+Importer* importer = nullptr;
+// one export at a time, it runs alongside the preview on its own copy of the tracks
+Segmented_Exporter* exporter = nullptr;
 
 void play()
 {
@@ -93,10 +112,27 @@ void play()
 	last_frame_clock = timer_clock::now();
 }
 
+void log_playback_stats()
+{
+	Decode_Stats decode = video.main_track.get_decoder()->get_decode_stats();
+	Logger::get("sync") << "decoded " << decode.frames_decoded << " frames, dropped " << decode.frames_dropped << ", late " << decode.frames_late
+		<< ", skipped " << decode.packets_skipped << " packets in " << decode.keyframe_jumps << " keyframe jumps, slowest close " << decode.max_close_ms << "ms\n";
+	if (prefetcher != nullptr) {
+		Prefetch_Stats prefetch = prefetcher->get_stats();
+		Logger::get("sync") << "prefetched " << prefetch.prefetches << " positions, " << prefetch.hits << " seeks hit, " << prefetch.misses << " missed\n";
+	}
+	if (audio_output != nullptr) {
+		Sync_Stats sync = audio_output->get_clock().get_stats();
+		Logger::get("sync") << "drift " << sync.drift_ms << "ms, sync error avg " << sync.avg_sync_error_ms << "ms max " << sync.max_sync_error_ms << "ms, "
+			<< sync.frames_shown << " frames shown, " << sync.frames_repeated << " repeated, " << sync.frames_dropped << " dropped\n";
+	}
+}
+
 void pause()
 {
 	paused = true;
 	SDL_PauseAudioDevice(audio_device, 1);
+	log_playback_stats();
 }
 
 void play_pause()
@@ -105,72 +141,110 @@ void play_pause()
 }
 
 void seek(float seek_secs) {
-	just_seeked = video.seek(seek_secs);
+	just_seeked = true;
+	renderer->seek(seek_secs);
 	last_frame_secs = seek_secs;
+	shown_frame_secs = -1;
+}
+
+// shows keyframes only while the mouse is held on the timeline, the exact frame is decoded on release
+void scrub(float scrub_secs)
+{
+	scrubbing = true;
+	last_frame_secs = scrub_secs;
+	shown_frame_secs = -1;
+	renderer->scrub(scrub_secs);
+}
+
+void end_scrub()
+{
+	scrubbing = false;
+	seek(last_seek_secs);
+}
+
+// video follows the audio device when there's audio to follow, the system clock otherwise
+bool audio_master()
+{
+	return audio_output != nullptr && video_has_audio;
+}
+
+// the render thread flushes the audio once it has seeked, the clock still runs from before the seek until then
+bool audio_clock_ready()
+{
+	return !renderer->is_seeking() && audio_output->has_clock();
+}
+
+// added files are placeholders with a guessed duration until they're probed, nothing should keep that
+bool still_importing()
+{
+	int pending = importer != nullptr ? importer->get_pending() : 0;
+	if (pending > 0)
+		Logger::get("error") << "still probing " << pending << " added files, try again once they're on the timeline\n";
+	return pending > 0;
+}
+
+void export_video()
+{
+	if (exporter != nullptr || still_importing())
+		return;
+
+	Export_Settings settings;
+	settings.filename = "export.mp4";
+	settings.smart_render = true;
+	// one segment per core
+	exporter = new Segmented_Exporter(settings, 0);
+	{
+		std::lock_guard<std::mutex> lock(renderer->get_video_mutex());
+		exporter->load(&video);
+	}
+	if (exporter->start() < 0) {
+		delete exporter;
+		exporter = nullptr;
+	}
+}
+
+void finish_export()
+{
+	if (exporter == nullptr || !exporter->is_finished())
+		return;
+
+	int ret = exporter->wait();
+	Export_Stats stats = exporter->get_stats();
+	Logger::get("export") << (ret < 0 ? "export failed after " : "exported ") << stats.frames_composited + stats.frames_copied << "/" << stats.frames_total << " frames (" << stats.frames_copied << " copied) in " << stats.elapsed_secs << "s, "
+		<< stats.frames_repeated << " repeated, " << stats.silent_blocks << " of " << stats.audio_blocks << " audio blocks silent, "
+		<< stats.segments << " segments, " << stats.packets_dropped << " packets dropped at joins\n";
+	delete exporter;
+	exporter = nullptr;
 }
 
 void split_clip()
 {
 	if (clips_bar_last_click_secs == -1)
 		return;
+	std::lock_guard<std::mutex> lock(renderer->get_video_mutex());
 	video.main_track.split(clips_bar_last_click_secs, TransitionEffect::Fade);
 }
 
+// where SAVE writes to
+std::string project_filename = "project.vedp";
+
 void load_test_scenario()
 {
 	video.addToMainTrack("concert.mp4", TransitionEffect::None);
 	video.addToOverlayTrack("overlay.mov", TransitionEffect::None);
-	std::this_thread::sleep_for(std::chrono::milliseconds(10));
 	//seek(1.0f);
 	//video.main_track.split(1, TransitionEffect::Fade);
 	//play();
 }
 
+// runs on the SDL audio thread, mixing happens on the audio output's producer thread
 void audio_callback(void*, Uint8 *stream, int len)
 {
-	// unfreed memory
-	static uint8_t* audio_buf = new uint8_t[MAX_AUDIO_FRAME_SIZE * 2];
-	static unsigned int audio_buf_size = 0;
-
-	int copied = 0;
-
-	Logger::get("audio") << "requested " << len << " bytes for audio stream\n";
-	while (len > 0) {
-		// check whether we have enough stored
-		if (audio_buf_size >= len) {
-			Logger::get("audio") << "copying " << len << " bytes to stream, have " << audio_buf_size - len << " left\n";
-			// copy from buffer to stream
-			memcpy(&stream[copied], audio_buf, len);
-			// move remainder to beginning of stream
-			memmove(audio_buf, &audio_buf[len], audio_buf_size - len);
-			audio_buf_size -= len;
-			break;
-		}
-
-		// copy whatever we have saved
-		if (audio_buf_size > 0) {
-			Logger::get("audio") << "copying the remaining " << audio_buf_size << " bytes to stream\n";
-			// copy from buffer to stream
-			memcpy(stream, audio_buf, audio_buf_size);
-			len -= audio_buf_size;
-			copied += audio_buf_size;
-			audio_buf_size = 0;
-		}
-
-		// read another frame and store it in the buf
-		int ret = video.get_next_audio_frame();
-		if (ret < 0) {
-			Logger::get("audio") << "unable to get audio frame: " << av_err2str(ret) << "\n";
-			memset(&stream[copied], 0, len);
-			break;
-		}
-
-		AVFrame* audio_frame = video.out_audio_frame;
-		audio_buf_size = av_samples_get_buffer_size(NULL, audio_frame->channels, audio_frame->nb_samples, AV_SAMPLE_FMT_S16, 1);
-		memcpy(audio_buf, audio_frame->data[0], audio_buf_size);
+	if (audio_output == nullptr) {
+		memset(stream, 0, len);
+		return;
 	}
-
-	Logger::get("audio") << "---\n";
+	audio_output->read(stream, len);
 }
 
 void open_audio()
@@ -186,12 +260,21 @@ void open_audio()
 	desired.silence = 0;
 	desired.samples = 1024;
 	desired.callback = audio_callback;
-	audio_device = SDL_OpenAudioDevice(NULL, 0, &desired, &audio_spec, SDL_AUDIO_ALLOW_ANY_CHANGE);
+	// the mixer outputs s16 at any rate and channel count, SDL converts anything else
+	audio_device = SDL_OpenAudioDevice(NULL, 0, &desired, &audio_spec, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE);
 	if (audio_device == 0) {
 		Logger::get("error") << "SDL_OpenAudio: " << SDL_GetError() << "\n";
 		return;
 	}
 	Logger::get("audio") << "received sample rate " << audio_spec.freq << ", " << (char)(audio_spec.channels + '0') << " channels, format " << audio_spec.format << "\n";
+	video.set_audio_output(audio_spec.freq, audio_spec.channels);
+
+	audio_output = new Audio_Output(&video, audio_spec.freq, audio_spec.channels, audio_spec.samples);
+	audio_output->start();
+	{
+		std::lock_guard<std::mutex> lock(renderer->get_video_mutex());
+		renderer->set_audio_output(audio_output);
+	}
 }
 
 void v_draw_text(struct nk_command_buffer* canvas, const char* text, const struct nk_user_font* font, int x, int y, nk_color bg_color, nk_color fg_color)
@@ -255,8 +338,10 @@ void widget_tracks(struct nk_context* ctx)
 		float start = bars_width * piece->file.video_start_secs / video_duration + 1; // add 1 for line thickness
 		float width = bars_width * piece->file.duration_secs / video_duration - 10; // dunno why need to subtract 9
 		struct nk_rect size = nk_rect(bars_start_x + start, top + 1, bars_start_x + width, track_height);
-		nk_fill_rect(canvas, size, 2, fill_colors[color_num]);
-		nk_stroke_rect(canvas, size, 2, 3, line_colors[color_num]);
+		// placeholders are greyed out until their file is probed
+		int color = piece->placeholder != 0 ? 7 : color_num;
+		nk_fill_rect(canvas, size, 2, fill_colors[color]);
+		nk_stroke_rect(canvas, size, 2, 3, line_colors[color]);
 		color_num += 1;
 		//Logger::get("ui") << "main track piece from " << piece->file.video_start_secs << " to " << piece->file.video_start_secs + piece->file.duration_secs << "\n";
 	}
@@ -271,8 +356,10 @@ void widget_tracks(struct nk_context* ctx)
 		float start = bars_width * piece->file.video_start_secs / video_duration + 1; // add 1 for line thickness
 		float width = bars_width * piece->file.duration_secs / video_duration - 10; // dunno why need to subtract 9
 		struct nk_rect size = nk_rect(bars_start_x + start, top + 1, bars_start_x + width, track_height);
-		nk_fill_rect(canvas, size, 2, fill_colors[color_num]);
-		nk_stroke_rect(canvas, size, 2, 3, line_colors[color_num]);
+		// placeholders are greyed out until their file is probed
+		int color = piece->placeholder != 0 ? 7 : color_num;
+		nk_fill_rect(canvas, size, 2, fill_colors[color]);
+		nk_stroke_rect(canvas, size, 2, 3, line_colors[color]);
 		color_num += 1;
 		//Logger::get("ui") << "overlay track piece from " << piece->file.video_start_secs << " to " << piece->file.video_start_secs + piece->file.duration_secs << "\n";
 	}
@@ -320,7 +407,7 @@ void widget_tracks(struct nk_context* ctx)
 			float seek_secs = mouse_x_pct * video_duration;
 
 			if (just_seeked || last_seek_secs != seek_secs) {
-				seek(seek_secs);
+				scrub(seek_secs);
 				last_seek_secs = seek_secs;
 				clips_bar_last_click_secs = seek_secs;
 			}
@@ -346,8 +433,10 @@ void widget_track(struct nk_context* ctx, Track* track, int color_num)
 		float start = space.w * piece->file.video_start_secs / video_duration - 3; // add 1 for line thickness
 		float width = space.w * piece->file.duration_secs / video_duration; // dunno why need to subtract 9
 		struct nk_rect size = nk_rect(space.x + start, space.y + 1, space.x + width, space.h - 2);
-		nk_fill_rect(canvas, size, 2, fill_colors[color_num]);
-		nk_stroke_rect(canvas, size, 2, 3, line_colors[color_num]);
+		// placeholders are greyed out until their file is probed
+		int color = piece->placeholder != 0 ? 7 : color_num;
+		nk_fill_rect(canvas, size, 2, fill_colors[color]);
+		nk_stroke_rect(canvas, size, 2, 3, line_colors[color]);
 		//Logger::get("ui") << "main track piece from " << piece->file.video_start_secs << " to " << piece->file.video_start_secs + piece->file.duration_secs << "\n";
 	}
 
@@ -396,14 +485,18 @@ void widget_clips_overlay(struct nk_context* ctx, const struct nk_rect track_rec
 		nk_stroke_line(canvas, selection_x, track_rect.y, selection_x, track_rect.y + track_rect.h, 3, nk_rgb(100, 100, 200));
 	}
 
-	// draw current place indicator
+	// draw current place indicator, highlighted while the frame on screen is still being refined
 	int current_x = track_rect.x + track_rect.w * video.get_last_video_frame_secs() / video_duration;
-	nk_stroke_line(canvas, current_x, track_rect.y, current_x, track_rect.y + track_rect.h, 1, nk_rgb(100,100,100));
+	nk_stroke_line(canvas, current_x, track_rect.y, current_x, track_rect.y + track_rect.h, 1, shown_frame_provisional ? nk_rgb(200,160,60) : nk_rgb(100,100,100));
 
 	float mouse_x = ctx->input.mouse.pos.x;
-	// draw hover vertical line
-	if (nk_input_is_mouse_hovering_rect(&ctx->input, track_rect))
+	// draw hover vertical line, a decoder gets warmed up there once the cursor rests
+	if (nk_input_is_mouse_hovering_rect(&ctx->input, track_rect)) {
 		nk_stroke_line(canvas, mouse_x, track_rect.y, mouse_x, track_rect.y + track_rect.h, 1, nk_rgb(200,200,200));
+		prefetcher->hover(std::min(1.0f, (mouse_x - track_rect.x) / track_rect.w) * video_duration);
+	} else {
+		prefetcher->hover(-1);
+	}
 
 	// handle seeks via click or drag
 	if (nk_input_has_mouse_click_down_in_rect(&ctx->input, NK_BUTTON_LEFT, track_rect, nk_true)) {
@@ -415,7 +508,7 @@ void widget_clips_overlay(struct nk_context* ctx, const struct nk_rect track_rec
 		Logger::get("ui") << "at " << mouse_x_pct << "%, seeking to " << seek_secs << "s\n";
 
 		if (just_seeked || last_seek_secs != seek_secs) {
-			seek(seek_secs);
+			scrub(seek_secs);
 			last_seek_secs = seek_secs;
 			clips_bar_last_click_secs = seek_secs;
 		}
@@ -424,6 +517,21 @@ void widget_clips_overlay(struct nk_context* ctx, const struct nk_rect track_rec
 
 int main_volume = 100;
 int overlay_volume = 100;
+int main_muted = 0;
+int overlay_muted = 0;
+void widget_volume(struct nk_context* ctx, Track* track, int* volume, int* muted, int width)
+{
+	int mute_width = 25;
+	nk_layout_row_push(ctx, mute_width);
+	nk_selectable_label(ctx, "M", NK_TEXT_CENTERED, muted);
+	nk_layout_row_push(ctx, width - mute_width - ctx->style.window.spacing.x);
+	nk_property_int(ctx, "#vol", 0, volume, 200, 1, 1);
+
+	// picked up by the mixer on its next block
+	track->set_volume(*volume / 100.0f);
+	track->set_muted(*muted);
+}
+
 void widget_clips_bar(struct nk_context* ctx)
 {
 	struct nk_rect empty;
@@ -432,18 +540,16 @@ void widget_clips_bar(struct nk_context* ctx)
 	int track_width = win_width - volume_width - 30;
 
 	// draw main track
-	nk_layout_row_begin(ctx, NK_STATIC, 30, 2);
+	nk_layout_row_begin(ctx, NK_STATIC, 30, 3);
 	int start_y = ctx->current->layout->at_y;
-	nk_layout_row_push(ctx, volume_width);
-	nk_property_int(ctx, "#vol", 0, &main_volume, 200, 1, 1);
+	widget_volume(ctx, &video.main_track, &main_volume, &main_muted, volume_width);
 	nk_layout_row_push(ctx, track_width);
 	widget_track(ctx, &video.main_track, 0);
 	nk_layout_row_end(ctx);
 
 	// draw overlay track
-	nk_layout_row_begin(ctx, NK_STATIC, 30, 2);
-	nk_layout_row_push(ctx, volume_width);
-	nk_property_int(ctx, "#vol", 0, &overlay_volume, 200, 1, 1);
+	nk_layout_row_begin(ctx, NK_STATIC, 30, 3);
+	widget_volume(ctx, &video.overlay_track, &overlay_volume, &overlay_muted, volume_width);
 	nk_layout_row_push(ctx, track_width);
 	widget_track(ctx, &video.overlay_track, 1);
 	nk_layout_row_end(ctx);
@@ -471,12 +577,28 @@ int main(int argc, char* argv[])
 	//Logger::addCategory("filter");
 	//Logger::addCategory("decoder");
 	//Logger::addCategory("overlay");
+	//Logger::addCategory("upload");
+	//Logger::addCategory("mixer");
+	//Logger::addCategory("sync");
+	//Logger::addCategory("render");
+	//Logger::addCategory("prefetch");
+	//Logger::addCategory("export");
+	//Logger::addCategory("decoder_pool");
+	//Logger::addCategory("import");
+	//Logger::addCategory("project");
 	Logger::addCategory("ui");
 
 	// video decoder
 	av_register_all();
 	avfilter_register_all();
 
+	// renders projects and exits, without opening a window
+	if (argc > 1 && std::string(argv[1]) == "--batch")
+		return run_batch(argv[0], argc - 2, argv + 2);
+	// started by a coordinator, renders the segments it's sent
+	if (argc > 1 && std::string(argv[1]) == "--worker")
+		return run_worker(argc - 2, argv + 2);
+
     // Platform
     SDL_Window *win;
     SDL_GLContext glContext;
@@ -534,7 +656,40 @@ int main(int argc, char* argv[])
 	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, video_w, video_h, GL_RGB, GL_UNSIGNED_BYTE, black_frame);
 	delete[] black_frame;
 
-	load_test_scenario();
+	Texture_Uploader* uploader = new Texture_Uploader(frame_texture, video_w, video_h);
+
+	// decoders write straight into GPU-visible memory when the driver allows persistent mappings
+	// freed once the renderer, the uploader and the decoders have let go of its frames
+	Frame_Pool* decoder_frame_pool = nullptr;
+	if (Mapped_Frame_Pool::is_supported()) {
+		Mapped_Frame_Pool* frame_pool = new Mapped_Frame_Pool();
+		if (uploader->set_frame_pool(frame_pool)) {
+			video.set_frame_pool(frame_pool);
+			decoder_frame_pool = frame_pool;
+		}
+	}
+
+	// a project on the command line opens without touching its media until frames are needed
+	if (argc > 1) {
+		project_filename = argv[1];
+		if (load_project(project_filename, &video) < 0)
+			load_test_scenario();
+	} else {
+		load_test_scenario();
+	}
+
+	// timeline evaluation happens off the UI thread from here on, edits lock the renderer's video mutex
+	renderer = new Frame_Renderer(&video, video_w, video_h);
+	renderer->start();
+
+	prefetcher = new Seek_Prefetcher(&video, renderer->get_video_mutex());
+	prefetcher->set_frame_pool(decoder_frame_pool);
+	prefetcher->start();
+	video.set_prefetcher(prefetcher);
+
+	// added files are probed off the UI thread and fill in their placeholders as they finish
+	importer = new Importer(&video, renderer->get_video_mutex(), 0);
+	importer->start();
 
 	// set up audio
 	if (audio_device == 1) {
@@ -570,13 +725,38 @@ int main(int argc, char* argv[])
         }
         nk_input_end(ctx);
 
-		// show next frame if not paused and we've waited long enough or if just seeked
-		if (just_seeked || !paused) {
+		if (scrubbing && !ctx->input.mouse.buttons[NK_BUTTON_LEFT].down)
+			end_scrub();
+		finish_export();
+
+		// the frame copied last time around goes to the texture now
+		uploader->flush();
+
+		// pick up the newest frame the render thread finished
+		const Rendered_Frame* rendered = renderer->take();
+		if (rendered != nullptr) {
+			uploader->upload(rendered->frame);
+			shown_frame_secs = rendered->frame_secs;
+			shown_frame_duration = rendered->frame_duration_secs;
+			video_has_audio = rendered->has_audio;
+			shown_frame_provisional = rendered->provisional;
+			// a stand-in frame is off by design, it would only skew the sync stats
+			if (!paused && !rendered->seeked && !rendered->provisional && audio_master() && audio_clock_ready())
+				audio_output->get_clock().frame_shown(rendered->frame_secs, audio_output->get_clock().get_secs(), rendered->frame_duration_secs);
+		}
+
+		// ask for the next frame if not paused and the clock moved past the frame on screen, or if just seeked
+		if (!scrubbing && (just_seeked || !paused)) {
 			if (just_seeked)
 				last_frame_clock = timer_clock::now();
 
 			// advance frame if not paused unless just seeked
-			if (!just_seeked && !paused) {
+			bool advanced = !just_seeked && !paused;
+			if (advanced && audio_master()) {
+				// holds at the seek position until the new audio is heard
+				if (audio_clock_ready())
+					last_frame_secs = audio_output->get_clock().get_secs();
+			} else if (advanced) {
 				auto now = timer_clock::now();
 				Logger::get("realtime") << "adding " << std::chrono::duration_cast<std::chrono::duration<float>>(now - last_frame_clock).count() << "s\n";
 				last_frame_secs += std::chrono::duration_cast<std::chrono::duration<float>>(now - last_frame_clock).count();
@@ -590,10 +770,13 @@ int main(int argc, char* argv[])
 			std::chrono::duration<double> duration = rt_now - start;
 			Logger::get("realtime") << "asking for frame at " << std::setprecision(4) << last_frame_secs << "s at " << duration.count() << "s, diff " << duration.count() - last_frame_secs << "s\n";
 
-			int ret = video.get_video_frame(last_frame_secs, video_w, video_h);
-			if (ret == 0) {
-				glBindTexture(GL_TEXTURE_2D, frame_texture);
-				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, video_w, video_h, GL_RGB, GL_UNSIGNED_BYTE, video.out_video_frame->data[0]);
+			// repeat the frame on screen until the clock reaches the next one
+			bool repeat = advanced && shown_frame_secs >= 0 && last_frame_secs >= shown_frame_secs && last_frame_secs < shown_frame_secs + shown_frame_duration;
+			if (repeat) {
+				if (audio_master())
+					audio_output->get_clock().frame_repeated();
+			} else {
+				renderer->request(last_frame_secs);
 			}
 		}
 
@@ -602,21 +785,36 @@ int main(int argc, char* argv[])
             nk_menubar_begin(ctx);
             nk_layout_row_begin(ctx, NK_STATIC, 25, 2);
             nk_layout_row_push(ctx, 45);
-            if (nk_menu_begin_label(ctx, "FILE", NK_TEXT_LEFT, nk_vec2(120, 200))) {
+            if (nk_menu_begin_label(ctx, "FILE", NK_TEXT_LEFT, nk_vec2(120, 240))) {
                 nk_layout_row_dynamic(ctx, 30, 1);
                 if (nk_menu_item_label(ctx, "ADD VIDEO", NK_TEXT_LEFT)) {
-					std::string new_video = path();
-					if (new_video.size() > 0) {
-						video.addToMainTrack(new_video, TransitionEffect::Fade);
-						std::this_thread::sleep_for(std::chrono::milliseconds(10));
-					}
+					std::vector<std::string> new_videos = paths();
+					if (new_videos.size() > 0)
+						importer->add(&video.main_track, new_videos, TransitionEffect::Fade);
 				}
                 if (nk_menu_item_label(ctx, "ADD OVERLAY", NK_TEXT_LEFT)) {
-					std::string new_video = path();
-					if (new_video.size() > 0) {
-						video.addToOverlayTrack(new_video, TransitionEffect::Fade);
-						std::this_thread::sleep_for(std::chrono::milliseconds(10));
+					std::vector<std::string> new_videos = paths();
+					if (new_videos.size() > 0)
+						importer->add(&video.overlay_track, new_videos, TransitionEffect::Fade);
+				}
+                if (exporter == nullptr) {
+					if (nk_menu_item_label(ctx, "EXPORT", NK_TEXT_LEFT))
+						export_video();
+				} else {
+					char export_label[32];
+					snprintf(export_label, sizeof(export_label), "EXPORTING %d%%", (int) (exporter->get_progress() * 100));
+					if (nk_menu_item_label(ctx, export_label, NK_TEXT_LEFT))
+						exporter->cancel();
+				}
+				if (nk_menu_item_label(ctx, "SAVE", NK_TEXT_LEFT) && !still_importing()) {
+					std::list<TrackPiece> main_pieces;
+					std::list<TrackPiece> overlay_pieces;
+					{
+						std::lock_guard<std::mutex> lock(renderer->get_video_mutex());
+						main_pieces = video.main_track.pieces;
+						overlay_pieces = video.overlay_track.pieces;
 					}
+					save_project(project_filename, main_pieces, overlay_pieces);
 				}
                 nk_menu_item_label(ctx, "CLOSE", NK_TEXT_LEFT);
                 nk_menu_end(ctx);
@@ -659,7 +857,25 @@ int main(int argc, char* argv[])
     }
 
 cleanup:
+	// cancels a running export
+	delete exporter;
+	// the prefetcher and importer lock the renderer's video mutex
+	delete importer;
+	{
+		// the render thread is still running, a seek mustn't reach the prefetcher once it's gone
+		std::lock_guard<std::mutex> lock(renderer->get_video_mutex());
+		video.set_prefetcher(nullptr);
+	}
+	delete prefetcher;
+	delete renderer;
 	av_frame_free(&rgb_frame);
+	delete uploader;
+	// the pool's buffers are GL objects, they go before the context
+	video.release_frame_pool();
+	delete decoder_frame_pool;
+
+	SDL_CloseAudioDevice(audio_device);
+	delete audio_output;
 
     nk_sdl_shutdown();
     SDL_GL_DeleteContext(glContext);
@@ -0,0 +1,215 @@
+#include "mixer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "logger.h"
+
+Audio_Mixer::Audio_Mixer(int sample_rate, int channels)
+{
+	this->sample_rate = sample_rate;
+	this->channels = channels;
+}
+
+int Audio_Mixer::get_sample_rate() const
+{
+	return this->sample_rate;
+}
+
+int Audio_Mixer::get_channels() const
+{
+	return this->channels;
+}
+
+int Audio_Mixer::add_input()
+{
+	Input input;
+	input.planes.resize(this->channels);
+	input.write_pointers.resize(this->channels);
+	this->inputs.push_back(input);
+	return this->inputs.size() - 1;
+}
+
+// makes room for nb_samples after write_pos, moving unread samples to the front first
+void Audio_Mixer::reserve(Input& input, int nb_samples)
+{
+	int unread = input.write_pos - input.read_pos;
+	if (input.read_pos > 0) {
+		for (auto& plane : input.planes)
+			memmove(plane.data(), &plane[input.read_pos], unread * sizeof(float));
+		input.read_pos = 0;
+		input.write_pos = unread;
+	}
+
+	int needed = input.write_pos + nb_samples;
+	if ((int) input.planes[0].size() < needed)
+		for (auto& plane : input.planes)
+			plane.resize(needed);
+}
+
+void Audio_Mixer::write(int input_index, const float* const* planes, int nb_samples)
+{
+	Input& input = this->inputs[input_index];
+	reserve(input, nb_samples);
+	for (int ch = 0; ch < this->channels; ++ch)
+		memcpy(&input.planes[ch][input.write_pos], planes[ch], nb_samples * sizeof(float));
+	input.write_pos += nb_samples;
+}
+
+float** Audio_Mixer::begin_write(int input_index, int max_samples)
+{
+	Input& input = this->inputs[input_index];
+	reserve(input, max_samples);
+	for (int ch = 0; ch < this->channels; ++ch)
+		input.write_pointers[ch] = &input.planes[ch][input.write_pos];
+	return input.write_pointers.data();
+}
+
+void Audio_Mixer::end_write(int input_index, int nb_samples)
+{
+	this->inputs[input_index].write_pos += nb_samples;
+}
+
+int Audio_Mixer::available(int input_index) const
+{
+	const Input& input = this->inputs[input_index];
+	return input.write_pos - input.read_pos;
+}
+
+void Audio_Mixer::reset()
+{
+	for (auto& input : this->inputs) {
+		input.read_pos = 0;
+		input.write_pos = 0;
+	}
+}
+
+const Mixer_Stats& Audio_Mixer::get_stats() const
+{
+	return this->stats;
+}
+
+void Audio_Mixer::mix(int16_t* out, int nb_samples, const std::vector<float>& gains)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// pad short inputs so every input can be read for the whole block
+	for (auto& input : this->inputs) {
+		int missing = nb_samples - (input.write_pos - input.read_pos);
+		if (missing <= 0)
+			continue;
+		reserve(input, missing);
+		for (auto& plane : input.planes)
+			std::fill(&plane[input.write_pos], &plane[input.write_pos] + missing, 0.0f);
+		input.write_pos += missing;
+	}
+
+	if (this->channels == 2) {
+		std::vector<const float*> left;
+		std::vector<const float*> right;
+		for (auto& input : this->inputs) {
+			left.push_back(&input.planes[0][input.read_pos]);
+			right.push_back(&input.planes[1][input.read_pos]);
+		}
+		mix_stereo(out, nb_samples, left, right, gains);
+	} else {
+		mix_generic(out, nb_samples, gains);
+	}
+
+	for (auto& input : this->inputs)
+		input.read_pos += nb_samples;
+
+	float block_us = std::chrono::duration_cast<std::chrono::duration<float, std::micro>>(std::chrono::high_resolution_clock::now() - start).count();
+	block_us = block_us * block_samples / nb_samples;
+	stats.last_block_us = block_us;
+	stats.avg_block_us = stats.blocks_mixed == 0 ? block_us : 0.99f * stats.avg_block_us + 0.01f * block_us;
+	stats.max_block_us = std::max(stats.max_block_us, block_us);
+	stats.blocks_mixed += 1;
+	Logger::get("mixer") << "mixed " << nb_samples << " samples from " << this->inputs.size() << " inputs, " << block_us << "us per " << block_samples << " samples\n";
+}
+
+static inline int16_t to_s16(float sample)
+{
+	sample = std::min(1.0f, std::max(-1.0f, sample));
+	return (int16_t) lrintf(sample * 32767.0f);
+}
+
+// accumulates every input four samples at a time, then clamps, converts and interleaves in the same pass
+void Audio_Mixer::mix_stereo(int16_t* out, int nb_samples, const std::vector<const float*>& left, const std::vector<const float*>& right, const std::vector<float>& gains)
+{
+	int num_inputs = left.size();
+	int i = 0;
+
+#if defined(__SSE2__)
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 minus_one = _mm_set1_ps(-1.0f);
+	const __m128 scale = _mm_set1_ps(32767.0f);
+	for (; i + 4 <= nb_samples; i += 4) {
+		__m128 l = _mm_setzero_ps();
+		__m128 r = _mm_setzero_ps();
+		for (int t = 0; t < num_inputs; ++t) {
+			__m128 gain = _mm_set1_ps(gains[t]);
+			l = _mm_add_ps(l, _mm_mul_ps(_mm_loadu_ps(&left[t][i]), gain));
+			r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(&right[t][i]), gain));
+		}
+		// clamp first, out of range conversions don't saturate
+		l = _mm_mul_ps(_mm_min_ps(_mm_max_ps(l, minus_one), one), scale);
+		r = _mm_mul_ps(_mm_min_ps(_mm_max_ps(r, minus_one), one), scale);
+		__m128i li = _mm_cvtps_epi32(l);
+		__m128i ri = _mm_cvtps_epi32(r);
+		// l0 r0 l1 r1 | l2 r2 l3 r3
+		__m128i lr = _mm_packs_epi32(_mm_unpacklo_epi32(li, ri), _mm_unpackhi_epi32(li, ri));
+		_mm_storeu_si128((__m128i*) &out[i * 2], lr);
+	}
+#elif defined(__aarch64__)
+	const float32x4_t one = vdupq_n_f32(1.0f);
+	const float32x4_t minus_one = vdupq_n_f32(-1.0f);
+	const float32x4_t scale = vdupq_n_f32(32767.0f);
+	for (; i + 4 <= nb_samples; i += 4) {
+		float32x4_t l = vdupq_n_f32(0);
+		float32x4_t r = vdupq_n_f32(0);
+		for (int t = 0; t < num_inputs; ++t) {
+			l = vfmaq_n_f32(l, vld1q_f32(&left[t][i]), gains[t]);
+			r = vfmaq_n_f32(r, vld1q_f32(&right[t][i]), gains[t]);
+		}
+		// clamped like the other paths, saturating alone would reach -32768
+		l = vmulq_f32(vminq_f32(vmaxq_f32(l, minus_one), one), scale);
+		r = vmulq_f32(vminq_f32(vmaxq_f32(r, minus_one), one), scale);
+		int16x4x2_t lr;
+		lr.val[0] = vmovn_s32(vcvtnq_s32_f32(l));
+		lr.val[1] = vmovn_s32(vcvtnq_s32_f32(r));
+		vst2_s16(&out[i * 2], lr);
+	}
+#endif
+
+	for (; i < nb_samples; ++i) {
+		float l = 0;
+		float r = 0;
+		for (int t = 0; t < num_inputs; ++t) {
+			l += left[t][i] * gains[t];
+			r += right[t][i] * gains[t];
+		}
+		out[i * 2] = to_s16(l);
+		out[i * 2 + 1] = to_s16(r);
+	}
+}
+
+void Audio_Mixer::mix_generic(int16_t* out, int nb_samples, const std::vector<float>& gains)
+{
+	for (int i = 0; i < nb_samples; ++i) {
+		for (int ch = 0; ch < this->channels; ++ch) {
+			float sample = 0;
+			for (int t = 0; t < (int) this->inputs.size(); ++t)
+				sample += this->inputs[t].planes[ch][this->inputs[t].read_pos + i] * gains[t];
+			out[i * this->channels + ch] = to_s16(sample);
+		}
+	}
+}
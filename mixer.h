@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+struct Mixer_Stats {
+	// cost of mixing, normalized to a block of 1024 samples
+	float last_block_us = 0;
+	float avg_block_us = 0;
+	float max_block_us = 0;
+	int blocks_mixed = 0;
+};
+
+// sums any number of inputs with per-input gain into interleaved s16
+// inputs are float planar at the output sample rate and channel count
+class Audio_Mixer {
+public:
+	static const int block_samples = 1024;
+
+	Audio_Mixer(int sample_rate, int channels);
+
+	int get_sample_rate() const;
+	int get_channels() const;
+
+	// returns the input's index
+	int add_input();
+	void write(int input, const float* const* planes, int nb_samples);
+	// lets a converter write up to max_samples in place, end_write commits what it wrote
+	float** begin_write(int input, int max_samples);
+	void end_write(int input, int nb_samples);
+	int available(int input) const;
+	void reset();
+
+	// inputs without enough samples are padded with silence
+	// out must hold nb_samples * channels samples
+	void mix(int16_t* out, int nb_samples, const std::vector<float>& gains);
+
+	const Mixer_Stats& get_stats() const;
+
+protected:
+	struct Input {
+		// one buffer per channel, samples before read_pos have been mixed
+		std::vector<std::vector<float>> planes;
+		std::vector<float*> write_pointers;
+		int read_pos = 0;
+		int write_pos = 0;
+	};
+
+	int sample_rate;
+	int channels;
+	std::vector<Input> inputs;
+	Mixer_Stats stats;
+
+	void reserve(Input& input, int nb_samples);
+	void mix_stereo(int16_t* out, int nb_samples, const std::vector<const float*>& left, const std::vector<const float*>& right, const std::vector<float>& gains);
+	void mix_generic(int16_t* out, int nb_samples, const std::vector<float>& gains);
+};
@@ -0,0 +1,223 @@
+#include "playback.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "logger.h"
+
+/*****************
+* Playback_Clock *
+*****************/
+Playback_Clock::Playback_Clock(int sample_rate, int device_samples)
+{
+	this->sample_rate = sample_rate;
+	this->device_samples = device_samples;
+}
+
+int64_t Playback_Clock::now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now().time_since_epoch()).count();
+}
+
+void Playback_Clock::restart(float secs)
+{
+	this->generation += 1;
+	this->base_secs = secs;
+	this->samples_played = 0;
+	this->last_callback_ns = 0;
+	this->generation += 1;
+}
+
+void Playback_Clock::add_samples(int nb_samples)
+{
+	if (nb_samples <= 0)
+		return;
+
+	int64_t now = now_ns();
+	int64_t device_ns = (int64_t) this->device_samples * 1000000000 / this->sample_rate;
+
+	this->generation += 1;
+	int64_t played = this->samples_played + nb_samples;
+	// audio stopped flowing for a while (paused, restarted), measure drift from here on
+	if (this->last_callback_ns == 0 || now - this->last_callback_ns > 4 * device_ns) {
+		this->drift_base_samples = played;
+		this->drift_base_ns = now;
+	}
+	this->samples_played = played;
+	this->last_callback_ns = now;
+	this->generation += 1;
+}
+
+float Playback_Clock::get_secs() const
+{
+	float base;
+	int64_t played;
+	int64_t callback_ns;
+	while (true) {
+		int gen = this->generation;
+		if (gen & 1)
+			continue;
+		base = this->base_secs;
+		played = this->samples_played;
+		callback_ns = this->last_callback_ns;
+		if (gen == this->generation)
+			break;
+	}
+	if (callback_ns == 0)
+		return base;
+
+	// the device is one buffer behind the last callback and has been playing since
+	double heard = played - this->device_samples + (now_ns() - callback_ns) * 1e-9 * this->sample_rate;
+	heard = std::max(0.0, std::min(heard, (double) played));
+	return base + heard / this->sample_rate;
+}
+
+bool Playback_Clock::is_running() const
+{
+	return this->last_callback_ns != 0;
+}
+
+void Playback_Clock::frame_repeated()
+{
+	this->stats.frames_repeated += 1;
+}
+
+void Playback_Clock::frame_shown(float frame_secs, float clock_secs, float frame_duration_secs)
+{
+	float error_ms = (frame_secs - clock_secs) * 1000;
+	this->stats.last_sync_error_ms = error_ms;
+	this->stats.avg_sync_error_ms = this->stats.frames_shown == 0 ? error_ms : 0.99f * this->stats.avg_sync_error_ms + 0.01f * error_ms;
+	this->stats.max_sync_error_ms = std::max(this->stats.max_sync_error_ms, std::abs(error_ms));
+	this->stats.frames_shown += 1;
+
+	// more than one frame since the last one shown means the ones in between never made it
+	if (this->last_shown_secs >= 0 && frame_duration_secs > 0 && frame_secs > this->last_shown_secs) {
+		int skipped = (int) lrintf((frame_secs - this->last_shown_secs) / frame_duration_secs) - 1;
+		if (skipped > 0)
+			this->stats.frames_dropped += skipped;
+	}
+	this->last_shown_secs = frame_secs;
+
+	Logger::get("sync") << "frame at " << frame_secs << "s, clock at " << clock_secs << "s, error " << error_ms << "ms\n";
+}
+
+Sync_Stats Playback_Clock::get_stats() const
+{
+	Sync_Stats stats = this->stats;
+	int64_t samples = this->samples_played - this->drift_base_samples;
+	int64_t ns = this->last_callback_ns - this->drift_base_ns;
+	if (this->last_callback_ns != 0)
+		stats.drift_ms = (samples * 1000.0 / this->sample_rate) - ns * 1e-6;
+	return stats;
+}
+
+/***************
+* Audio_Output *
+***************/
+Audio_Output::Audio_Output(Video* video, int sample_rate, int channels, int device_samples)
+	: ring(buffered_blocks * Audio_Mixer::block_samples * channels * sizeof(int16_t)),
+	  clock(sample_rate, device_samples)
+{
+	this->video = video;
+	this->bytes_per_sample = channels * sizeof(int16_t);
+}
+
+Audio_Output::~Audio_Output()
+{
+	stop();
+}
+
+void Audio_Output::start()
+{
+	if (this->producer_thread.joinable())
+		return;
+	this->stop_producer = false;
+	this->producer_thread = std::thread(&Audio_Output::produce, this);
+}
+
+void Audio_Output::stop()
+{
+	this->stop_producer = true;
+	if (this->producer_thread.joinable())
+		this->producer_thread.join();
+}
+
+int Audio_Output::get_underruns() const
+{
+	return this->underruns;
+}
+
+bool Audio_Output::has_clock() const
+{
+	return this->flush_completed == this->flush_requested && this->clock.is_running();
+}
+
+Playback_Clock& Audio_Output::get_clock()
+{
+	return this->clock;
+}
+
+void Audio_Output::flush(float secs)
+{
+	this->flush_secs = secs;
+	this->flush_requested += 1;
+}
+
+void Audio_Output::produce()
+{
+	int block_size = Audio_Mixer::block_samples * this->bytes_per_sample;
+	// a mixed block that didn't fit in the ring yet
+	int pending_offset = block_size;
+
+	while (!this->stop_producer) {
+		int flush = this->flush_requested;
+		if (flush != this->flush_acknowledged) {
+			this->video->reset_audio();
+			pending_offset = block_size;
+			this->flush_acknowledged = flush;
+		}
+
+		// nothing new goes in until the callback has thrown away the old audio
+		if (this->flush_completed != this->flush_acknowledged || this->ring.write_available() == 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			continue;
+		}
+
+		if (pending_offset == block_size) {
+			int ret = this->video->get_next_audio_frame();
+			if (ret < 0) {
+				Logger::get("audio") << "unable to get audio frame: " << av_err2str(ret) << "\n";
+				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+				continue;
+			}
+			pending_offset = 0;
+		}
+
+		const uint8_t* block = this->video->out_audio_frame->data[0];
+		pending_offset += this->ring.write(&block[pending_offset], block_size - pending_offset);
+	}
+}
+
+void Audio_Output::read(uint8_t* stream, int len)
+{
+	int flush = this->flush_acknowledged;
+	if (flush != this->flush_completed) {
+		this->ring.discard();
+		this->clock.restart(this->flush_secs);
+		this->flush_completed = flush;
+	}
+
+	int copied = 0;
+	if (this->flush_completed == this->flush_requested) {
+		copied = this->ring.read(stream, len);
+		// silence doesn't move the clock, video waits for the audio to catch up
+		this->clock.add_samples(copied / this->bytes_per_sample);
+	}
+
+	if (copied < len) {
+		memset(&stream[copied], 0, len - copied);
+		if (this->flush_completed == this->flush_requested)
+			this->underruns += 1;
+	}
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "clip.h"
+#include "ring_buffer.h"
+
+struct Sync_Stats {
+	// audio device clock minus system clock since audio last started flowing
+	float drift_ms = 0;
+	// shown frame time minus playback clock, positive when video is ahead
+	float last_sync_error_ms = 0;
+	float avg_sync_error_ms = 0;
+	float max_sync_error_ms = 0;
+	int frames_shown = 0;
+	// the clock hadn't moved past the frame on screen yet
+	int frames_repeated = 0;
+	// frames the clock moved past before they could be shown
+	int frames_dropped = 0;
+};
+
+// playback position driven by the samples the audio device has consumed
+// interpolated with the system clock between callbacks, so it can't drift from what's heard
+// only the audio thread moves the clock, any thread can read it
+class Playback_Clock {
+public:
+	// device_samples is the device buffer size, the audio handed over in a callback is heard one buffer later
+	Playback_Clock(int sample_rate, int device_samples);
+
+	// audio thread only
+	void restart(float secs);
+	void add_samples(int nb_samples);
+
+	float get_secs() const;
+	// false until audio has played since the last restart
+	bool is_running() const;
+
+	// UI thread only
+	void frame_repeated();
+	void frame_shown(float frame_secs, float clock_secs, float frame_duration_secs);
+	Sync_Stats get_stats() const;
+
+protected:
+	typedef std::chrono::steady_clock clock;
+
+	int sample_rate;
+	int device_samples;
+
+	// odd while the audio thread is updating the fields below
+	std::atomic_int generation{0};
+	std::atomic<float> base_secs{0};
+	std::atomic<int64_t> samples_played{0};
+	std::atomic<int64_t> last_callback_ns{0};
+	// drift is measured from the first callback after audio starts flowing again
+	std::atomic<int64_t> drift_base_samples{0};
+	std::atomic<int64_t> drift_base_ns{0};
+
+	Sync_Stats stats;
+	float last_shown_secs = -1;
+
+	static int64_t now_ns();
+};
+
+// mixes audio on its own thread ahead of the audio device
+// the device callback only copies out of a lock-free ring
+class Audio_Output {
+public:
+	// how much mixed audio is queued ahead of the device
+	static const int buffered_blocks = 8;
+
+	Audio_Output(Video* video, int sample_rate, int channels, int device_samples);
+	~Audio_Output();
+
+	void start();
+	void stop();
+
+	// body of the SDL audio callback, fills silence if the producer fell behind
+	void read(uint8_t* stream, int len);
+	// drops queued audio and mixer state after a seek to secs, the clock restarts there
+	// the renderer calls it once the tracks have seeked, anything mixed before then is thrown away
+	void flush(float secs);
+
+	int get_underruns() const;
+
+	// only meaningful once has_clock() returns true after a flush
+	bool has_clock() const;
+	Playback_Clock& get_clock();
+
+protected:
+	Video* video;
+	int bytes_per_sample;
+	Ring_Buffer ring;
+
+	std::thread producer_thread;
+	std::atomic_bool stop_producer{false};
+	void produce();
+
+	// flush handshake: the producer acknowledges a flush, then waits for the callback to discard
+	std::atomic_int flush_requested{0};
+	std::atomic_int flush_acknowledged{0};
+	std::atomic_int flush_completed{0};
+	std::atomic<float> flush_secs{0};
+
+	Playback_Clock clock;
+
+	std::atomic_int underruns{0};
+};
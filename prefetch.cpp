@@ -0,0 +1,158 @@
+#include "prefetch.h"
+
+#include <cmath>
+
+#include "clip.h"
+#include "logger.h"
+
+Seek_Prefetcher::Seek_Prefetcher(Video* video, std::mutex& video_mutex)
+	: video_mutex(video_mutex)
+{
+	this->video = video;
+}
+
+Seek_Prefetcher::~Seek_Prefetcher()
+{
+	stop();
+}
+
+void Seek_Prefetcher::start()
+{
+	if (this->prefetch_thread.joinable())
+		return;
+	this->stop_prefetching = false;
+	this->prefetch_thread = std::thread(&Seek_Prefetcher::prefetch, this);
+}
+
+void Seek_Prefetcher::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stop_prefetching = true;
+	}
+	this->condition.notify_one();
+	if (this->prefetch_thread.joinable())
+		this->prefetch_thread.join();
+}
+
+void Seek_Prefetcher::set_frame_pool(Frame_Pool* pool)
+{
+	this->frame_pool = pool;
+}
+
+Prefetch_Stats Seek_Prefetcher::get_stats()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->stats;
+}
+
+void Seek_Prefetcher::hover(float secs)
+{
+	if (secs < 0) {
+		this->hover_secs = -1;
+		this->last_requested_secs = -1;
+		return;
+	}
+
+	// moved, start timing the rest again
+	if (this->hover_secs < 0 || std::abs(secs - this->hover_secs) > rest_tolerance_secs) {
+		this->hover_secs = secs;
+		this->hover_since = clock::now();
+		this->last_requested_secs = -1;
+		return;
+	}
+
+	if (clock::now() - this->hover_since < rest_time)
+		return;
+	if (this->last_requested_secs >= 0 && std::abs(this->hover_secs - this->last_requested_secs) <= rest_tolerance_secs)
+		return;
+
+	this->last_requested_secs = this->hover_secs;
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->pending_secs = this->hover_secs;
+	}
+	this->condition.notify_one();
+}
+
+std::unique_ptr<Decoder_Ctx> Seek_Prefetcher::take(const std::string& filename, float file_secs)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	for (auto it = this->warm.begin(); it != this->warm.end(); ++it) {
+		if (it->filename != filename || file_secs < it->file_secs || file_secs > it->file_secs + window_secs)
+			continue;
+		std::unique_ptr<Decoder_Ctx> decoder = std::move(it->decoder);
+		this->warm.erase(it);
+		this->stats.hits += 1;
+		Logger::get("prefetch") << "handing over decoder at " << filename << " " << file_secs << "s\n";
+		return decoder;
+	}
+	this->stats.misses += 1;
+	return nullptr;
+}
+
+void Seek_Prefetcher::prefetch()
+{
+	while (true) {
+		float secs;
+		{
+			std::unique_lock<std::mutex> lock(this->mutex);
+			this->condition.wait(lock, [this] { return this->pending_secs >= 0 || this->stop_prefetching; });
+			if (this->stop_prefetching)
+				return;
+			secs = this->pending_secs;
+			this->pending_secs = -1;
+		}
+		warm_up(secs);
+	}
+}
+
+void Seek_Prefetcher::warm_up(float secs)
+{
+	std::string filename;
+	float file_secs;
+	{
+		std::lock_guard<std::mutex> lock(this->video_mutex);
+		if (!this->video->main_track.get_file_position(secs, &filename, &file_secs))
+			return;
+	}
+
+	// already warm, just mark it recently used
+	Warm_Decoder spare;
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		for (auto it = this->warm.begin(); it != this->warm.end(); ++it) {
+			if (it->filename == filename && std::abs(it->file_secs - file_secs) <= rest_tolerance_secs) {
+				this->warm.splice(this->warm.begin(), this->warm, it);
+				return;
+			}
+		}
+		// past the cap the least recently used decoder moves to the new position
+		if ((int) this->warm.size() >= max_warm) {
+			spare = std::move(this->warm.back());
+			this->warm.pop_back();
+			this->stats.evictions += 1;
+		}
+		this->stats.prefetches += 1;
+	}
+
+	// opening and seeking happens outside the lock, take() can't see this decoder yet
+	if (spare.decoder == nullptr) {
+		spare.decoder = std::make_unique<Decoder_Ctx>();
+		spare.decoder->set_frame_pool(this->frame_pool);
+	}
+	if (spare.decoder->filename != filename) {
+		int ret = spare.decoder->open_file(filename);
+		if (ret < 0) {
+			Logger::get("error") << "unable to open " << filename << " for prefetching: " << av_err2str(ret) << "\n";
+			return;
+		}
+	}
+	spare.decoder->seek(file_secs);
+	spare.filename = filename;
+	spare.file_secs = file_secs;
+	Logger::get("prefetch") << "warming up " << filename << " at " << file_secs << "s\n";
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->warm.push_front(std::move(spare));
+}
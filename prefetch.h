@@ -0,0 +1,82 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "common.h"
+
+class Video;
+
+struct Prefetch_Stats {
+	int prefetches = 0;
+	// seeks that were handed an already positioned decoder
+	int hits = 0;
+	int misses = 0;
+	int evictions = 0;
+};
+
+// keeps spare decoders sitting at timeline positions the cursor has rested on
+// so a click there can swap in a decoder that already has the frame
+class Seek_Prefetcher {
+public:
+	// how many positions are kept warm, the least recently used one is reused past that
+	static const int max_warm = 3;
+	// how long the cursor has to rest before a position is prefetched
+	static constexpr std::chrono::milliseconds rest_time{150};
+	// how far the cursor can wander and still count as resting
+	static constexpr float rest_tolerance_secs = 0.05f;
+	// a warm decoder also serves seeks this far past its position, its cache covers that
+	static constexpr float window_secs = 0.3f;
+
+	// video_mutex guards the tracks, it's held while a position is mapped to a file
+	Seek_Prefetcher(Video* video, std::mutex& video_mutex);
+	~Seek_Prefetcher();
+
+	void start();
+	void stop();
+
+	// UI thread, call every frame with the hovered timeline position or -1
+	void hover(float secs);
+	// hands over a decoder positioned at file_secs, or nullptr
+	std::unique_ptr<Decoder_Ctx> take(const std::string& filename, float file_secs);
+
+	// must be set before start()
+	void set_frame_pool(Frame_Pool* pool);
+
+	Prefetch_Stats get_stats();
+
+protected:
+	typedef std::chrono::steady_clock clock;
+
+	struct Warm_Decoder {
+		std::string filename;
+		float file_secs;
+		std::unique_ptr<Decoder_Ctx> decoder;
+	};
+
+	Video* video;
+	std::mutex& video_mutex;
+	Frame_Pool* frame_pool = nullptr;
+
+	// UI thread only
+	float hover_secs = -1;
+	clock::time_point hover_since;
+	float last_requested_secs = -1;
+
+	std::thread prefetch_thread;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool stop_prefetching = false;
+	float pending_secs = -1;
+	// most recently used first
+	std::list<Warm_Decoder> warm;
+	Prefetch_Stats stats;
+
+	void prefetch();
+	void warm_up(float secs);
+};
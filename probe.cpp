@@ -0,0 +1,126 @@
+#include "probe.h"
+
+#include "common.h"
+#include "logger.h"
+
+Probe_Cache& Probe_Cache::shared()
+{
+	static Probe_Cache cache;
+	return cache;
+}
+
+// duration as Decoder_Ctx::get_duration_secs measures it, plus the video format
+static bool probe_file(const std::string& filename, Media_Info* info)
+{
+	AVFormatContext* format_ctx = nullptr;
+	int ret = avformat_open_input(&format_ctx, filename.c_str(), nullptr, nullptr);
+	if (ret >= 0)
+		ret = avformat_find_stream_info(format_ctx, nullptr);
+	if (ret < 0 || format_ctx->nb_streams < 1) {
+		Logger::get("error") << "Could not probe " << filename << ": " << (ret < 0 ? av_err2str(ret) : "no streams") << "\n";
+		avformat_close_input(&format_ctx);
+		return false;
+	}
+
+	AVStream* first_stream = format_ctx->streams[0];
+	info->duration_secs = av_q2d(first_stream->time_base) * first_stream->duration;
+	int video_index = av_find_best_stream(format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+	if (video_index >= 0) {
+		AVStream* video_stream = format_ctx->streams[video_index];
+		info->width = video_stream->codecpar->width;
+		info->height = video_stream->codecpar->height;
+		info->frame_rate = video_stream->avg_frame_rate;
+	}
+	info->has_audio = av_find_best_stream(format_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0) >= 0;
+	info->has_format = true;
+
+	avformat_close_input(&format_ctx);
+	return true;
+}
+
+float Probe_Cache::get_duration_secs(const std::string& filename)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		auto it = this->files.find(filename);
+		if (it != this->files.end() && it->second.duration_secs >= 0) {
+			this->stats.hits += 1;
+			return it->second.duration_secs;
+		}
+	}
+	return get_info(filename).duration_secs;
+}
+
+Media_Info Probe_Cache::get_info(const std::string& filename)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		auto it = this->files.find(filename);
+		if (it != this->files.end() && it->second.has_format) {
+			this->stats.hits += 1;
+			return it->second;
+		}
+	}
+
+	Media_Info probed;
+	bool found = probe_file(filename, &probed);
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->stats.probes += 1;
+	// failures aren't cached, the file may show up later
+	if (!found)
+		return probed;
+	Media_Info& info = this->files[filename];
+	info.duration_secs = probed.duration_secs;
+	info.width = probed.width;
+	info.height = probed.height;
+	info.frame_rate = probed.frame_rate;
+	info.has_audio = probed.has_audio;
+	info.has_format = true;
+	return info;
+}
+
+std::vector<float> Probe_Cache::get_keyframe_secs(const std::string& filename)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		auto it = this->files.find(filename);
+		if (it != this->files.end() && it->second.has_keyframes) {
+			this->stats.hits += 1;
+			return it->second.keyframe_secs;
+		}
+	}
+
+	std::vector<float> keyframe_secs;
+	int ret = Decoder_Ctx::get_keyframe_secs(filename, &keyframe_secs);
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->stats.probes += 1;
+	// like get_info, a file that couldn't be opened is tried again next time
+	if (ret < 0)
+		return keyframe_secs;
+	Media_Info& info = this->files[filename];
+	info.has_keyframes = true;
+	info.keyframe_secs = keyframe_secs;
+	return keyframe_secs;
+}
+
+bool Probe_Cache::peek(const std::string& filename, Media_Info* info)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	auto it = this->files.find(filename);
+	if (it == this->files.end())
+		return false;
+	*info = it->second;
+	return true;
+}
+
+void Probe_Cache::remember(const std::string& filename, const Media_Info& info)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->files[filename] = info;
+}
+
+Probe_Stats Probe_Cache::get_stats()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->stats;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavutil/rational.h>
+}
+
+struct Probe_Stats {
+	// files actually opened
+	int probes = 0;
+	// answered from the cache
+	int hits = 0;
+};
+
+// what probing a file found, kept so the next piece from the same file doesn't open it again
+struct Media_Info {
+	float duration_secs = -1;
+	// the video stream's format, 0 until probed
+	int width = 0;
+	int height = 0;
+	AVRational frame_rate = {0, 1};
+	bool has_audio = false;
+	bool has_format = false;
+	bool has_keyframes = false;
+	std::vector<float> keyframe_secs;
+};
+
+// process-wide cache of media durations, formats and keyframe positions, safe from any thread
+// files are probed outside the lock, two threads asking for the same new file may both open it
+class Probe_Cache {
+public:
+	static Probe_Cache& shared();
+
+	float get_duration_secs(const std::string& filename);
+	// duration and format, probing the file if they aren't known
+	Media_Info get_info(const std::string& filename);
+	std::vector<float> get_keyframe_secs(const std::string& filename);
+	// what's known about a file without opening it, false if nothing is
+	bool peek(const std::string& filename, Media_Info* info);
+	// takes what a project saved as if it had been probed
+	void remember(const std::string& filename, const Media_Info& info);
+
+	Probe_Stats get_stats();
+
+protected:
+	Probe_Cache() = default;
+
+	std::mutex mutex;
+	std::map<std::string, Media_Info> files;
+	Probe_Stats stats;
+};
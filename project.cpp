@@ -0,0 +1,326 @@
+#include "project.h"
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include <unistd.h>
+
+#include "clip.h"
+#include "logger.h"
+#include "probe.h"
+
+// saved projects start with this, then the version as a u32
+// then the media table, each file's path (relative to the project's directory if it's inside it) and what probing it found:
+//   u32 count, per file: string path, f32 duration, i32 width, i32 height, i32 frame rate num, i32 den,
+//   u8 has audio, u8 has keyframes, u32 keyframe count, f32 keyframes
+// then the main and overlay tracks:
+//   u32 piece count, per piece: u32 media index, f32 video start, f32 file start, f32 duration, u8 transition
+// numbers are little endian, strings are a u32 length and the bytes
+static const char project_magic[4] = { 'V', 'E', 'D', 'P' };
+// older versions are still read, newer ones are refused
+static const uint32_t project_version = 1;
+
+/*********
+* Writer *
+*********/
+struct Project_Writer {
+	std::string data;
+
+	void u8(uint8_t value)
+	{
+		this->data.push_back((char) value);
+	}
+
+	void u32(uint32_t value)
+	{
+		for (int i = 0; i < 4; ++i)
+			this->data.push_back((char) (value >> (8 * i)));
+	}
+
+	void f32(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		u32(bits);
+	}
+
+	void string(const std::string& value)
+	{
+		u32(value.size());
+		this->data.append(value);
+	}
+};
+
+// media paths are relative to the working directory, the project can be opened from anywhere
+static std::string absolute_path(const std::string& filename)
+{
+	if (filename.size() > 0 && filename[0] == '/')
+		return filename;
+	char cwd[PATH_MAX];
+	if (getcwd(cwd, sizeof(cwd)) == nullptr)
+		return filename;
+	return std::string(cwd) + "/" + filename;
+}
+
+// media next to the project or below it is saved relative to it so the two can be moved together, anything else absolute
+static std::string project_relative_path(const std::string& project_filename, const std::string& media_filename)
+{
+	std::string project_dir = absolute_path(project_filename);
+	project_dir = project_dir.substr(0, project_dir.find_last_of('/') + 1);
+	std::string media_path = absolute_path(media_filename);
+	if (project_dir.size() > 0 && media_path.compare(0, project_dir.size(), project_dir) == 0)
+		return media_path.substr(project_dir.size());
+	return media_path;
+}
+
+int save_project(const std::string& filename, const std::list<TrackPiece>& main_pieces, const std::list<TrackPiece>& overlay_pieces)
+{
+	// every file a piece refers to, in the order first used
+	std::vector<std::string> media;
+	std::map<std::string, uint32_t> media_index;
+	for (const std::list<TrackPiece>* pieces : { &main_pieces, &overlay_pieces }) {
+		for (const TrackPiece& piece : *pieces) {
+			if (media_index.count(piece.file.filename) > 0)
+				continue;
+			media_index[piece.file.filename] = media.size();
+			media.push_back(piece.file.filename);
+		}
+	}
+
+	Project_Writer out;
+	out.data.append(project_magic, sizeof(project_magic));
+	out.u32(project_version);
+
+	out.u32(media.size());
+	for (const std::string& media_filename : media) {
+		// never opens the file, anything the cache doesn't know is saved as unknown
+		Media_Info info;
+		Probe_Cache::shared().peek(media_filename, &info);
+		if (!info.has_keyframes)
+			info.keyframe_secs.clear();
+		out.string(project_relative_path(filename, media_filename));
+		out.f32(info.duration_secs);
+		out.u32(info.width);
+		out.u32(info.height);
+		out.u32(info.frame_rate.num);
+		out.u32(info.frame_rate.den);
+		out.u8(info.has_audio);
+		out.u8(info.has_keyframes);
+		out.u32(info.keyframe_secs.size());
+		for (float keyframe_secs : info.keyframe_secs)
+			out.f32(keyframe_secs);
+	}
+
+	for (const std::list<TrackPiece>* pieces : { &main_pieces, &overlay_pieces }) {
+		out.u32(pieces->size());
+		for (const TrackPiece& piece : *pieces) {
+			out.u32(media_index[piece.file.filename]);
+			out.f32(piece.file.video_start_secs);
+			out.f32(piece.file.file_start_secs);
+			out.f32(piece.file.duration_secs);
+			out.u8(piece.transition == TransitionEffect::Fade ? 1 : 0);
+		}
+	}
+
+	// written next to the project and renamed over it, a failed save leaves the old one intact
+	std::string temp_filename = filename + ".tmp";
+	{
+		std::ofstream file(temp_filename, std::ios::binary | std::ios::trunc);
+		file.write(out.data.data(), out.data.size());
+		if (!file) {
+			Logger::get("error") << "Could not write project " << temp_filename << "\n";
+			return AVERROR(EIO);
+		}
+	}
+	// rename replaces the old project in one step, there's never a moment without one
+	if (std::rename(temp_filename.c_str(), filename.c_str()) != 0) {
+		Logger::get("error") << "Could not replace project " << filename << "\n";
+		return AVERROR(EIO);
+	}
+	Logger::get("project") << "saved " << filename << ": " << media.size() << " files, " << main_pieces.size() << " + " << overlay_pieces.size() << " pieces\n";
+	return 0;
+}
+
+/*********
+* Reader *
+*********/
+// reads past the end come back as zeros with ok cleared
+struct Project_Reader {
+	const std::string& data;
+	size_t pos = 0;
+	bool ok = true;
+
+	Project_Reader(const std::string& data) : data(data) {}
+
+	bool has(size_t size)
+	{
+		this->ok = this->ok && this->data.size() - this->pos >= size;
+		return this->ok;
+	}
+
+	uint8_t u8()
+	{
+		if (!has(1))
+			return 0;
+		return (uint8_t) this->data[this->pos++];
+	}
+
+	uint32_t u32()
+	{
+		if (!has(4))
+			return 0;
+		uint32_t value = 0;
+		for (int i = 0; i < 4; ++i)
+			value |= (uint32_t) (uint8_t) this->data[this->pos++] << (8 * i);
+		return value;
+	}
+
+	float f32()
+	{
+		uint32_t bits = u32();
+		float value;
+		memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	std::string string()
+	{
+		uint32_t size = u32();
+		if (!has(size))
+			return "";
+		std::string value = this->data.substr(this->pos, size);
+		this->pos += size;
+		return value;
+	}
+};
+
+static std::string resolve_path(const std::string& project_filename, const std::string& media_filename)
+{
+	if (media_filename.size() > 0 && media_filename[0] == '/')
+		return media_filename;
+	size_t slash = project_filename.find_last_of('/');
+	if (slash == std::string::npos)
+		return media_filename;
+	return project_filename.substr(0, slash + 1) + media_filename;
+}
+
+static int load_saved_project(const std::string& filename, const std::string& data, Video* video)
+{
+	Project_Reader in(data);
+	in.pos = sizeof(project_magic);
+	uint32_t version = in.u32();
+	if (version > project_version) {
+		Logger::get("error") << filename << " is project version " << version << ", newer than " << project_version << "\n";
+		return AVERROR_INVALIDDATA;
+	}
+
+	// the probe cache takes the saved media info, nothing gets opened until a frame is needed
+	std::vector<std::string> media(in.u32());
+	for (size_t i = 0; i < media.size() && in.ok; ++i) {
+		Media_Info info;
+		media[i] = resolve_path(filename, in.string());
+		info.duration_secs = in.f32();
+		info.width = in.u32();
+		info.height = in.u32();
+		info.frame_rate.num = in.u32();
+		info.frame_rate.den = in.u32();
+		info.has_audio = in.u8() != 0;
+		info.has_format = info.width != 0;
+		info.has_keyframes = in.u8() != 0;
+		uint32_t keyframe_count = in.u32();
+		if (!in.has((size_t) keyframe_count * 4))
+			break;
+		info.keyframe_secs.resize(keyframe_count);
+		for (float& keyframe_secs : info.keyframe_secs)
+			keyframe_secs = in.f32();
+		if (info.duration_secs >= 0)
+			Probe_Cache::shared().remember(media[i], info);
+	}
+
+	std::list<TrackPiece> tracks[2];
+	for (std::list<TrackPiece>& pieces : tracks) {
+		uint32_t count = in.u32();
+		for (uint32_t i = 0; i < count && in.ok; ++i) {
+			uint32_t index = in.u32();
+			float video_start_secs = in.f32();
+			float file_start_secs = in.f32();
+			float duration_secs = in.f32();
+			TransitionEffect transition = in.u8() == 1 ? TransitionEffect::Fade : TransitionEffect::None;
+			if (index >= media.size()) {
+				in.ok = false;
+				break;
+			}
+			pieces.push_back(TrackPiece(FilePiece(media[index], video_start_secs, file_start_secs, duration_secs), transition));
+		}
+	}
+	if (!in.ok) {
+		Logger::get("error") << "project " << filename << " is truncated or corrupt\n";
+		return AVERROR_INVALIDDATA;
+	}
+
+	video->main_track.set_pieces(tracks[0]);
+	video->overlay_track.set_pieces(tracks[1]);
+	Logger::get("project") << "loaded " << filename << ": " << media.size() << " files, " << tracks[0].size() << " + " << tracks[1].size() << " pieces\n";
+	return 0;
+}
+
+static int load_text_project(const std::string& filename, const std::string& data, Video* video)
+{
+	std::istringstream in(data);
+	std::string line;
+	int line_number = 0;
+	int pieces = 0;
+	while (std::getline(in, line)) {
+		line_number += 1;
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		std::istringstream fields(line);
+		std::string track, transition, media_filename;
+		fields >> track >> transition >> std::ws;
+		std::getline(fields, media_filename);
+		if ((track != "main" && track != "overlay") || (transition != "none" && transition != "fade") || media_filename.empty()) {
+			Logger::get("error") << filename << ":" << line_number << ": expected <main|overlay> <none|fade> <file>\n";
+			return AVERROR_INVALIDDATA;
+		}
+
+		TransitionEffect effect = transition == "fade" ? TransitionEffect::Fade : TransitionEffect::None;
+		media_filename = resolve_path(filename, media_filename);
+		// the piece would be added with a negative duration
+		if (Probe_Cache::shared().get_duration_secs(media_filename) < 0) {
+			Logger::get("error") << filename << ":" << line_number << ": can't read " << media_filename << "\n";
+			return AVERROR_INVALIDDATA;
+		}
+		if (track == "main")
+			video->addToMainTrack(media_filename, effect);
+		else
+			video->addToOverlayTrack(media_filename, effect);
+		pieces += 1;
+	}
+
+	if (pieces == 0) {
+		Logger::get("error") << "project " << filename << " has no pieces\n";
+		return AVERROR_INVALIDDATA;
+	}
+	return 0;
+}
+
+int load_project(const std::string& filename, Video* video)
+{
+	std::ifstream file(filename, std::ios::binary);
+	if (!file) {
+		Logger::get("error") << "Could not open project " << filename << "\n";
+		return AVERROR(ENOENT);
+	}
+	std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	if (data.size() >= sizeof(project_magic) && memcmp(data.data(), project_magic, sizeof(project_magic)) == 0)
+		return load_saved_project(filename, data, video);
+	return load_text_project(filename, data, video);
+}
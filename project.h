@@ -0,0 +1,19 @@
+#pragma once
+
+#include <list>
+#include <string>
+
+class Video;
+struct TrackPiece;
+
+// projects are saved in a compact binary format, see project.cpp, which keeps each media file's
+// probed duration, format and keyframes so loading one rebuilds the timeline without opening any media
+// a text file is also read as a project, with one piece per line appended to its track in order:
+//   <main|overlay> <none|fade> <media file>
+// blank lines and lines starting with # are skipped, relative media paths are relative to the project
+
+// lazy for saved projects, text projects probe each file as they're added
+int load_project(const std::string& filename, Video* video);
+// takes copies of the tracks' pieces, so the video mutex isn't held while the file is written
+// media info comes from the probe cache, keyframes it hasn't scanned yet are scanned on the next load
+int save_project(const std::string& filename, const std::list<TrackPiece>& main_pieces, const std::list<TrackPiece>& overlay_pieces);
@@ -0,0 +1,582 @@
+#include "remote.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "logger.h"
+
+/***********
+* Messages *
+***********/
+// every message is a 4 byte big endian length and a payload whose first line is the message type
+// segment  coordinator to worker, settings and clip lists, see write_segment
+// cancel   coordinator to worker, stop the running segment
+// quit     coordinator to worker
+// progress worker to coordinator, 0 to 1
+// result   worker to coordinator, the error code and stats, followed by data messages and end
+// data     raw bytes of the encoded segment after the type line
+
+// files are sent in pieces this size
+static const size_t data_chunk_size = 1 << 20;
+// refuses anything bigger, a corrupt length shouldn't allocate gigabytes
+static const uint32_t max_message_size = 64 << 20;
+
+static std::string message_type(const std::string& message)
+{
+	return message.substr(0, message.find('\n'));
+}
+
+static std::string message_body(const std::string& message)
+{
+	size_t newline = message.find('\n');
+	return newline == std::string::npos ? "" : message.substr(newline + 1);
+}
+
+static void write_pieces(std::ostream& out, const char* track, const std::list<TrackPiece>& pieces)
+{
+	for (const TrackPiece& piece : pieces)
+		out << "piece " << track << " " << (piece.transition == TransitionEffect::Fade ? "fade" : "none") << " "
+			<< piece.file.video_start_secs << " " << piece.file.file_start_secs << " " << piece.file.duration_secs << " " << piece.file.filename << "\n";
+}
+
+static std::string write_segment(const Export_Settings& settings, const std::list<TrackPiece>& main_pieces, const std::list<TrackPiece>& overlay_pieces)
+{
+	std::ostringstream out;
+	out << std::setprecision(9);
+	out << "segment\n";
+	out << "format " << settings.format_name << "\n";
+	out << "video_codec " << avcodec_get_name(settings.video_codec) << "\n";
+	out << "audio_codec " << avcodec_get_name(settings.audio_codec) << "\n";
+	if (settings.pix_fmt != AV_PIX_FMT_NONE)
+		out << "pix_fmt " << av_get_pix_fmt_name(settings.pix_fmt) << "\n";
+	out << "max_b_frames " << settings.max_b_frames << "\n";
+	out << "threads " << settings.threads << "\n";
+	out << "inline_headers " << settings.inline_headers << "\n";
+	out << "streams " << settings.video << " " << settings.audio << "\n";
+	out << "size " << settings.width << " " << settings.height << "\n";
+	out << "frame_rate " << settings.frame_rate.num << " " << settings.frame_rate.den << "\n";
+	out << "audio " << settings.sample_rate << " " << settings.channels << "\n";
+	out << "gains " << settings.main_gain << " " << settings.overlay_gain << "\n";
+	out << "bit_rates " << settings.video_bit_rate << " " << settings.audio_bit_rate << "\n";
+	out << "range " << settings.start_secs << " " << settings.end_secs << "\n";
+	write_pieces(out, "main", main_pieces);
+	write_pieces(out, "overlay", overlay_pieces);
+	return out.str();
+}
+
+static AVCodecID codec_by_name(const std::string& name)
+{
+	const AVCodecDescriptor* descriptor = avcodec_descriptor_get_by_name(name.c_str());
+	return descriptor != nullptr ? descriptor->id : AV_CODEC_ID_NONE;
+}
+
+static bool read_segment(const std::string& body, Export_Settings* settings, std::list<TrackPiece>* main_pieces, std::list<TrackPiece>* overlay_pieces)
+{
+	std::istringstream in(body);
+	std::string line;
+	while (std::getline(in, line)) {
+		std::istringstream fields(line);
+		std::string key, value;
+		fields >> key;
+		if (key == "format")
+			fields >> settings->format_name;
+		else if (key == "video_codec" && fields >> value)
+			settings->video_codec = codec_by_name(value);
+		else if (key == "audio_codec" && fields >> value)
+			settings->audio_codec = codec_by_name(value);
+		else if (key == "pix_fmt" && fields >> value)
+			settings->pix_fmt = av_get_pix_fmt(value.c_str());
+		else if (key == "max_b_frames")
+			fields >> settings->max_b_frames;
+		else if (key == "threads")
+			fields >> settings->threads;
+		else if (key == "inline_headers")
+			fields >> settings->inline_headers;
+		else if (key == "streams")
+			fields >> settings->video >> settings->audio;
+		else if (key == "size")
+			fields >> settings->width >> settings->height;
+		else if (key == "frame_rate")
+			fields >> settings->frame_rate.num >> settings->frame_rate.den;
+		else if (key == "audio")
+			fields >> settings->sample_rate >> settings->channels;
+		else if (key == "gains")
+			fields >> settings->main_gain >> settings->overlay_gain;
+		else if (key == "bit_rates")
+			fields >> settings->video_bit_rate >> settings->audio_bit_rate;
+		else if (key == "range")
+			fields >> settings->start_secs >> settings->end_secs;
+		else if (key == "piece") {
+			std::string track, transition, filename;
+			float video_start_secs, file_start_secs, duration_secs;
+			fields >> track >> transition >> video_start_secs >> file_start_secs >> duration_secs >> std::ws;
+			std::getline(fields, filename);
+			if (!fields.eof() && fields.fail())
+				return false;
+			TrackPiece piece(FilePiece(filename, video_start_secs, file_start_secs, duration_secs), transition == "fade" ? TransitionEffect::Fade : TransitionEffect::None);
+			(track == "overlay" ? overlay_pieces : main_pieces)->push_back(piece);
+		}
+		if (fields.fail() && !fields.eof())
+			return false;
+	}
+	return main_pieces->size() > 0;
+}
+
+static std::string write_result(int error, const Export_Stats& stats)
+{
+	std::ostringstream out;
+	out << "result\n";
+	out << "error " << error << "\n";
+	out << "frames " << stats.frames_total << " " << stats.frames_composited << " " << stats.frames_repeated << "\n";
+	out << "audio " << stats.audio_blocks << " " << stats.silent_blocks << "\n";
+	out << "packets " << stats.video_packets << " " << stats.audio_packets << "\n";
+	return out.str();
+}
+
+static int read_result(const std::string& body, Export_Stats* stats)
+{
+	std::istringstream in(body);
+	std::string line;
+	int error = AVERROR_INVALIDDATA;
+	while (std::getline(in, line)) {
+		std::istringstream fields(line);
+		std::string key;
+		fields >> key;
+		if (key == "error")
+			fields >> error;
+		else if (key == "frames")
+			fields >> stats->frames_total >> stats->frames_composited >> stats->frames_repeated;
+		else if (key == "audio")
+			fields >> stats->audio_blocks >> stats->silent_blocks;
+		else if (key == "packets")
+			fields >> stats->video_packets >> stats->audio_packets;
+	}
+	return error;
+}
+
+#ifndef _WIN32
+/**********
+* Sockets *
+**********/
+// writing to a worker that went away mustn't kill the process with SIGPIPE
+#ifdef __APPLE__
+// no MSG_NOSIGNAL, every socket is set up with SO_NOSIGPIPE instead
+static const int send_flags = 0;
+
+static void set_no_sigpipe(int fd)
+{
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+}
+#else
+static const int send_flags = MSG_NOSIGNAL;
+
+static void set_no_sigpipe(int)
+{
+}
+#endif
+
+static bool write_all(int fd, const char* data, size_t size)
+{
+	while (size > 0) {
+		ssize_t written = send(fd, data, size, send_flags);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+static bool read_all(int fd, char* data, size_t size)
+{
+	while (size > 0) {
+		ssize_t got = recv(fd, data, size, 0);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return false;
+		data += got;
+		size -= got;
+	}
+	return true;
+}
+
+static bool send_message(int fd, const std::string& message)
+{
+	uint32_t size = message.size();
+	char header[4] = { (char) (size >> 24), (char) (size >> 16), (char) (size >> 8), (char) size };
+	return write_all(fd, header, 4) && write_all(fd, message.data(), message.size());
+}
+
+static bool receive_message(int fd, std::string* message)
+{
+	unsigned char header[4];
+	if (!read_all(fd, (char*) header, 4))
+		return false;
+	uint32_t size = (uint32_t) header[0] << 24 | (uint32_t) header[1] << 16 | (uint32_t) header[2] << 8 | header[3];
+	if (size > max_message_size)
+		return false;
+	message->resize(size);
+	return size == 0 || read_all(fd, &(*message)[0], size);
+}
+
+// waits up to timeout_ms for fd to have something to read
+static bool wait_readable(int fd, int timeout_ms)
+{
+	struct pollfd poll_fd = { fd, POLLIN, 0 };
+	return poll(&poll_fd, 1, timeout_ms) > 0;
+}
+
+// fills addr from unix:<path> or tcp:<host>:<port>
+static bool parse_address(const std::string& address, struct sockaddr_storage* addr, socklen_t* addr_size)
+{
+	memset(addr, 0, sizeof(*addr));
+	if (address.compare(0, 5, "unix:") == 0) {
+		struct sockaddr_un* unix_addr = (struct sockaddr_un*) addr;
+		std::string path = address.substr(5);
+		if (path.size() >= sizeof(unix_addr->sun_path))
+			return false;
+		unix_addr->sun_family = AF_UNIX;
+		strncpy(unix_addr->sun_path, path.c_str(), sizeof(unix_addr->sun_path) - 1);
+		*addr_size = sizeof(struct sockaddr_un);
+		return true;
+	}
+	if (address.compare(0, 4, "tcp:") == 0) {
+		size_t colon = address.rfind(':');
+		std::string host = address.substr(4, colon - 4);
+		std::string port = address.substr(colon + 1);
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		struct addrinfo* found = nullptr;
+		if (colon <= 4 || getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0)
+			return false;
+		memcpy(addr, found->ai_addr, found->ai_addrlen);
+		*addr_size = found->ai_addrlen;
+		freeaddrinfo(found);
+		return true;
+	}
+	return false;
+}
+
+static int open_socket(const std::string& address, bool listening)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_size;
+	if (!parse_address(address, &addr, &addr_size)) {
+		Logger::get("error") << "bad worker address " << address << ", expected unix:<path> or tcp:<host>:<port>\n";
+		return -1;
+	}
+
+	int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	set_no_sigpipe(fd);
+	int ret;
+	if (listening) {
+		int reuse = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		if (addr.ss_family == AF_UNIX)
+			unlink(((struct sockaddr_un*) &addr)->sun_path);
+		ret = bind(fd, (struct sockaddr*) &addr, addr_size);
+		if (ret == 0)
+			ret = listen(fd, 16);
+	} else {
+		ret = connect(fd, (struct sockaddr*) &addr, addr_size);
+	}
+	if (ret < 0) {
+		Logger::get("error") << "Could not " << (listening ? "listen on " : "connect to ") << address << ": " << strerror(errno) << "\n";
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+std::string local_worker_address(const std::string& name)
+{
+	return std::string("unix:") + P_tmpdir + "/" + name + "-" + std::to_string(getpid()) + ".sock";
+}
+
+/***************
+* Coordinator *
+***************/
+Distributed_Exporter::Distributed_Exporter(const Export_Settings& settings, const std::string& address, int workers)
+	: Segmented_Exporter(settings, workers)
+{
+	this->address = address;
+	this->worker_count = std::max(1, workers);
+}
+
+Distributed_Exporter::~Distributed_Exporter()
+{
+	// the run thread calls export_segment, it has to be gone before the connections are
+	cancel();
+	wait();
+	close_workers();
+}
+
+int Distributed_Exporter::spawn_local_workers(const std::string& executable)
+{
+	if (this->listen_fd < 0)
+		this->listen_fd = open_socket(this->address, true);
+	if (this->listen_fd < 0)
+		return AVERROR(EADDRNOTAVAIL);
+
+	for (int i = 0; i < this->worker_count; ++i) {
+		pid_t pid = fork();
+		if (pid < 0)
+			return AVERROR(errno);
+		if (pid == 0) {
+			execl(executable.c_str(), executable.c_str(), "--worker", this->address.c_str(), (char*) nullptr);
+			_exit(127);
+		}
+		this->children.push_back(pid);
+	}
+	Logger::get("remote") << "spawned " << this->worker_count << " workers on " << this->address << "\n";
+	return 0;
+}
+
+int Distributed_Exporter::start()
+{
+	if (this->listen_fd < 0)
+		this->listen_fd = open_socket(this->address, true);
+	if (this->listen_fd < 0)
+		return AVERROR(EADDRNOTAVAIL);
+
+	// one connection per worker, each serves one of the job threads
+	auto deadline = std::chrono::steady_clock::now() + accept_timeout;
+	while ((int) this->connections.size() < this->worker_count) {
+		int remaining_ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		if (remaining_ms <= 0 || !wait_readable(this->listen_fd, remaining_ms))
+			break;
+		int fd = accept(this->listen_fd, nullptr, nullptr);
+		if (fd >= 0) {
+			set_no_sigpipe(fd);
+			this->connections.push_back(fd);
+		}
+	}
+	if (this->connections.size() == 0) {
+		Logger::get("error") << "no workers connected to " << this->address << "\n";
+		return AVERROR(ETIMEDOUT);
+	}
+	Logger::get("remote") << this->connections.size() << " of " << this->worker_count << " workers connected\n";
+	this->jobs = this->connections.size();
+	return Segmented_Exporter::start();
+}
+
+int Distributed_Exporter::export_segment(int worker, Segment* segment, const Export_Settings& settings)
+{
+	int fd = this->connections[worker];
+	if (!send_message(fd, write_segment(settings, this->main_pieces, this->overlay_pieces)))
+		return AVERROR(EPIPE);
+
+	FILE* out = fopen(segment->filename.c_str(), "wb");
+	if (out == nullptr)
+		return AVERROR(errno);
+
+	int error = 0;
+	bool cancel_sent = false;
+	std::string message;
+	while (true) {
+		if (this->cancelled && !cancel_sent) {
+			cancel_sent = send_message(fd, "cancel\n");
+			error = AVERROR_EXIT;
+		}
+		if (!wait_readable(fd, progress_interval_ms))
+			continue;
+		if (!receive_message(fd, &message)) {
+			Logger::get("error") << "worker " << worker << " disconnected during " << segment->filename << "\n";
+			error = AVERROR(EPIPE);
+			break;
+		}
+
+		std::string type = message_type(message);
+		if (type == "progress") {
+			std::lock_guard<std::mutex> lock(this->segments_mutex);
+			segment->progress = std::strtof(message_body(message).c_str(), nullptr);
+		} else if (type == "result") {
+			Export_Stats stats;
+			int ret = read_result(message_body(message), &stats);
+			if (error == 0)
+				error = ret;
+			std::lock_guard<std::mutex> lock(this->segments_mutex);
+			segment->stats = stats;
+		} else if (type == "data") {
+			size_t offset = message.find('\n') + 1;
+			if (fwrite(message.data() + offset, 1, message.size() - offset, out) != message.size() - offset && error == 0)
+				error = AVERROR(EIO);
+		} else if (type == "end") {
+			break;
+		}
+	}
+	if (fclose(out) != 0 && error == 0)
+		error = AVERROR(EIO);
+	return error;
+}
+
+void Distributed_Exporter::close_workers()
+{
+	for (int fd : this->connections) {
+		send_message(fd, "quit\n");
+		close(fd);
+	}
+	this->connections.clear();
+	if (this->listen_fd >= 0) {
+		close(this->listen_fd);
+		this->listen_fd = -1;
+		if (this->address.compare(0, 5, "unix:") == 0)
+			unlink(this->address.substr(5).c_str());
+	}
+	for (int pid : this->children)
+		waitpid(pid, nullptr, 0);
+	this->children.clear();
+}
+
+/*********
+* Worker *
+*********/
+// renders one segment to a local file and streams it back
+static int render_segment(int fd, const std::string& body)
+{
+	Export_Settings settings;
+	std::list<TrackPiece> main_pieces;
+	std::list<TrackPiece> overlay_pieces;
+	if (!read_segment(body, &settings, &main_pieces, &overlay_pieces)) {
+		send_message(fd, write_result(AVERROR_INVALIDDATA, Export_Stats()));
+		return send_message(fd, "end\n") ? 0 : AVERROR(EPIPE);
+	}
+	settings.filename = std::string(P_tmpdir) + "/worker-" + std::to_string(getpid()) + ".mkv";
+
+	int ret;
+	Export_Stats stats;
+	{
+		Exporter exporter(settings);
+		exporter.load(main_pieces, overlay_pieces);
+		ret = exporter.start();
+		// reports progress and listens for a cancel while the exporter runs
+		std::string message;
+		bool cancelled = false;
+		while (ret >= 0 && !exporter.is_finished()) {
+			if (wait_readable(fd, Distributed_Exporter::progress_interval_ms)) {
+				if (!receive_message(fd, &message) || message_type(message) == "cancel" || message_type(message) == "quit") {
+					exporter.cancel();
+					cancelled = true;
+				}
+				continue;
+			}
+			send_message(fd, "progress\n" + std::to_string(exporter.get_progress()));
+		}
+		if (ret >= 0)
+			ret = exporter.wait();
+		// a cancelled exporter stops without an error, its file is only part of the segment
+		if (ret >= 0 && cancelled)
+			ret = AVERROR_EXIT;
+		stats = exporter.get_stats();
+	}
+	Logger::get("remote") << "rendered " << stats.frames_composited << " frames from " << settings.start_secs << "s: " << (ret < 0 ? av_err2str(ret) : "ok") << "\n";
+
+	bool sent = send_message(fd, write_result(ret, stats));
+	FILE* in = ret >= 0 ? fopen(settings.filename.c_str(), "rb") : nullptr;
+	if (in != nullptr) {
+		std::string chunk;
+		while (sent) {
+			chunk.assign("data\n");
+			chunk.resize(5 + data_chunk_size);
+			size_t got = fread(&chunk[5], 1, data_chunk_size, in);
+			if (got == 0)
+				break;
+			chunk.resize(5 + got);
+			sent = send_message(fd, chunk);
+		}
+		fclose(in);
+	}
+	std::remove(settings.filename.c_str());
+	sent = sent && send_message(fd, "end\n");
+	return sent ? 0 : AVERROR(EPIPE);
+}
+
+int run_worker(int argc, char* argv[])
+{
+	Logger::addCategory("remote");
+	if (argc < 1) {
+		std::cerr << "usage: --worker <unix:path|tcp:host:port>\n";
+		return 2;
+	}
+	int fd = open_socket(argv[0], false);
+	if (fd < 0)
+		return 1;
+
+	std::string message;
+	while (receive_message(fd, &message)) {
+		std::string type = message_type(message);
+		if (type == "quit")
+			break;
+		if (type == "segment" && render_segment(fd, message_body(message)) < 0)
+			break;
+	}
+	close(fd);
+	return 0;
+}
+#else
+Distributed_Exporter::Distributed_Exporter(const Export_Settings& settings, const std::string& address, int workers)
+	: Segmented_Exporter(settings, workers)
+{
+	this->address = address;
+	this->worker_count = workers;
+}
+
+Distributed_Exporter::~Distributed_Exporter()
+{
+	cancel();
+	wait();
+}
+
+int Distributed_Exporter::spawn_local_workers(const std::string&)
+{
+	return AVERROR(ENOSYS);
+}
+
+int Distributed_Exporter::start()
+{
+	Logger::get("error") << "worker processes aren't supported on windows\n";
+	return AVERROR(ENOSYS);
+}
+
+int Distributed_Exporter::export_segment(int, Segment*, const Export_Settings&)
+{
+	return AVERROR(ENOSYS);
+}
+
+void Distributed_Exporter::close_workers()
+{
+}
+
+std::string local_worker_address(const std::string&)
+{
+	return "";
+}
+
+int run_worker(int, char*[])
+{
+	std::cerr << "worker processes aren't supported on windows\n";
+	return 1;
+}
+#endif
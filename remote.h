@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "export.h"
+
+// a segmented export whose segments are rendered by worker processes over a socket
+// the coordinator sends each worker a segment's settings and the clip lists, the worker renders it
+// with its own decoders and filters and streams the encoded file back, and the coordinator joins them as usual
+// addresses are unix:<path> or tcp:<host>:<port>, media paths have to resolve the same way on every worker
+class Distributed_Exporter : public Segmented_Exporter {
+public:
+	// how long start() waits for the workers to connect
+	static constexpr std::chrono::milliseconds accept_timeout{10000};
+	// how often a worker reports progress while rendering
+	static const int progress_interval_ms = 500;
+
+	Distributed_Exporter(const Export_Settings& settings, const std::string& address, int workers);
+	~Distributed_Exporter();
+
+	// runs workers as child processes of executable on this machine, call before start
+	int spawn_local_workers(const std::string& executable);
+	// listens, waits for the workers and starts exporting
+	int start() override;
+
+protected:
+	std::string address;
+	int worker_count;
+	int listen_fd = -1;
+	std::vector<int> connections;
+	std::vector<int> children;
+
+	int export_segment(int worker, Segment* segment, const Export_Settings& settings) override;
+	void close_workers();
+};
+
+// a unix socket in the temp directory, unique to this process
+std::string local_worker_address(const std::string& name);
+
+// entry point for main --worker <address>, renders segments until the coordinator is done
+int run_worker(int argc, char* argv[]);
@@ -0,0 +1,196 @@
+#include "render.h"
+
+#include "logger.h"
+#include "playback.h"
+
+Frame_Renderer::Frame_Renderer(Video* video, int width, int height)
+{
+	this->video = video;
+	this->width = width;
+	this->height = height;
+	for (auto& frame : this->frames)
+		frame.frame = av_frame_alloc();
+}
+
+Frame_Renderer::~Frame_Renderer()
+{
+	stop();
+	for (auto& frame : this->frames)
+		av_frame_free(&frame.frame);
+}
+
+void Frame_Renderer::start()
+{
+	if (this->render_thread.joinable())
+		return;
+	this->stop_rendering = false;
+	this->render_thread = std::thread(&Frame_Renderer::render, this);
+}
+
+void Frame_Renderer::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->request_mutex);
+		this->stop_rendering = true;
+	}
+	this->request_condition.notify_one();
+	if (this->render_thread.joinable())
+		this->render_thread.join();
+}
+
+void Frame_Renderer::request(float secs)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->request_mutex);
+		// a pending seek or scrub still has to happen, it just lands somewhere else
+		// a pending refinement is for a frame that's no longer wanted
+		if (this->request_type == Request::Refine)
+			this->request_type = Request::Frame;
+		this->request_secs = secs;
+		this->has_request = true;
+		this->request_follow_up = false;
+	}
+	this->request_condition.notify_one();
+}
+
+void Frame_Renderer::seek(float secs)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->request_mutex);
+		this->request_secs = secs;
+		this->request_type = Request::Seek;
+		this->has_request = true;
+		this->request_follow_up = false;
+		this->seeks_requested += 1;
+	}
+	this->request_condition.notify_one();
+}
+
+void Frame_Renderer::scrub(float secs)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->request_mutex);
+		this->request_secs = secs;
+		this->request_type = Request::Scrub;
+		this->has_request = true;
+		this->request_follow_up = false;
+	}
+	this->request_condition.notify_one();
+}
+
+bool Frame_Renderer::is_seeking() const
+{
+	return this->seeks_done != this->seeks_requested;
+}
+
+void Frame_Renderer::set_audio_output(Audio_Output* audio_output)
+{
+	this->audio_output = audio_output;
+}
+
+std::mutex& Frame_Renderer::get_video_mutex()
+{
+	return this->video_mutex;
+}
+
+int Frame_Renderer::get_frames_superseded() const
+{
+	return this->frames_superseded;
+}
+
+void Frame_Renderer::render()
+{
+	while (true) {
+		float secs;
+		Request type;
+		int seeks;
+		{
+			std::unique_lock<std::mutex> lock(this->request_mutex);
+			this->request_condition.wait(lock, [this] { return this->has_request || this->stop_rendering; });
+			if (this->stop_rendering)
+				return;
+			secs = this->request_secs;
+			type = this->request_type;
+			seeks = this->seeks_requested;
+			this->follow_ups = this->request_follow_up ? this->follow_ups + 1 : 0;
+			this->has_request = false;
+			this->request_type = Request::Frame;
+		}
+
+		std::lock_guard<std::mutex> lock(this->video_mutex);
+		if (type == Request::Seek) {
+			this->video->seek(secs);
+			// the mixer only starts over once the tracks are at secs, or it would mix what was buffered before
+			if (this->audio_output != nullptr)
+				this->audio_output->flush(secs);
+			this->seeks_done = seeks;
+		}
+
+		int deadline_ms = frame_deadline_ms;
+		if (type != Request::Frame)
+			deadline_ms = seek_deadline_ms;
+
+		int ret;
+		bool provisional = false;
+		if (type == Request::Scrub)
+			ret = this->video->scrub(secs, this->width, this->height);
+		else
+			ret = this->video->request_video_frame(secs, this->width, this->height, deadline_ms, &provisional);
+		if (ret != 0) {
+			Logger::get("render") << "no frame at " << secs << "s: " << av_err2str(ret) << "\n";
+			// the keyframe is still decoding, otherwise it'd only show once the mouse moves again
+			if (type == Request::Scrub && ret == AVERROR(EAGAIN) && this->follow_ups < max_follow_ups)
+				follow_up(secs, Request::Scrub);
+			continue;
+		}
+
+		Rendered_Frame& out = this->frames[this->back];
+		av_frame_unref(out.frame);
+		ret = av_frame_ref(out.frame, this->video->out_video_frame);
+		if (ret < 0) {
+			Logger::get("error") << "unable to reference rendered frame: " << av_err2str(ret) << "\n";
+			continue;
+		}
+		out.requested_secs = secs;
+		out.frame_secs = this->video->get_last_video_frame_secs();
+		out.frame_duration_secs = this->video->get_frame_duration_secs();
+		out.has_audio = this->video->has_audio();
+		out.seeked = type == Request::Seek || type == Request::Scrub;
+		out.provisional = provisional;
+		publish();
+		Logger::get("render") << "rendered " << (provisional ? "provisional " : "") << "frame at " << out.frame_secs << "s for " << secs << "s\n";
+		// playback asks for another frame soon enough, only a seek is followed up
+		if (provisional && type != Request::Frame && this->follow_ups < max_follow_ups)
+			follow_up(secs, Request::Refine);
+	}
+}
+
+void Frame_Renderer::follow_up(float secs, Request type)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->request_mutex);
+		if (this->has_request)
+			return;
+		this->request_secs = secs;
+		this->request_type = type;
+		this->has_request = true;
+		this->request_follow_up = true;
+	}
+	this->request_condition.notify_one();
+}
+
+void Frame_Renderer::publish()
+{
+	int previous = this->ready.exchange(this->back | fresh_flag);
+	if (previous & fresh_flag)
+		this->frames_superseded += 1;
+	this->back = previous & ~fresh_flag;
+}
+
+const Rendered_Frame* Frame_Renderer::take()
+{
+	if (!(this->ready & fresh_flag))
+		return nullptr;
+	this->front = this->ready.exchange(this->front) & ~fresh_flag;
+	return &this->frames[this->front];
+}
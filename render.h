@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include "clip.h"
+
+class Audio_Output;
+
+struct Rendered_Frame {
+	AVFrame* frame = nullptr;
+	// timeline position the frame was asked for
+	float requested_secs = 0;
+	// timeline position of the frame that was actually decoded
+	float frame_secs = 0;
+	float frame_duration_secs = 0;
+	// whether the main track has audio for the clock to follow
+	bool has_audio = false;
+	// first frame after a seek
+	bool seeked = false;
+	// a stand-in until the exact frame is decoded, the keyframe a seek landed on or a nearby frame
+	// after a seek the refined frame follows without another request
+	bool provisional = false;
+};
+
+// evaluates the timeline, composites and converts frames on its own thread
+// so decode waits, filter setup and seeks never stall the UI
+// finished frames go through a triple buffer, the UI thread only picks up the newest one
+class Frame_Renderer {
+public:
+	// how long a request waits for the exact frame before a nearby one is shown instead
+	static const int frame_deadline_ms = 30;
+	// seeks show the keyframe they land on as soon as it's decoded, this only bounds the wait for it
+	static const int seek_deadline_ms = Decoder_Ctx::seek_wait_ms;
+	// how many times the renderer asks again by itself, to refine a provisional frame
+	// or for a scrub keyframe that wasn't decoded in time, before it gives up
+	static const int max_follow_ups = 10;
+
+	Frame_Renderer(Video* video, int width, int height);
+	~Frame_Renderer();
+
+	void start();
+	void stop();
+
+	// requests are latest-wins, a request that hasn't started yet is replaced
+	void request(float secs);
+	void seek(float secs);
+	// keyframes only until the next seek
+	void scrub(float secs);
+	// true from seek() until the render thread has moved the tracks, the audio clock is stale until then
+	bool is_seeking() const;
+	// flushed by the render thread once a seek has moved the tracks, so no pre-seek audio is mixed after it
+	// set under the video mutex
+	void set_audio_output(Audio_Output* audio_output);
+
+	// UI thread, returns the newest finished frame or nullptr if nothing new was rendered
+	// the frame stays valid until the next call
+	const Rendered_Frame* take();
+
+	// hold while editing tracks, the render thread holds it while it reads them
+	std::mutex& get_video_mutex();
+
+	// frames replaced by a newer one before the UI picked them up
+	int get_frames_superseded() const;
+
+protected:
+	Video* video;
+	int width;
+	int height;
+
+	std::thread render_thread;
+	bool stop_rendering = false;
+	// Refine is queued by the render thread after a provisional frame from a seek, it waits for the exact one
+	enum class Request { Frame, Seek, Scrub, Refine };
+	void render();
+	// asks again for secs, unless something newer was asked for meanwhile
+	void follow_up(float secs, Request type);
+
+	std::mutex video_mutex;
+	Audio_Output* audio_output = nullptr;
+
+	// pending request, guarded by request_mutex
+	std::mutex request_mutex;
+	std::condition_variable request_condition;
+	// render thread only
+	int follow_ups = 0;
+	bool has_request = false;
+	Request request_type = Request::Frame;
+	float request_secs = 0;
+	// queued by follow_up rather than the UI
+	bool request_follow_up = false;
+	// seek() counts up, the render thread catches up once the seek it took is done
+	std::atomic_int seeks_requested{0};
+	std::atomic_int seeks_done{0};
+
+	// triple buffer: the render thread owns back, the UI thread owns front,
+	// ready holds the newest finished frame plus fresh_flag if the UI hasn't taken it
+	static const int fresh_flag = 4;
+	Rendered_Frame frames[3];
+	int back = 0;
+	int front = 1;
+	std::atomic_int ready{2};
+	void publish();
+
+	std::atomic_int frames_superseded{0};
+};
@@ -0,0 +1,86 @@
+#include "resample.h"
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+}
+
+#include "logger.h"
+
+Audio_Resampler::~Audio_Resampler()
+{
+	free_contexts();
+}
+
+void Audio_Resampler::free_contexts()
+{
+	for (auto it = this->contexts.begin(); it != this->contexts.end(); it++)
+		swr_free(&it->second);
+	this->contexts.clear();
+	this->current = nullptr;
+}
+
+SwrContext* Audio_Resampler::get_context(const AVFrame* frame, Audio_Mixer* mixer)
+{
+	// cached contexts are only valid for one output format
+	if (mixer->get_sample_rate() != this->out_sample_rate || mixer->get_channels() != this->out_channels) {
+		free_contexts();
+		this->out_sample_rate = mixer->get_sample_rate();
+		this->out_channels = mixer->get_channels();
+	}
+
+	uint64_t channel_layout = frame->channel_layout;
+	if (channel_layout == 0)
+		channel_layout = av_get_default_channel_layout(frame->channels);
+	Format format(frame->format, frame->sample_rate, channel_layout);
+
+	auto it = this->contexts.find(format);
+	if (it != this->contexts.end()) {
+		// coming back to a format or after a reset, drop whatever it buffered before
+		if (it->second != this->current) {
+			swr_init(it->second);
+			this->current = it->second;
+		}
+		return it->second;
+	}
+
+	SwrContext* swr = swr_alloc_set_opts(nullptr,
+		av_get_default_channel_layout(this->out_channels), AV_SAMPLE_FMT_FLTP, this->out_sample_rate,
+		channel_layout, (enum AVSampleFormat) frame->format, frame->sample_rate,
+		0, nullptr);
+	int ret = swr == nullptr ? AVERROR(ENOMEM) : swr_init(swr);
+	if (ret < 0) {
+		Logger::get("error") << "Cannot set up resampler from " << av_get_sample_fmt_name((enum AVSampleFormat) frame->format) << " " << frame->sample_rate << "hz: " << av_err2str(ret) << "\n";
+		swr_free(&swr);
+		return nullptr;
+	}
+
+	Logger::get("audio") << "new resampler from " << av_get_sample_fmt_name((enum AVSampleFormat) frame->format) << " " << frame->sample_rate << "hz, " << this->contexts.size() + 1 << " cached\n";
+	this->contexts[format] = swr;
+	this->current = swr;
+	return swr;
+}
+
+void Audio_Resampler::reset()
+{
+	// initialized again when it's next used
+	this->current = nullptr;
+}
+
+int Audio_Resampler::convert(const AVFrame* frame, Audio_Mixer* mixer, int input)
+{
+	SwrContext* swr = get_context(frame, mixer);
+	if (swr == nullptr)
+		return AVERROR(EINVAL);
+
+	int max_samples = swr_get_out_samples(swr, frame->nb_samples);
+	float** planes = mixer->begin_write(input, max_samples);
+	int converted = swr_convert(swr, (uint8_t**) planes, max_samples, (const uint8_t**) frame->extended_data, frame->nb_samples);
+	if (converted < 0) {
+		Logger::get("error") << "Error while resampling audio: " << av_err2str(converted) << "\n";
+		mixer->end_write(input, 0);
+		return converted;
+	}
+
+	mixer->end_write(input, converted);
+	return 0;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <map>
+#include <tuple>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libswresample/swresample.h>
+}
+
+#include "mixer.h"
+
+// converts decoded audio to the mixer's float planar format
+// keeps one SwrContext per source format so a track moving between files doesn't rebuild anything,
+// the track resets it on every file change so a cached context starts clean
+class Audio_Resampler {
+public:
+	Audio_Resampler() {}
+	~Audio_Resampler();
+	Audio_Resampler(const Audio_Resampler&) = delete;
+	void operator=(const Audio_Resampler&) = delete;
+
+	// converts the whole frame straight into the mixer input's buffer
+	int convert(const AVFrame* frame, Audio_Mixer* mixer, int input);
+	// drops the samples the current context holds back, the next frame starts without them
+	void reset();
+
+protected:
+	// source sample format, sample rate, channel layout
+	typedef std::tuple<int, int, uint64_t> Format;
+
+	std::map<Format, SwrContext*> contexts;
+	SwrContext* current = nullptr;
+	int out_sample_rate = 0;
+	int out_channels = 0;
+
+	SwrContext* get_context(const AVFrame* frame, Audio_Mixer* mixer);
+	void free_contexts();
+};
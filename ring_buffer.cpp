@@ -0,0 +1,69 @@
+#include "ring_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+Ring_Buffer::Ring_Buffer(size_t capacity)
+{
+	this->capacity = 1;
+	while (this->capacity < capacity)
+		this->capacity <<= 1;
+	this->mask = this->capacity - 1;
+	this->buffer = new uint8_t[this->capacity];
+}
+
+Ring_Buffer::~Ring_Buffer()
+{
+	delete[] this->buffer;
+}
+
+size_t Ring_Buffer::get_capacity() const
+{
+	return this->capacity;
+}
+
+size_t Ring_Buffer::read_available() const
+{
+	return this->write_count.load(std::memory_order_acquire) - this->read_count.load(std::memory_order_relaxed);
+}
+
+size_t Ring_Buffer::write_available() const
+{
+	return this->capacity - (this->write_count.load(std::memory_order_relaxed) - this->read_count.load(std::memory_order_acquire));
+}
+
+size_t Ring_Buffer::write(const uint8_t* data, size_t size)
+{
+	size_t write_pos = this->write_count.load(std::memory_order_relaxed);
+	size = std::min(size, write_available());
+
+	// copy in up to two pieces when wrapping around the end
+	size_t start = write_pos & this->mask;
+	size_t first = std::min(size, this->capacity - start);
+	memcpy(&this->buffer[start], data, first);
+	memcpy(this->buffer, &data[first], size - first);
+
+	// publish the bytes only after they're written
+	this->write_count.store(write_pos + size, std::memory_order_release);
+	return size;
+}
+
+size_t Ring_Buffer::read(uint8_t* data, size_t size)
+{
+	size_t read_pos = this->read_count.load(std::memory_order_relaxed);
+	size = std::min(size, read_available());
+
+	size_t start = read_pos & this->mask;
+	size_t first = std::min(size, this->capacity - start);
+	memcpy(data, &this->buffer[start], first);
+	memcpy(&data[first], this->buffer, size - first);
+
+	// hand the space back only after it's been copied out
+	this->read_count.store(read_pos + size, std::memory_order_release);
+	return size;
+}
+
+void Ring_Buffer::discard()
+{
+	this->read_count.store(this->write_count.load(std::memory_order_acquire), std::memory_order_release);
+}
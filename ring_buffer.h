@@ -0,0 +1,35 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// lock-free byte ring for exactly one producer thread and one consumer thread
+class Ring_Buffer {
+public:
+	// capacity is rounded up to a power of two
+	explicit Ring_Buffer(size_t capacity);
+	~Ring_Buffer();
+	Ring_Buffer(const Ring_Buffer&) = delete;
+	void operator=(const Ring_Buffer&) = delete;
+
+	size_t get_capacity() const;
+	size_t read_available() const;
+	size_t write_available() const;
+
+	// producer only, returns how many bytes fit
+	size_t write(const uint8_t* data, size_t size);
+	// consumer only, returns how many bytes were read
+	size_t read(uint8_t* data, size_t size);
+	// consumer only, drops everything written so far
+	void discard();
+
+protected:
+	uint8_t* buffer;
+	size_t capacity;
+	size_t mask;
+
+	// free-running counters, positions are taken modulo capacity
+	std::atomic<size_t> read_count{0};
+	std::atomic<size_t> write_count{0};
+};
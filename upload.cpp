@@ -0,0 +1,489 @@
+#include "upload.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "logger.h"
+
+/*********************
+ * Mapped_Frame_Pool *
+ *********************/
+bool Mapped_Frame_Pool::is_supported()
+{
+	return GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+}
+
+Mapped_Frame_Pool::Mapped_Frame_Pool()
+{
+	for (int i = 0; i < num_slots; ++i) {
+		Mapped_Slot* slot = new Mapped_Slot();
+		slot->pool = this;
+		this->slots.push_back(slot);
+	}
+}
+
+// frames still referencing a slot must be freed before the pool
+Mapped_Frame_Pool::~Mapped_Frame_Pool()
+{
+	for (auto slot : this->slots) {
+		reallocate(slot, 0);
+		delete slot;
+	}
+}
+
+void Mapped_Frame_Pool::reallocate(Mapped_Slot* slot, int size)
+{
+	if (slot->fence != nullptr) {
+		glDeleteSync(slot->fence);
+		slot->fence = nullptr;
+	}
+	if (slot->buffer != 0) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->buffer);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &slot->buffer);
+		slot->buffer = 0;
+		slot->data = nullptr;
+		slot->size = 0;
+	}
+	if (size == 0)
+		return;
+
+	// decoders read reference frames back, so ask for cached client memory rather than write-combined
+	GLbitfield access = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(1, &slot->buffer);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->buffer);
+	glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, access | GL_CLIENT_STORAGE_BIT);
+	slot->data = (uint8_t*) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, access);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (slot->data == nullptr) {
+		Logger::get("error") << "unable to map frame pool buffer of " << size << " bytes\n";
+		glDeleteBuffers(1, &slot->buffer);
+		slot->buffer = 0;
+		return;
+	}
+	slot->size = size;
+}
+
+void Mapped_Frame_Pool::recycle()
+{
+	std::lock_guard<std::mutex> lock(this->slots_mutex);
+	for (auto slot : this->slots) {
+		if (slot->state == Mapped_Slot::State::Released) {
+			if (slot->fence != nullptr) {
+				GLenum status = glClientWaitSync(slot->fence, 0, 0);
+				if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+					continue;
+				glDeleteSync(slot->fence);
+				slot->fence = nullptr;
+			}
+			slot->state = Mapped_Slot::State::Free;
+		}
+
+		// grow free slots when a decoder opened a bigger file
+		if (slot->state == Mapped_Slot::State::Free && slot->size < this->wanted_size) {
+			Logger::get("upload") << "allocating " << this->wanted_size << " byte frame pool buffer\n";
+			reallocate(slot, this->wanted_size);
+		}
+	}
+}
+
+int Mapped_Frame_Pool::get_buffer(AVCodecContext* codec_ctx, AVFrame* frame)
+{
+	enum AVPixelFormat format = (enum AVPixelFormat) frame->format;
+	if (format != AV_PIX_FMT_YUV420P && format != AV_PIX_FMT_YUVJ420P)
+		return AVERROR(ENOSYS);
+
+	// pad the same way the default allocator does
+	int width = frame->width;
+	int height = frame->height;
+	int linesize_align[AV_NUM_DATA_POINTERS];
+	avcodec_align_dimensions2(codec_ctx, &width, &height, linesize_align);
+
+	int linesizes[4];
+	int ret = av_image_fill_linesizes(linesizes, format, (width + 127) & ~127);
+	if (ret < 0)
+		return ret;
+
+	int offsets[3];
+	int size = 0;
+	for (int plane = 0; plane < 3; ++plane) {
+		int plane_height = plane == 0 ? height : (height + 1) / 2;
+		offsets[plane] = size;
+		size += (linesizes[plane] * plane_height + 63) & ~63;
+	}
+	// decoders may read a little past the last line
+	size += 64;
+
+	std::lock_guard<std::mutex> lock(this->slots_mutex);
+	auto slot_it = std::find_if(this->slots.begin(), this->slots.end(), [size](const Mapped_Slot* slot) {
+		return slot->state == Mapped_Slot::State::Free && slot->size >= size;
+	});
+	if (slot_it == this->slots.end()) {
+		this->wanted_size = std::max(this->wanted_size, size);
+		return AVERROR(EAGAIN);
+	}
+	Mapped_Slot* slot = *slot_it;
+
+	frame->buf[0] = av_buffer_create(slot->data, size, &Mapped_Frame_Pool::release_buffer, slot, 0);
+	if (frame->buf[0] == nullptr)
+		return AVERROR(ENOMEM);
+	slot->state = Mapped_Slot::State::Decoding;
+
+	for (int plane = 0; plane < 3; ++plane) {
+		frame->data[plane] = slot->data + offsets[plane];
+		frame->linesize[plane] = linesizes[plane];
+	}
+	frame->extended_data = frame->data;
+	return 0;
+}
+
+void Mapped_Frame_Pool::release_buffer(void* opaque, uint8_t*)
+{
+	Mapped_Slot* slot = (Mapped_Slot*) opaque;
+	std::lock_guard<std::mutex> lock(slot->pool->slots_mutex);
+	slot->state = Mapped_Slot::State::Released;
+}
+
+Mapped_Slot* Mapped_Frame_Pool::get_slot(const AVFrame* frame) const
+{
+	if (frame->buf[0] == nullptr)
+		return nullptr;
+	Mapped_Slot* slot = (Mapped_Slot*) av_buffer_get_opaque(frame->buf[0]);
+	if (std::find(this->slots.begin(), this->slots.end(), slot) == this->slots.end())
+		return nullptr;
+	return slot;
+}
+
+bool Mapped_Frame_Pool::owns(const AVFrame* frame) const
+{
+	return get_slot(frame) != nullptr;
+}
+
+void Mapped_Frame_Pool::mark_read(Mapped_Slot* slot)
+{
+	std::lock_guard<std::mutex> lock(this->slots_mutex);
+	if (slot->fence != nullptr)
+		glDeleteSync(slot->fence);
+	slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+/********************
+ * Texture_Uploader *
+ ********************/
+Texture_Uploader::Texture_Uploader(GLuint texture, int width, int height)
+{
+	this->texture = texture;
+	this->width = width;
+	this->height = height;
+	this->frame_size = width * height * 3;
+
+	glGenBuffers(ring_size, this->pbos);
+	for (int i = 0; i < ring_size; ++i) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbos[i]);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, this->frame_size, nullptr, GL_STREAM_DRAW);
+		this->fences[i] = nullptr;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+Texture_Uploader::~Texture_Uploader()
+{
+	for (int i = 0; i < ring_size; ++i)
+		if (this->fences[i] != nullptr)
+			glDeleteSync(this->fences[i]);
+	glDeleteBuffers(ring_size, this->pbos);
+
+	av_frame_free(&this->pending_direct_frame);
+	if (this->program != 0) {
+		glDeleteTextures(3, this->plane_textures);
+		glDeleteFramebuffers(1, &this->framebuffer);
+		glDeleteVertexArrays(1, &this->vertex_array);
+		glDeleteProgram(this->program);
+	}
+}
+
+static const char* yuv_vertex_shader =
+	"#version 150\n"
+	"out vec2 uv;\n"
+	"void main() {\n"
+	"	vec2 pos = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+	"	uv = pos;\n"
+	"	gl_Position = vec4(pos * 2.0 - 1.0, 0.0, 1.0);\n"
+	"}\n";
+
+// bt.601, which is what the filter graph's rgb24 conversion assumes too
+static const char* yuv_fragment_shader =
+	"#version 150\n"
+	"uniform sampler2D plane_y;\n"
+	"uniform sampler2D plane_u;\n"
+	"uniform sampler2D plane_v;\n"
+	"uniform int full_range;\n"
+	"in vec2 uv;\n"
+	"out vec4 color;\n"
+	"void main() {\n"
+	"	float y = texture(plane_y, uv).r;\n"
+	"	float u = texture(plane_u, uv).r - 0.5;\n"
+	"	float v = texture(plane_v, uv).r - 0.5;\n"
+	"	if (full_range == 0) {\n"
+	"		y = (y - 16.0 / 255.0) * 255.0 / 219.0;\n"
+	"		u = u * 255.0 / 224.0;\n"
+	"		v = v * 255.0 / 224.0;\n"
+	"	}\n"
+	"	color = vec4(y + 1.402 * v, y - 0.344136 * u - 0.714136 * v, y + 1.772 * u, 1.0);\n"
+	"}\n";
+
+static GLuint compile_shader(GLenum type, const char* source)
+{
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, nullptr);
+	glCompileShader(shader);
+
+	GLint status;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (status != GL_TRUE) {
+		char log[512];
+		glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+		Logger::get("error") << "unable to compile yuv shader: " << log << "\n";
+		glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+int Texture_Uploader::init_converter()
+{
+	GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, yuv_vertex_shader);
+	GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, yuv_fragment_shader);
+	if (vertex_shader == 0 || fragment_shader == 0)
+		return -1;
+
+	this->program = glCreateProgram();
+	glAttachShader(this->program, vertex_shader);
+	glAttachShader(this->program, fragment_shader);
+	glLinkProgram(this->program);
+	glDeleteShader(vertex_shader);
+	glDeleteShader(fragment_shader);
+
+	GLint status;
+	glGetProgramiv(this->program, GL_LINK_STATUS, &status);
+	if (status != GL_TRUE) {
+		Logger::get("error") << "unable to link yuv shader\n";
+		glDeleteProgram(this->program);
+		this->program = 0;
+		return -1;
+	}
+
+	glUseProgram(this->program);
+	glUniform1i(glGetUniformLocation(this->program, "plane_y"), 0);
+	glUniform1i(glGetUniformLocation(this->program, "plane_u"), 1);
+	glUniform1i(glGetUniformLocation(this->program, "plane_v"), 2);
+	this->full_range_location = glGetUniformLocation(this->program, "full_range");
+	glUseProgram(0);
+
+	glGenTextures(3, this->plane_textures);
+	for (int plane = 0; plane < 3; ++plane) {
+		glBindTexture(GL_TEXTURE_2D, this->plane_textures[plane]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		this->plane_widths[plane] = 0;
+		this->plane_heights[plane] = 0;
+	}
+
+	glGenFramebuffers(1, &this->framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, this->framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, this->texture, 0);
+	GLenum fb_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if (fb_status != GL_FRAMEBUFFER_COMPLETE) {
+		Logger::get("error") << "preview texture can't be rendered to, status " << fb_status << "\n";
+		return -1;
+	}
+
+	// core profile won't draw without a vertex array, even an empty one
+	glGenVertexArrays(1, &this->vertex_array);
+	return 0;
+}
+
+bool Texture_Uploader::set_frame_pool(Mapped_Frame_Pool* pool)
+{
+	if (pool != nullptr && this->program == 0 && init_converter() < 0) {
+		Logger::get("error") << "zero-copy frame upload disabled\n";
+		return false;
+	}
+	this->frame_pool = pool;
+	return true;
+}
+
+// planes are read straight out of the pool's PBO, then scaled and converted into the preview texture
+void Texture_Uploader::draw_direct(const AVFrame* frame)
+{
+	Mapped_Slot* slot = this->frame_pool->get_slot(frame);
+	if (slot == nullptr)
+		return;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->buffer);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (int plane = 0; plane < 3; ++plane) {
+		int plane_width = plane == 0 ? frame->width : (frame->width + 1) / 2;
+		int plane_height = plane == 0 ? frame->height : (frame->height + 1) / 2;
+		const void* offset = (const void*) (frame->data[plane] - slot->data);
+
+		glBindTexture(GL_TEXTURE_2D, this->plane_textures[plane]);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, frame->linesize[plane]);
+		if (this->plane_widths[plane] != plane_width || this->plane_heights[plane] != plane_height) {
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, plane_width, plane_height, 0, GL_RED, GL_UNSIGNED_BYTE, offset);
+			this->plane_widths[plane] = plane_width;
+			this->plane_heights[plane] = plane_height;
+		} else {
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, plane_width, plane_height, GL_RED, GL_UNSIGNED_BYTE, offset);
+		}
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	this->frame_pool->mark_read(slot);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, this->framebuffer);
+	glViewport(0, 0, this->width, this->height);
+	glDisable(GL_BLEND);
+	glDisable(GL_SCISSOR_TEST);
+	glUseProgram(this->program);
+	glUniform1i(this->full_range_location, frame->format == AV_PIX_FMT_YUVJ420P);
+	glBindVertexArray(this->vertex_array);
+	for (int plane = 0; plane < 3; ++plane) {
+		glActiveTexture(GL_TEXTURE0 + plane);
+		glBindTexture(GL_TEXTURE_2D, this->plane_textures[plane]);
+	}
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindVertexArray(0);
+	glUseProgram(0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+float Texture_Uploader::elapsed_ms(clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::duration<float, std::milli>>(clock::now() - start).count();
+}
+
+const Upload_Stats& Texture_Uploader::get_stats() const
+{
+	return this->stats;
+}
+
+// a PBO is free once the GPU has finished the transfer that last read from it
+bool Texture_Uploader::is_pbo_free(int index)
+{
+	GLsync fence = this->fences[index];
+	if (fence == nullptr)
+		return true;
+
+	GLenum status = glClientWaitSync(fence, 0, 0);
+	if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+		return false;
+
+	glDeleteSync(fence);
+	this->fences[index] = nullptr;
+	return true;
+}
+
+void Texture_Uploader::flush()
+{
+	if (this->frame_pool != nullptr)
+		this->frame_pool->recycle();
+
+	if (this->pending_direct_frame != nullptr) {
+		auto start = clock::now();
+		draw_direct(this->pending_direct_frame);
+		av_frame_free(&this->pending_direct_frame);
+
+		stats.last_submit_ms = elapsed_ms(start);
+		stats.avg_submit_ms = 0.9f * stats.avg_submit_ms + 0.1f * stats.last_submit_ms;
+		Logger::get("upload") << "drew pooled frame to texture in " << stats.last_submit_ms << "ms\n";
+		return;
+	}
+
+	if (this->pending_pbo == -1)
+		return;
+
+	auto start = clock::now();
+
+	// with a PBO bound the data pointer is an offset, so this returns without waiting for the copy
+	glBindTexture(GL_TEXTURE_2D, this->texture);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbos[this->pending_pbo]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, this->width, this->height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	this->fences[this->pending_pbo] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	this->pending_pbo = -1;
+
+	stats.last_submit_ms = elapsed_ms(start);
+	stats.avg_submit_ms = 0.9f * stats.avg_submit_ms + 0.1f * stats.last_submit_ms;
+	Logger::get("upload") << "submitted pbo to texture in " << stats.last_submit_ms << "ms\n";
+}
+
+bool Texture_Uploader::upload(const AVFrame* frame)
+{
+	// decoded straight into a PBO, hold a reference until it's drawn
+	if (this->frame_pool != nullptr && this->frame_pool->owns(frame)) {
+		if (this->pending_direct_frame == nullptr)
+			this->pending_direct_frame = av_frame_alloc();
+		av_frame_unref(this->pending_direct_frame);
+		av_frame_ref(this->pending_direct_frame, frame);
+		this->pending_pbo = -1;
+		stats.frames_uploaded += 1;
+		stats.last_copy_ms = 0;
+		stats.avg_copy_ms = 0.9f * stats.avg_copy_ms;
+		return true;
+	}
+
+	if (frame->width != this->width || frame->height != this->height || frame->format != AV_PIX_FMT_RGB24) {
+		Logger::get("error") << "uploader expects " << this->width << "x" << this->height << " rgb24 frames, got " << frame->width << "x" << frame->height << "\n";
+		return false;
+	}
+
+	auto start = clock::now();
+
+	// a newer frame replaces one that hasn't been submitted yet
+	int index = this->pending_pbo != -1 ? this->pending_pbo : this->next_pbo;
+	if (!is_pbo_free(index)) {
+		stats.frames_skipped += 1;
+		Logger::get("upload") << "all pbos busy, skipping frame with pts " << frame->pts << "\n";
+		return false;
+	}
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbos[index]);
+	// synchronization is handled by the fences
+	GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+	uint8_t* dest = (uint8_t*) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, this->frame_size, access);
+	if (dest == nullptr) {
+		Logger::get("error") << "unable to map pixel buffer " << index << "\n";
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return false;
+	}
+
+	int row_size = this->width * 3;
+	if (frame->linesize[0] == row_size) {
+		memcpy(dest, frame->data[0], this->frame_size);
+	} else {
+		for (int y = 0; y < this->height; ++y)
+			memcpy(&dest[y * row_size], &frame->data[0][y * frame->linesize[0]], row_size);
+	}
+
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	av_frame_free(&this->pending_direct_frame);
+	this->pending_pbo = index;
+	if (index == this->next_pbo)
+		this->next_pbo = (this->next_pbo + 1) % ring_size;
+
+	stats.frames_uploaded += 1;
+	stats.last_copy_ms = elapsed_ms(start);
+	stats.avg_copy_ms = 0.9f * stats.avg_copy_ms + 0.1f * stats.last_copy_ms;
+	Logger::get("upload") << "copied frame with pts " << frame->pts << " to pbo " << index << " in " << stats.last_copy_ms << "ms\n";
+	return true;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include <GL/glew.h>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include "common.h"
+
+struct Upload_Stats {
+	// time spent on the UI thread writing a frame into mapped PBO memory
+	float last_copy_ms = 0;
+	float avg_copy_ms = 0;
+	// time spent on the UI thread issuing the PBO -> texture transfer
+	float last_submit_ms = 0;
+	float avg_submit_ms = 0;
+	int frames_uploaded = 0;
+	// frames dropped because every PBO was still being read by the GPU
+	int frames_skipped = 0;
+};
+
+class Mapped_Frame_Pool;
+
+struct Mapped_Slot {
+	enum class State { Free, Decoding, Released };
+
+	Mapped_Frame_Pool* pool;
+	GLuint buffer = 0;
+	uint8_t* data = nullptr;
+	int size = 0;
+	// set when the GPU last read from the slot, the slot can't be reused until it signals
+	GLsync fence = nullptr;
+	State state = State::Free;
+};
+
+// decoder frame memory backed by persistently mapped pixel buffer objects
+// so decoded planes can be uploaded to textures without a CPU copy
+// buffers are created on the GL thread in recycle(), handed out on decoding threads
+class Mapped_Frame_Pool : public Frame_Pool {
+public:
+	static const int num_slots = 32;
+
+	// needs GL 4.4 or ARB_buffer_storage
+	static bool is_supported();
+
+	Mapped_Frame_Pool();
+	virtual ~Mapped_Frame_Pool();
+
+	int get_buffer(AVCodecContext* codec_ctx, AVFrame* frame) override;
+	bool owns(const AVFrame* frame) const override;
+
+	// GL thread only
+	void recycle();
+	Mapped_Slot* get_slot(const AVFrame* frame) const;
+	void mark_read(Mapped_Slot* slot);
+
+protected:
+	std::mutex slots_mutex;
+	std::vector<Mapped_Slot*> slots;
+	// largest buffer a decoder has asked for
+	int wanted_size = 0;
+
+	void reallocate(Mapped_Slot* slot, int size);
+	static void release_buffer(void* opaque, uint8_t* data);
+};
+
+// uploads rgb24 frames to a texture through a ring of pixel buffer objects
+// upload() only copies into mapped PBO memory, the texture is updated from that
+// PBO on the next flush() so the driver copy happens asynchronously
+class Texture_Uploader {
+public:
+	static const int ring_size = 3;
+
+	Texture_Uploader(GLuint texture, int width, int height);
+	~Texture_Uploader();
+
+	// submits the frame filled by the last upload() to the texture
+	// call once per UI frame, before upload()
+	void flush();
+	// copies the frame into the next free PBO, returns false if it was dropped
+	// yuv420p frames from the frame pool are converted on the GPU instead
+	bool upload(const AVFrame* frame);
+
+	// returns false if the GPU conversion path couldn't be set up
+	bool set_frame_pool(Mapped_Frame_Pool* pool);
+
+	const Upload_Stats& get_stats() const;
+
+protected:
+	typedef std::chrono::high_resolution_clock clock;
+
+	GLuint texture;
+	int width;
+	int height;
+	int frame_size;
+
+	GLuint pbos[ring_size];
+	GLsync fences[ring_size];
+	int next_pbo = 0;
+	int pending_pbo = -1;
+
+	Upload_Stats stats;
+
+	// zero-copy path for frames decoded into the frame pool
+	Mapped_Frame_Pool* frame_pool = nullptr;
+	AVFrame* pending_direct_frame = nullptr;
+	GLuint plane_textures[3];
+	int plane_widths[3];
+	int plane_heights[3];
+	GLuint framebuffer = 0;
+	GLuint program = 0;
+	GLuint vertex_array = 0;
+	GLint full_range_location = -1;
+
+	int init_converter();
+	void draw_direct(const AVFrame* frame);
+
+	bool is_pbo_free(int index);
+	static float elapsed_ms(clock::time_point start);
+};